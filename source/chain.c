@@ -0,0 +1,518 @@
+/* chain readers: read ahead along a FAT chain, keeping up to a queue
+   depth of cluster reads in flight, or for mapped images asking the
+   kernel to fault in the clusters before they're touched */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "chain.h"
+
+/* reads in flight per chain; DOS_IO_DEPTH overrides it */
+#define CHAIN_DEFAULT_DEPTH 16
+
+/* for mapped images, the prefetch window starts at PREFETCH_MIN
+   clusters and doubles each time it's topped up, up to DOS_IO_PREFETCH
+   clusters (0 turns prefetching off) */
+#define PREFETCH_MIN 4
+#define PREFETCH_DEFAULT_MAX 64
+/* clusters of each subdirectory to prefetch ahead of a traversal */
+#define PREFETCH_DIR_CLUSTERS 4
+
+#define ENGINE_MMAP 0
+#define ENGINE_URING 1
+#define ENGINE_PREAD 2
+#define ENGINE_COPY 3
+
+#define SLOT_FREE 0
+#define SLOT_IN_FLIGHT 1
+#define SLOT_DONE 2
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+struct chain_slot {
+    uint8_t *buf;
+    uint16_t cluster;
+    int state;
+    int res;
+    struct iovec iov;
+};
+
+struct chain_reader {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t clust_size;
+    uint32_t limit;		/* first cluster past the end of the disk */
+    int engine;
+    int depth;
+    struct chain_slot *slots;
+    uint8_t *pool;		/* depth buffers of clust_size bytes */
+    uint16_t next;		/* next cluster to issue a read for */
+    uint32_t remaining;		/* clusters still wanted */
+    long issued, consumed;
+    uint16_t pf_next;		/* next cluster to prefetch */
+    long pf_issued;		/* clusters prefetched so far */
+    int pf_depth, pf_max;
+    int have_ring;
+    struct uring ring;
+};
+
+/* ------------------------------------------------------------------ */
+/* a minimal io_uring, driven with the raw system calls so there's no
+   library to depend on */
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+	return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (r->cq_len > r->sq_len)
+	    r->sq_len = r->cq_len;
+	r->cq_len = r->sq_len;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	r->cq_ptr = r->sq_ptr;
+    } else {
+	r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED
+	|| r->sqes == MAP_FAILED) {
+	if (r->sqes != MAP_FAILED)
+	    munmap(r->sqes, r->sqes_len);
+	if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+	    munmap(r->cq_ptr, r->cq_len);
+	if (r->sq_ptr != MAP_FAILED)
+	    munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	return -1;
+    }
+
+    r->sq_head = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((uint8_t*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((uint8_t*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((uint8_t*)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+	munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+/* uring_queue_readv adds a read to the submission queue; it's not
+   submitted until uring_enter */
+static void uring_queue_readv(struct uring *r, int fd, struct iovec *iov,
+			      uint64_t offset, uint64_t user_data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = 1;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(struct uring *r, unsigned submit, unsigned wait)
+{
+    int ret;
+    do {
+	ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+		      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/* ------------------------------------------------------------------ */
+
+static int valid_cluster(struct chain_reader *cr, uint16_t cluster)
+{
+    return cluster >= CLUST_FIRST && cluster < cr->limit;
+}
+
+static uint64_t cluster_offset(uint16_t cluster, uint8_t *image_buf,
+			       struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+    return g->data_offset + (uint64_t)(cluster - CLUST_FIRST) * g->clust_bytes;
+}
+
+/* prefetch_run asks the kernel to start reading n contiguous clusters
+   from first: through the mapping if the whole image is mapped, or
+   into the page cache if the backend reads the file as it stands */
+static void prefetch_run(uint16_t first, uint32_t n, uint8_t *image_buf,
+			 struct bpb33* bpb)
+{
+    uint64_t offset = cluster_offset(first, image_buf, bpb);
+    uint64_t len = (uint64_t)n * bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *start;
+
+    if (io_current == NULL || io_current->ops == &io_mmap_backend
+	|| io_current->ops == &io_preview_backend) {
+	start = (uint8_t*)((uintptr_t)(image_buf + offset) & ~(page - 1));
+	madvise(start, image_buf + offset + len - start, MADV_WILLNEED);
+    } else if (io_current->ops == &io_pread_backend
+	       || io_current->ops == &io_window_backend) {
+	readahead(io_current->fd, offset, len);
+    }
+    /* compressed images have their own chunk cache */
+}
+
+/* prefetch_chain prefetches up to n clusters of the chain from start,
+   a run of contiguous clusters at a time; it returns the cluster after
+   the last one it prefetched */
+static uint16_t prefetch_chain(uint16_t start, uint32_t n, uint32_t limit,
+			       uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t first = start, cluster = start, next;
+    uint32_t run = 0;
+
+    while (n > 0 && cluster >= CLUST_FIRST && cluster < limit) {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	run++;
+	n--;
+	if (next != cluster + 1 || n == 0) {
+	    prefetch_run(first, run, image_buf, bpb);
+	    first = next;
+	    run = 0;
+	}
+	cluster = next;
+    }
+    if (run > 0)
+	prefetch_run(first, run, image_buf, bpb);
+    return cluster;
+}
+
+/* top_up_prefetch keeps the prefetch window ahead of the consumer,
+   growing it while the chain goes on */
+static void top_up_prefetch(struct chain_reader *cr)
+{
+    long want;
+
+    if (cr->pf_max == 0)
+	return;
+    if (cr->pf_issued < cr->consumed) {
+	/* catch up with the consumer */
+	cr->pf_next = cr->next;
+	cr->pf_issued = cr->consumed;
+    }
+    if (cr->pf_issued - cr->consumed >= cr->pf_depth / 2)
+	return;
+    want = cr->consumed + cr->pf_depth - cr->pf_issued;
+    if (want > cr->remaining - (cr->pf_issued - cr->consumed))
+	want = cr->remaining - (cr->pf_issued - cr->consumed);
+    if (want <= 0)
+	return;
+    cr->pf_next = prefetch_chain(cr->pf_next, want, cr->limit,
+				 cr->image_buf, cr->bpb);
+    cr->pf_issued += want;
+    cr->pf_depth *= 2;
+    if (cr->pf_depth > cr->pf_max)
+	cr->pf_depth = cr->pf_max;
+}
+
+/* issue starts reads for the next clusters in the chain, until depth
+   reads are outstanding or the chain ends */
+static void issue(struct chain_reader *cr)
+{
+    struct chain_slot *slot;
+    unsigned queued = 0;
+
+    while (cr->issued - cr->consumed < cr->depth && cr->remaining > 0
+	   && valid_cluster(cr, cr->next)) {
+	slot = &cr->slots[cr->issued % cr->depth];
+	slot->cluster = cr->next;
+	slot->state = SLOT_IN_FLIGHT;
+	if (cr->engine == ENGINE_URING) {
+	    slot->iov.iov_base = slot->buf;
+	    slot->iov.iov_len = cr->clust_size;
+	    uring_queue_readv(&cr->ring, io_current->fd, &slot->iov,
+			      cluster_offset(slot->cluster, cr->image_buf,
+					     cr->bpb),
+			      cr->issued % cr->depth);
+	    queued++;
+	}
+	cr->issued++;
+	cr->remaining--;
+	cr->next = get_fat_entry(cr->next, cr->image_buf, cr->bpb);
+    }
+    if (queued > 0 && uring_enter(&cr->ring, queued, 0) < 0) {
+	/* the reads never went in; do them synchronously instead */
+	cr->engine = ENGINE_PREAD;
+    }
+}
+
+/* complete waits until the slot's read has finished */
+static void complete(struct chain_reader *cr, struct chain_slot *slot)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    ssize_t n;
+    size_t done;
+
+    while (cr->engine == ENGINE_URING && slot->state == SLOT_IN_FLIGHT) {
+	head = *cr->ring.cq_head;
+	if (head == __atomic_load_n(cr->ring.cq_tail, __ATOMIC_ACQUIRE)) {
+	    if (uring_enter(&cr->ring, 0, 1) < 0)
+		cr->engine = ENGINE_PREAD;
+	    continue;
+	}
+	cqe = &cr->ring.cqes[head & *cr->ring.cq_mask];
+	cr->slots[cqe->user_data].res = cqe->res;
+	cr->slots[cqe->user_data].state = SLOT_DONE;
+	__atomic_store_n(cr->ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+
+    if (slot->state == SLOT_DONE && slot->res >= 0) {
+	/* a short read only happens at the end of the image */
+	if (slot->res < cr->clust_size)
+	    memset(slot->buf + slot->res, 0, cr->clust_size - slot->res);
+	return;
+    }
+
+    /* no io_uring, or the read failed: read it the simple way */
+    for (done = 0; done < cr->clust_size; done += n) {
+	n = pread(io_current->fd, slot->buf + done, cr->clust_size - done,
+		  cluster_offset(slot->cluster, cr->image_buf, cr->bpb)
+		  + done);
+	if (n < 0 && errno == EINTR) {
+	    n = 0;
+	    continue;
+	}
+	if (n < 0) {
+	    fprintf(stderr, "Read from disk image failed: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+	if (n == 0) {
+	    memset(slot->buf + done, 0, cr->clust_size - done);
+	    break;
+	}
+    }
+    slot->state = SLOT_DONE;
+}
+
+/* chain_open starts reading the chain from start.  At most
+   max_clusters are read, or the whole chain if it's 0. */
+struct chain_reader *chain_open(uint16_t start, uint32_t max_clusters,
+				uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct chain_reader *cr;
+    char *env;
+    int i;
+
+    cr = calloc(1, sizeof(struct chain_reader));
+    cr->image_buf = image_buf;
+    cr->bpb = bpb;
+    cr->clust_size = geometry(bpb)->clust_bytes;
+    cr->limit = geometry(bpb)->clusters;
+    cr->next = start;
+    cr->remaining = max_clusters > 0 ? max_clusters : cr->limit;
+    cr->pf_depth = PREFETCH_MIN;
+    cr->pf_max = PREFETCH_DEFAULT_MAX;
+    env = getenv("DOS_IO_PREFETCH");
+    if (env != NULL)
+	cr->pf_max = atoi(env);
+    if (cr->pf_depth > cr->pf_max)
+	cr->pf_depth = cr->pf_max;
+
+    if (io_current == NULL || io_current->meta_len >= io_current->size) {
+	/* the whole image is mapped, so reading ahead is up to the
+	   kernel, with hints from top_up_prefetch */
+	cr->engine = ENGINE_MMAP;
+	return cr;
+    }
+
+    if (io_current->ops != &io_pread_backend) {
+	/* only the backend knows how to decode the file, so copy the
+	   clusters out of it one at a time */
+	cr->engine = ENGINE_COPY;
+	cr->pool = malloc(cr->clust_size);
+	return cr;
+    }
+
+    /* reads go straight to the file, so write back the cache first */
+    if (io_current->ops->flush(io_current) < 0) {
+	fprintf(stderr, "Write to disk image failed: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    cr->depth = CHAIN_DEFAULT_DEPTH;
+    env = getenv("DOS_IO_DEPTH");
+    if (env != NULL && atoi(env) > 0)
+	cr->depth = atoi(env);
+    if (cr->depth > cr->remaining)
+	cr->depth = cr->remaining;
+    if (cr->depth < 1)
+	cr->depth = 1;
+
+    cr->slots = calloc(cr->depth, sizeof(struct chain_slot));
+    cr->pool = malloc((size_t)cr->depth * cr->clust_size);
+    for (i = 0; i < cr->depth; i++)
+	cr->slots[i].buf = cr->pool + (size_t)i * cr->clust_size;
+
+    cr->engine = ENGINE_PREAD;
+    if (getenv("DOS_IO_NO_URING") == NULL
+	&& uring_init(&cr->ring, cr->depth) == 0) {
+	cr->engine = ENGINE_URING;
+	cr->have_ring = TRUE;
+    }
+    return cr;
+}
+
+/* chain_next returns the data of the next cluster of the chain, and
+   sets *cluster to its number, or returns NULL at the end */
+uint8_t *chain_next(struct chain_reader *cr, uint16_t *cluster)
+{
+    struct chain_slot *slot;
+    uint16_t c;
+
+    if (cr->engine == ENGINE_MMAP || cr->engine == ENGINE_COPY) {
+	c = cr->next;
+	if (cr->remaining == 0 || !valid_cluster(cr, c))
+	    return NULL;
+	cr->remaining--;
+	cr->next = get_fat_entry(c, cr->image_buf, cr->bpb);
+	cr->consumed++;
+	top_up_prefetch(cr);
+	*cluster = c;
+	if (cr->engine == ENGINE_MMAP)
+	    return cluster_to_addr(c, cr->image_buf, cr->bpb);
+	memcpy(cr->pool, cluster_to_addr(c, cr->image_buf, cr->bpb),
+	       cr->clust_size);
+	return cr->pool;
+    }
+
+    /* the previous buffer is finished with, so its slot can be reused */
+    issue(cr);
+    if (cr->consumed == cr->issued)
+	return NULL;
+    slot = &cr->slots[cr->consumed % cr->depth];
+    complete(cr, slot);
+    cr->consumed++;
+    *cluster = slot->cluster;
+    return slot->buf;
+}
+
+void chain_close(struct chain_reader *cr)
+{
+    struct chain_slot *slot;
+
+    if (cr->engine == ENGINE_URING) {
+	/* the kernel may still be writing into the pool */
+	while (cr->consumed < cr->issued) {
+	    slot = &cr->slots[cr->consumed % cr->depth];
+	    complete(cr, slot);
+	    cr->consumed++;
+	}
+    }
+    if (cr->have_ring)
+	uring_exit(&cr->ring);
+    free(cr->slots);
+    free(cr->pool);
+    free(cr);
+}
+
+/* chain_prefetch_dirs prefetches the first clusters of every
+   subdirectory in len bytes of directory entries, which a traversal is
+   about to visit */
+void chain_prefetch_dirs(uint8_t *dir, uint32_t len, uint8_t *image_buf,
+			 struct bpb33* bpb)
+{
+    struct direntry *dirent = (struct direntry*)dir;
+    uint32_t limit = geometry(bpb)->clusters;
+    char *env = getenv("DOS_IO_PREFETCH");
+    uint32_t d;
+
+    if (env != NULL && atoi(env) == 0)
+	return;
+    for (d = 0; d + sizeof(struct direntry) <= len;
+	 d += sizeof(struct direntry), dirent++) {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    return;
+	if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+	    || (dirent->deAttributes & ATTR_VOLUME) != 0
+	    || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    continue;
+	prefetch_chain(getushort(dirent->deStartCluster),
+		       PREFETCH_DIR_CLUSTERS, limit, image_buf, bpb);
+    }
+}
+
+/* chain_prefetch_range prefetches n contiguous clusters from first,
+   for a caller about to sweep through them in order */
+void chain_prefetch_range(uint16_t first, uint32_t n, uint8_t *image_buf,
+			  struct bpb33* bpb)
+{
+    char *env = getenv("DOS_IO_PREFETCH");
+
+    if ((env != NULL && atoi(env) == 0) || n == 0 || first < CLUST_FIRST)
+	return;
+    prefetch_run(first, n, image_buf, bpb);
+}
+
+char *chain_engine_name(struct chain_reader *cr)
+{
+    switch (cr->engine) {
+    case ENGINE_MMAP:
+	return "mmap";
+    case ENGINE_URING:
+	return "io_uring";
+    case ENGINE_COPY:
+	return "copy";
+    default:
+	return "pread";
+    }
+}
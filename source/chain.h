@@ -0,0 +1,24 @@
+/* chain readers hand back the clusters of a FAT chain in order.  With
+   the pread backend they keep a number of cluster reads in flight ahead
+   of the consumer, using io_uring if the kernel has it and plain pread
+   otherwise; with the mmap backend they walk the mapping, telling the
+   kernel which clusters are coming next, and with any other backend
+   they copy each cluster out of it.
+
+   The buffer returned by chain_next stays valid until the next call to
+   chain_next or chain_close on the same reader.  It is a private copy
+   for everything but the mmap backend, so it must not be written. */
+
+#include <stdint.h>
+
+struct chain_reader;
+
+struct chain_reader *chain_open(uint16_t start, uint32_t max_clusters,
+				uint8_t *image_buf, struct bpb33* bpb);
+uint8_t *chain_next(struct chain_reader *cr, uint16_t *cluster);
+void chain_close(struct chain_reader *cr);
+char *chain_engine_name(struct chain_reader *cr);
+void chain_prefetch_dirs(uint8_t *dir, uint32_t len, uint8_t *image_buf,
+			 struct bpb33* bpb);
+void chain_prefetch_range(uint16_t first, uint32_t n, uint8_t *image_buf,
+			  struct bpb33* bpb);
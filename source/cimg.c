@@ -0,0 +1,434 @@
+/* compressed disk images, and the I/O backend that reads and writes
+   them through a cache of decompressed chunks */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "lz.h"
+#include "cimg.h"
+
+/* default size of the decompressed chunk cache, in KiB; DOS_IO_CACHE
+   overrides it, as for the pread backend */
+#define CCACHE_DEFAULT_KB 1024
+
+/* the on-disk header; chunk data follows it */
+struct cimg_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t image_size;
+    uint32_t first_len;
+    uint32_t chunk_size;
+    uint32_t nchunks;
+    uint32_t pad;
+    uint64_t index_offset;
+};
+
+/* cimg_is_compressed returns TRUE if the file is a compressed image */
+int cimg_is_compressed(char *filename)
+{
+    char magic[4];
+    int fd, n;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+	return FALSE;
+    n = read(fd, magic, sizeof(magic));
+    close(fd);
+    return n == sizeof(magic) && memcmp(magic, CIMG_MAGIC, 4) == 0;
+}
+
+static uint32_t expected_chunks(uint64_t image_size, uint32_t first_len,
+				uint32_t chunk_size)
+{
+    if (image_size <= first_len)
+	return 1;
+    return 1 + (image_size - first_len + chunk_size - 1) / chunk_size;
+}
+
+static void alloc_cbuf(struct cimg *c)
+{
+    uint32_t largest = c->chunk_size > c->first_len
+	? c->chunk_size : c->first_len;
+    c->cbuf = malloc(lz_bound(largest));
+}
+
+/* cimg_open reads the header and index of a compressed image, returning
+   0 on success or -1 if it isn't one */
+int cimg_open(struct cimg *c, int fd)
+{
+    struct cimg_header hdr;
+    uint64_t chunk_end;
+    uint32_t i;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    if (read_fully(fd, (uint8_t*)&hdr, sizeof(hdr), 0) < 0
+	|| memcmp(hdr.magic, CIMG_MAGIC, 4) != 0
+	|| hdr.version != CIMG_VERSION
+	|| hdr.first_len == 0 || hdr.chunk_size == 0
+	|| hdr.nchunks != expected_chunks(hdr.image_size, hdr.first_len,
+					  hdr.chunk_size))
+	return -1;
+    c->image_size = hdr.image_size;
+    c->first_len = hdr.first_len;
+    c->chunk_size = hdr.chunk_size;
+    c->nchunks = hdr.nchunks;
+    c->index_offset = hdr.index_offset;
+
+    c->index = malloc(c->nchunks * sizeof(struct cimg_chunk));
+    if (read_fully(fd, (uint8_t*)c->index,
+		   c->nchunks * sizeof(struct cimg_chunk),
+		   c->index_offset) < 0) {
+	free(c->index);
+	return -1;
+    }
+    c->end = c->index_offset + c->nchunks * sizeof(struct cimg_chunk);
+    for (i = 0; i < c->nchunks; i++) {
+	chunk_end = c->index[i].offset + c->index[i].clen;
+	if (chunk_end > c->end)
+	    c->end = chunk_end;
+    }
+    alloc_cbuf(c);
+    return 0;
+}
+
+/* cimg_create sets up an empty compressed image in fd, for the chunks
+   to be written with cimg_write_chunk */
+void cimg_create(struct cimg *c, int fd, uint64_t image_size,
+		 uint32_t first_len, uint32_t chunk_size)
+{
+    memset(c, 0, sizeof(*c));
+    c->fd = fd;
+    c->image_size = image_size;
+    c->first_len = first_len;
+    c->chunk_size = chunk_size;
+    c->nchunks = expected_chunks(image_size, first_len, chunk_size);
+    c->end = sizeof(struct cimg_header);
+    c->index_dirty = TRUE;
+    c->index = calloc(c->nchunks, sizeof(struct cimg_chunk));
+    alloc_cbuf(c);
+}
+
+/* cimg_chunk_start returns the image offset that chunk i starts at */
+uint64_t cimg_chunk_start(struct cimg *c, uint32_t i)
+{
+    if (i == 0)
+	return 0;
+    return c->first_len + (uint64_t)(i - 1) * c->chunk_size;
+}
+
+/* cimg_chunk_len returns how many bytes of the image chunk i holds */
+uint32_t cimg_chunk_len(struct cimg *c, uint32_t i)
+{
+    uint64_t start = cimg_chunk_start(c, i);
+    uint32_t len = i == 0 ? c->first_len : c->chunk_size;
+
+    if (start >= c->image_size)
+	return 0;
+    if (start + len > c->image_size)
+	len = c->image_size - start;
+    return len;
+}
+
+/* cimg_read_chunk decompresses chunk i into buf, which must have room
+   for a whole chunk; anything past the end of the image reads as
+   zeros.  It returns 0 on success, or -1 with errno set. */
+int cimg_read_chunk(struct cimg *c, uint32_t i, uint8_t *buf)
+{
+    struct cimg_chunk *ch;
+    uint32_t len;
+
+    len = cimg_chunk_len(c, i);
+    memset(buf + len, 0, (i == 0 ? c->first_len : c->chunk_size) - len);
+    if (i >= c->nchunks || c->index[i].clen == 0) {
+	memset(buf, 0, len);
+	return 0;
+    }
+    ch = &c->index[i];
+    if (ch->codec == CIMG_STORED) {
+	if (ch->clen != len) {
+	    errno = EIO;
+	    return -1;
+	}
+	return read_fully(c->fd, buf, len, ch->offset);
+    }
+    if (ch->clen > lz_bound(len)) {
+	errno = EIO;
+	return -1;
+    }
+    if (read_fully(c->fd, c->cbuf, ch->clen, ch->offset) < 0)
+	return -1;
+    if (lz_decompress(c->cbuf, ch->clen, buf, len) < 0) {
+	errno = EIO;
+	return -1;
+    }
+    return 0;
+}
+
+/* cimg_write_chunk compresses chunk i from buf and writes it to the
+   file, in place if it fits and at the end if not.  The index isn't
+   written until cimg_write_index. */
+int cimg_write_chunk(struct cimg *c, uint32_t i, uint8_t *buf)
+{
+    struct cimg_chunk *ch;
+    uint32_t len, clen, codec;
+    uint8_t *data;
+    uint64_t offset;
+
+    if (i >= c->nchunks)
+	return 0;		/* past the end of the image */
+    ch = &c->index[i];
+    len = cimg_chunk_len(c, i);
+
+    /* only keep the compressed copy if it saves something */
+    clen = lz_compress(buf, len, c->cbuf, len - 1);
+    if (clen == 0) {
+	data = buf;
+	clen = len;
+	codec = CIMG_STORED;
+    } else {
+	data = c->cbuf;
+	codec = CIMG_LZ;
+    }
+
+    if (ch->clen > 0 && clen <= ch->clen) {
+	offset = ch->offset;
+    } else {
+	offset = c->end;
+	c->end += clen;
+    }
+    if (write_fully(c->fd, data, clen, offset) < 0)
+	return -1;
+    if (ch->offset != offset || ch->clen != clen || ch->codec != codec) {
+	ch->offset = offset;
+	ch->clen = clen;
+	ch->codec = codec;
+	c->index_dirty = TRUE;
+    }
+    return 0;
+}
+
+/* cimg_write_index writes the index, if it has changed, and then the
+   header that points to it */
+int cimg_write_index(struct cimg *c)
+{
+    struct cimg_header hdr;
+    size_t index_len = c->nchunks * sizeof(struct cimg_chunk);
+
+    if (!c->index_dirty)
+	return 0;
+    /* the index is the same size every time, so once it has a place
+       it keeps it */
+    if (c->index_offset == 0) {
+	c->index_offset = c->end;
+	c->end += index_len;
+    }
+    if (write_fully(c->fd, (uint8_t*)c->index, index_len,
+		    c->index_offset) < 0)
+	return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CIMG_MAGIC, 4);
+    hdr.version = CIMG_VERSION;
+    hdr.image_size = c->image_size;
+    hdr.first_len = c->first_len;
+    hdr.chunk_size = c->chunk_size;
+    hdr.nchunks = c->nchunks;
+    hdr.index_offset = c->index_offset;
+    if (write_fully(c->fd, (uint8_t*)&hdr, sizeof(hdr), 0) < 0)
+	return -1;
+    c->index_dirty = FALSE;
+    return 0;
+}
+
+void cimg_free(struct cimg *c)
+{
+    free(c->index);
+    free(c->cbuf);
+}
+
+/* ------------------------------------------------------------------ */
+/* the compressed image backend: chunk 0 is the resident metadata, and
+   data clusters come from a small LRU cache of decompressed chunks.
+   Dirty chunks are recompressed when they're evicted and when the
+   image is flushed. */
+
+struct ccache_entry {
+    uint32_t chunk;		/* chunk number, or UINT32_MAX if empty */
+    int dirty;
+    long used;			/* when it was last used, for LRU */
+};
+
+struct ccache {
+    struct cimg c;
+    pthread_mutex_t lock;
+    uint8_t *slab;		/* count * chunk_size bytes of chunk data */
+    struct ccache_entry *entries;
+    int count;
+    long clock;
+    int meta_dirty;
+    long hits, misses, writebacks;
+};
+
+static void io_failed(char *what)
+{
+    fprintf(stderr, "%s compressed disk image failed: %s\n", what,
+	    strerror(errno));
+    exit(1);
+}
+
+static uint8_t *cimg_backend_open(struct io_image *img, char *pathname)
+{
+    struct ccache *cc;
+    char *env;
+    long kb;
+    int i;
+
+    img->fd = open(pathname, O_RDWR);
+    if (img->fd < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+    cc = calloc(1, sizeof(struct ccache));
+    if (cimg_open(&cc->c, img->fd) < 0) {
+	fprintf(stderr, "%s is not a compressed disk image\n", pathname);
+	exit(1);
+    }
+    img->size = cc->c.image_size;
+    img->meta_len = cc->c.first_len;
+    img->meta = malloc(img->meta_len);
+    if (cimg_read_chunk(&cc->c, 0, img->meta) < 0)
+	io_failed("Read from");
+    if (io_meta_length(img->meta, &img->clust_size) != img->meta_len
+	|| img->clust_size == 0 || cc->c.chunk_size % img->clust_size != 0) {
+	fprintf(stderr, "Bad geometry in boot sector of %s\n", pathname);
+	exit(1);
+    }
+
+    kb = CCACHE_DEFAULT_KB;
+    env = getenv("DOS_IO_CACHE");
+    if (env != NULL && atol(env) > 0)
+	kb = atol(env);
+    cc->count = kb * 1024 / cc->c.chunk_size;
+    if (cc->count < 2)
+	cc->count = 2;
+    cc->slab = malloc((size_t)cc->count * cc->c.chunk_size);
+    cc->entries = malloc(cc->count * sizeof(struct ccache_entry));
+    for (i = 0; i < cc->count; i++) {
+	cc->entries[i].chunk = UINT32_MAX;
+	cc->entries[i].dirty = FALSE;
+	cc->entries[i].used = 0;
+    }
+    pthread_mutex_init(&cc->lock, NULL);
+    img->priv = cc;
+    return img->meta;
+}
+
+static int write_back_chunk(struct ccache *cc, int i)
+{
+    struct ccache_entry *e = &cc->entries[i];
+    if (!e->dirty)
+	return 0;
+    e->dirty = FALSE;
+    cc->writebacks++;
+    return cimg_write_chunk(&cc->c, e->chunk,
+			    cc->slab + (size_t)i * cc->c.chunk_size);
+}
+
+static uint8_t *cimg_backend_cluster(struct io_image *img, uint64_t offset)
+{
+    struct ccache *cc = img->priv;
+    uint64_t rel = offset - cc->c.first_len;
+    uint32_t chunk = 1 + rel / cc->c.chunk_size;
+    uint32_t within = rel % cc->c.chunk_size;
+    int i, victim = 0;
+    uint8_t *buf;
+
+    pthread_mutex_lock(&cc->lock);
+    cc->clock++;
+    for (i = 0; i < cc->count; i++) {
+	if (cc->entries[i].chunk == chunk) {
+	    cc->hits++;
+	    cc->entries[i].used = cc->clock;
+	    pthread_mutex_unlock(&cc->lock);
+	    return cc->slab + (size_t)i * cc->c.chunk_size + within;
+	}
+	if (cc->entries[i].used < cc->entries[victim].used)
+	    victim = i;
+    }
+
+    /* miss: recycle the least recently used chunk */
+    cc->misses++;
+    if (write_back_chunk(cc, victim) < 0)
+	io_failed("Write to");
+    buf = cc->slab + (size_t)victim * cc->c.chunk_size;
+    cc->entries[victim].chunk = chunk;
+    cc->entries[victim].used = cc->clock;
+    if (cimg_read_chunk(&cc->c, chunk, buf) < 0)
+	io_failed("Read from");
+    pthread_mutex_unlock(&cc->lock);
+    return buf + within;
+}
+
+static void cimg_backend_dirty(struct io_image *img, uint8_t *addr,
+			       size_t len)
+{
+    struct ccache *cc = img->priv;
+
+    if (addr >= img->meta && addr < img->meta + img->meta_len) {
+	cc->meta_dirty = TRUE;
+    } else if (addr >= cc->slab
+	       && addr < cc->slab + (size_t)cc->count * cc->c.chunk_size) {
+	cc->entries[(addr - cc->slab) / cc->c.chunk_size].dirty = TRUE;
+    }
+}
+
+static int cimg_backend_flush(struct io_image *img)
+{
+    struct ccache *cc = img->priv;
+    int i, err = 0;
+
+    if (cc->meta_dirty) {
+	err |= cimg_write_chunk(&cc->c, 0, img->meta);
+	cc->meta_dirty = FALSE;
+    }
+    for (i = 0; i < cc->count; i++)
+	err |= write_back_chunk(cc, i);
+    err |= cimg_write_index(&cc->c);
+    return err;
+}
+
+static void cimg_backend_close(struct io_image *img)
+{
+    struct ccache *cc = img->priv;
+
+    if (getenv("DOS_IO_STATS") != NULL) {
+	fprintf(stderr, "chunk cache: %ld hits, %ld misses, %ld writebacks\n",
+		cc->hits, cc->misses, cc->writebacks);
+    }
+    pthread_mutex_destroy(&cc->lock);
+    cimg_free(&cc->c);
+    free(cc->slab);
+    free(cc->entries);
+    free(cc);
+    free(img->meta);
+}
+
+struct io_backend io_cimg_backend = {
+    "cimg", cimg_backend_open, cimg_backend_cluster, cimg_backend_dirty,
+    cimg_backend_flush, cimg_backend_close
+};
@@ -0,0 +1,49 @@
+/* compressed disk images.  The image is cut into chunks which are
+   compressed independently, so that any cluster can be read by
+   decompressing just the chunk it's in.  The first chunk holds
+   everything before the first data cluster (boot sector, FATs and root
+   directory); the rest are all chunk_size bytes, a whole number of
+   clusters, except perhaps the last, so no cluster spans two chunks.
+
+   The file starts with a header, and the index, one entry per chunk,
+   is wherever the header says.  Chunks that are rewritten go back in
+   place if they still fit, and at the end of the file if they don't;
+   dos_pack -d followed by dos_pack reclaims the space. */
+
+#include <stdint.h>
+
+#define CIMG_MAGIC "DOSZ"
+#define CIMG_VERSION 1
+
+#define CIMG_STORED 0		/* chunk didn't compress, kept as is */
+#define CIMG_LZ 1
+
+struct cimg_chunk {
+    uint64_t offset;		/* where the chunk is in the file */
+    uint32_t clen;		/* its length in the file */
+    uint32_t codec;
+};
+
+struct cimg {
+    int fd;
+    uint64_t image_size;	/* size of the uncompressed image */
+    uint32_t first_len;		/* length of chunk 0 */
+    uint32_t chunk_size;	/* length of the other chunks */
+    uint32_t nchunks;
+    uint64_t index_offset;
+    uint64_t end;		/* where the next appended chunk goes */
+    int index_dirty;
+    struct cimg_chunk *index;
+    uint8_t *cbuf;		/* compression buffer */
+};
+
+int cimg_is_compressed(char *filename);
+int cimg_open(struct cimg *c, int fd);
+void cimg_create(struct cimg *c, int fd, uint64_t image_size,
+		 uint32_t first_len, uint32_t chunk_size);
+uint64_t cimg_chunk_start(struct cimg *c, uint32_t i);
+uint32_t cimg_chunk_len(struct cimg *c, uint32_t i);
+int cimg_read_chunk(struct cimg *c, uint32_t i, uint8_t *buf);
+int cimg_write_chunk(struct cimg *c, uint32_t i, uint8_t *buf);
+int cimg_write_index(struct cimg *c);
+void cimg_free(struct cimg *c);
@@ -0,0 +1,482 @@
+/* metadata checkpoints for incremental scans */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "ckpt.h"
+#include "sum.h"
+
+#define CKPT_MAGIC "DSCK"
+#define CKPT_VERSION 2
+
+/* the on-disk header; it is followed by the FAT hashes, the nodes and
+   the extents, which body_crc covers */
+struct ckpt_header {
+    char magic[4];
+    uint32_t version;
+    uint16_t bytes_per_sec;
+    uint16_t sectors;
+    uint16_t fat_secs;
+    uint16_t root_ents;
+    uint32_t n_fat_blocks;
+    uint32_t n_nodes;
+    uint32_t n_extents;
+    uint32_t body_crc;		/* CRC32C */
+};
+
+/* hash_bytes is a quick 64 bit hash for spotting changed metadata.
+   It isn't meant to resist anyone trying to make collisions. */
+static uint64_t hash_bytes(uint8_t *p, size_t len, uint64_t h)
+{
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+	memcpy(&w, p + i, 8);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+	h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 32;
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+static int valid_cluster(uint16_t cluster, uint32_t limit)
+{
+    return cluster >= CLUST_FIRST && cluster < limit;
+}
+
+/* body_crc is the CRC32C of everything after the header */
+static uint32_t body_crc(struct ckpt *ck)
+{
+    struct sum_state s;
+
+    sum_init(&s, 0);
+    sum_update(&s, (uint8_t*)ck->fat_hash,
+	       ck->n_fat_blocks * sizeof(uint64_t));
+    sum_update(&s, (uint8_t*)ck->nodes,
+	       ck->n_nodes * sizeof(struct ckpt_node));
+    sum_update(&s, (uint8_t*)ck->extents,
+	       ck->n_extents * sizeof(struct ckpt_extent));
+    return sum_crc(&s);
+}
+
+/* ckpt_valid checks that every index in a checkpoint read from disk
+   is in range, since they're used without further checks: the nodes'
+   parents come before them and their subtrees end after them, within
+   the node array, and their extents are within the extent array and
+   the volume */
+static int ckpt_valid(struct ckpt *ck, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    struct ckpt_node *node;
+    struct ckpt_extent *ext;
+    uint32_t i;
+
+    for (i = 0; i < ck->n_nodes; i++) {
+	node = &ck->nodes[i];
+	if (i == 0 ? node->parent != 0 || node->cluster != MSDOSFSROOT
+	    : node->parent >= i || !valid_cluster(node->cluster, limit))
+	    return FALSE;
+	if (node->next <= i || node->next > ck->n_nodes)
+	    return FALSE;
+	if (node->first_extent > ck->n_extents
+	    || node->n_extents > ck->n_extents - node->first_extent)
+	    return FALSE;
+    }
+    for (i = 0; i < ck->n_extents; i++) {
+	ext = &ck->extents[i];
+	if (!valid_cluster(ext->start, limit) || ext->len == 0
+	    || ext->len > limit - ext->start)
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+static struct ckpt *ckpt_alloc(struct bpb33* bpb)
+{
+    struct ckpt *ck = calloc(1, sizeof(struct ckpt));
+    ck->bytes_per_sec = bpb->bpbBytesPerSec;
+    ck->sectors = bpb->bpbSectors;
+    ck->fat_secs = bpb->bpbFATsecs;
+    ck->root_ents = bpb->bpbRootDirEnts;
+    ck->n_fat_blocks = bpb->bpbFATsecs;
+    ck->fat_hash = calloc(ck->n_fat_blocks, sizeof(uint64_t));
+    ck->fat_changed = calloc(ck->n_fat_blocks, 1);
+    return ck;
+}
+
+void ckpt_free(struct ckpt *ck)
+{
+    if (ck == NULL)
+	return;
+    free(ck->fat_hash);
+    free(ck->fat_changed);
+    free(ck->nodes);
+    free(ck->extents);
+    free(ck->by_cluster);
+    free(ck);
+}
+
+/* ckpt_read loads a checkpoint, returning NULL if there isn't one, if
+   it was made for a volume with a different layout, or if it has been
+   damaged */
+struct ckpt *ckpt_read(char *filename, struct bpb33* bpb)
+{
+    struct ckpt_header hdr;
+    struct ckpt *ck;
+    FILE *fd;
+    int ok;
+
+    fd = fopen(filename, "r");
+    if (fd == NULL)
+	return NULL;
+    if (fread(&hdr, sizeof(hdr), 1, fd) != 1
+	|| memcmp(hdr.magic, CKPT_MAGIC, 4) != 0
+	|| hdr.version != CKPT_VERSION
+	|| hdr.bytes_per_sec != bpb->bpbBytesPerSec
+	|| hdr.sectors != bpb->bpbSectors
+	|| hdr.fat_secs != bpb->bpbFATsecs
+	|| hdr.root_ents != bpb->bpbRootDirEnts
+	|| hdr.n_fat_blocks != bpb->bpbFATsecs) {
+	fclose(fd);
+	return NULL;
+    }
+
+    ck = ckpt_alloc(bpb);
+    ck->n_nodes = ck->max_nodes = hdr.n_nodes;
+    ck->n_extents = ck->max_extents = hdr.n_extents;
+    ck->nodes = malloc((hdr.n_nodes + 1) * sizeof(struct ckpt_node));
+    ck->extents = malloc((hdr.n_extents + 1) * sizeof(struct ckpt_extent));
+    ok = fread(ck->fat_hash, sizeof(uint64_t), ck->n_fat_blocks, fd)
+	== ck->n_fat_blocks
+	&& fread(ck->nodes, sizeof(struct ckpt_node), ck->n_nodes, fd)
+	== ck->n_nodes
+	&& fread(ck->extents, sizeof(struct ckpt_extent), ck->n_extents, fd)
+	== ck->n_extents;
+    fclose(fd);
+    if (!ok || ck->n_nodes == 0) {
+	fprintf(stderr, "Ignoring truncated checkpoint %s\n", filename);
+	ckpt_free(ck);
+	return NULL;
+    }
+    if (body_crc(ck) != hdr.body_crc || !ckpt_valid(ck, bpb)) {
+	fprintf(stderr, "Ignoring damaged checkpoint %s\n", filename);
+	ckpt_free(ck);
+	return NULL;
+    }
+    return ck;
+}
+
+/* ckpt_write saves a checkpoint, returning 0 on success */
+int ckpt_write(struct ckpt *ck, char *filename)
+{
+    struct ckpt_header hdr;
+    FILE *fd;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CKPT_MAGIC, 4);
+    hdr.version = CKPT_VERSION;
+    hdr.bytes_per_sec = ck->bytes_per_sec;
+    hdr.sectors = ck->sectors;
+    hdr.fat_secs = ck->fat_secs;
+    hdr.root_ents = ck->root_ents;
+    hdr.n_fat_blocks = ck->n_fat_blocks;
+    hdr.n_nodes = ck->n_nodes;
+    hdr.n_extents = ck->n_extents;
+    hdr.body_crc = body_crc(ck);
+
+    fd = fopen(filename, "w");
+    if (fd == NULL) {
+	fprintf(stderr, "Can't write checkpoint %s\n", filename);
+	return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fd) == 1
+	&& fwrite(ck->fat_hash, sizeof(uint64_t), ck->n_fat_blocks, fd)
+	== ck->n_fat_blocks
+	&& fwrite(ck->nodes, sizeof(struct ckpt_node), ck->n_nodes, fd)
+	== ck->n_nodes
+	&& fwrite(ck->extents, sizeof(struct ckpt_extent), ck->n_extents, fd)
+	== ck->n_extents;
+    if (fclose(fd) != 0 || !ok) {
+	fprintf(stderr, "Can't write checkpoint %s\n", filename);
+	unlink(filename);
+	return -1;
+    }
+    return 0;
+}
+
+/* ckpt_find returns the node for the directory starting at cluster,
+   or NULL if the checkpoint doesn't have one */
+struct ckpt_node *ckpt_find(struct ckpt *ck, uint16_t cluster)
+{
+    uint32_t i;
+
+    if (ck->by_cluster == NULL) {
+	/* index the nodes by start cluster the first time through */
+	ck->by_cluster = malloc(65536 * sizeof(uint32_t));
+	for (i = 0; i < 65536; i++)
+	    ck->by_cluster[i] = UINT32_MAX;
+	for (i = 0; i < ck->n_nodes; i++)
+	    ck->by_cluster[ck->nodes[i].cluster] = i;
+    }
+    i = ck->by_cluster[cluster];
+    if (i == UINT32_MAX)
+	return NULL;
+    return &ck->nodes[i];
+}
+
+/* ckpt_mark_used marks every cluster referenced by node as in use.
+   If the whole subtree is clean, the clusters of all the directories
+   below it are marked too. */
+void ckpt_mark_used(struct ckpt *ck, struct ckpt_node *node,
+		    int nonEmptyClusters[], int total_clusters)
+{
+    uint32_t i, last, e, c;
+    struct ckpt_extent *ext;
+
+    i = node - ck->nodes;
+    last = node->subtree_clean ? node->next : i + 1;
+    for (; i < last; i++) {
+	for (e = 0; e < ck->nodes[i].n_extents; e++) {
+	    ext = &ck->extents[ck->nodes[i].first_extent + e];
+	    for (c = ext->start; c < ext->start + ext->len
+		     && c < total_clusters; c++) {
+		nonEmptyClusters[c] = 1;
+	    }
+	}
+    }
+}
+
+static uint32_t new_node(struct ckpt *ck)
+{
+    if (ck->n_nodes == ck->max_nodes) {
+	ck->max_nodes = ck->max_nodes ? ck->max_nodes * 2 : 64;
+	ck->nodes = realloc(ck->nodes,
+			    ck->max_nodes * sizeof(struct ckpt_node));
+    }
+    memset(&ck->nodes[ck->n_nodes], 0, sizeof(struct ckpt_node));
+    return ck->n_nodes++;
+}
+
+static void add_extent(struct ckpt *ck, uint16_t start, uint16_t len)
+{
+    if (ck->n_extents == ck->max_extents) {
+	ck->max_extents = ck->max_extents ? ck->max_extents * 2 : 256;
+	ck->extents = realloc(ck->extents,
+			      ck->max_extents * sizeof(struct ckpt_extent));
+    }
+    ck->extents[ck->n_extents].start = start;
+    ck->extents[ck->n_extents].len = len;
+    ck->n_extents++;
+}
+
+/* add_chain records the cluster chain from start as extents of the
+   node being built, stopping at anything that isn't a sane cluster */
+static void add_chain(struct ckpt *ck, uint16_t start,
+		      uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    uint32_t steps = 0;
+    uint16_t cluster = start, first = start, len = 0;
+
+    while (valid_cluster(cluster, limit) && steps++ < limit) {
+	if (len > 0 && cluster != first + len) {
+	    add_extent(ck, first, len);
+	    first = cluster;
+	    len = 0;
+	}
+	len++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    if (len > 0)
+	add_extent(ck, first, len);
+}
+
+/* extents_unchanged checks that none of the FAT sectors describing
+   the old node's extents have changed */
+static int extents_unchanged(struct ckpt *ck, struct ckpt *old,
+			     struct ckpt_node *oldn)
+{
+    uint32_t e, b, first, last;
+    struct ckpt_extent *ext;
+
+    for (e = 0; e < oldn->n_extents; e++) {
+	ext = &old->extents[oldn->first_extent + e];
+	first = (3 * ext->start / 2) / ck->bytes_per_sec;
+	last = (3 * (ext->start + ext->len - 1) / 2 + 1) / ck->bytes_per_sec;
+	for (b = first; b <= last && b < ck->n_fat_blocks; b++) {
+	    if (ck->fat_changed[b])
+		return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+/* dir_next_block steps through the blocks of a directory: the whole
+   root directory, or one cluster at a time for a subdirectory.  It
+   returns the number of dirents in the block, or 0 at the end. */
+static int dir_next_block(uint16_t dir, uint16_t *cluster, int first,
+			  struct direntry **dirent, uint32_t *steps,
+			  uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+
+    if (dir == MSDOSFSROOT) {
+	if (!first)
+	    return 0;
+	*dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
+	return bpb->bpbRootDirEnts;
+    }
+    if (!first)
+	*cluster = get_fat_entry(*cluster, image_buf, bpb);
+    if (!valid_cluster(*cluster, limit) || (*steps)++ >= limit)
+	return 0;
+    *dirent = (struct direntry*)cluster_to_addr(*cluster, image_buf, bpb);
+    return bpb->bpbBytesPerSec * bpb->bpbSecPerClust
+	/ sizeof(struct direntry);
+}
+
+/* hash_dir hashes the raw contents of a directory */
+static uint64_t hash_dir(uint16_t dir, uint8_t *image_buf,
+			 struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    uint16_t cluster = dir;
+    uint32_t steps = 0;
+    uint64_t h = dir;
+    int n, first = TRUE;
+
+    while ((n = dir_next_block(dir, &cluster, first, &dirent, &steps,
+			       image_buf, bpb)) > 0) {
+	h = hash_bytes((uint8_t*)dirent, n * sizeof(struct direntry), h);
+	first = FALSE;
+    }
+    return h;
+}
+
+/* build_node adds the directory starting at dir, and everything below
+   it, to ck.  It returns the index of the new node. */
+static uint32_t build_node(struct ckpt *ck, struct ckpt *old, uint16_t dir,
+			   uint32_t parent, int depth,
+			   uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct ckpt_node *oldn = NULL;
+    struct direntry *dirent;
+    uint32_t idx, child, steps = 0;
+    uint16_t cluster = dir;
+    uint64_t subtree;
+    int n, i, clean, subtree_clean, first;
+
+    idx = new_node(ck);
+    ck->nodes[idx].cluster = dir;
+    ck->nodes[idx].parent = parent;
+    ck->nodes[idx].hash = hash_dir(dir, image_buf, bpb);
+
+    if (old != NULL)
+	oldn = ckpt_find(old, dir);
+    clean = oldn != NULL && oldn->hash == ck->nodes[idx].hash
+	&& extents_unchanged(ck, old, oldn);
+
+    /* the clusters this directory is responsible for: its own chain
+       and those of its files, but not its subdirectories */
+    ck->nodes[idx].first_extent = ck->n_extents;
+    if (clean) {
+	for (i = 0; i < oldn->n_extents; i++) {
+	    struct ckpt_extent *ext = &old->extents[oldn->first_extent + i];
+	    add_extent(ck, ext->start, ext->len);
+	}
+    } else {
+	if (dir != MSDOSFSROOT)
+	    add_chain(ck, dir, image_buf, bpb);
+	first = TRUE;
+	while ((n = dir_next_block(dir, &cluster, first, &dirent, &steps,
+				   image_buf, bpb)) > 0) {
+	    first = FALSE;
+	    for (i = 0; i < n && dirent[i].deName[0] != SLOT_EMPTY; i++) {
+		if (dirent[i].deName[0] == SLOT_DELETED
+		    || (dirent[i].deAttributes
+			& (ATTR_VOLUME | ATTR_DIRECTORY)) != 0)
+		    continue;
+		add_chain(ck, getushort(dirent[i].deStartCluster),
+			  image_buf, bpb);
+	    }
+	    if (i < n)
+		break;
+	}
+    }
+    ck->nodes[idx].n_extents = ck->n_extents - ck->nodes[idx].first_extent;
+
+    /* now the children, in directory order.  Guard against loops in a
+       damaged tree by limiting the depth. */
+    subtree = ck->nodes[idx].hash;
+    subtree_clean = clean;
+    cluster = dir;
+    steps = 0;
+    first = TRUE;
+    while (depth < MAXPATHLEN / 2
+	   && (n = dir_next_block(dir, &cluster, first, &dirent, &steps,
+				  image_buf, bpb)) > 0) {
+	first = FALSE;
+	for (i = 0; i < n && dirent[i].deName[0] != SLOT_EMPTY; i++) {
+	    uint16_t start;
+	    if (dirent[i].deName[0] == SLOT_DELETED
+		|| dirent[i].deName[0] == '.'
+		|| (dirent[i].deAttributes & ATTR_VOLUME) != 0
+		|| (dirent[i].deAttributes & ATTR_DIRECTORY) == 0)
+		continue;
+	    start = getushort(dirent[i].deStartCluster);
+	    if (!valid_cluster(start, geometry(bpb)->clusters))
+		continue;
+	    child = build_node(ck, old, start, idx, depth + 1,
+			       image_buf, bpb);
+	    subtree = hash_bytes((uint8_t*)&ck->nodes[child].subtree,
+				 sizeof(uint64_t), subtree);
+	    if (!ck->nodes[child].subtree_clean)
+		subtree_clean = FALSE;
+	    /* the cluster we were walking may have been mapped out */
+	    if (dir != MSDOSFSROOT)
+		dirent = (struct direntry*)cluster_to_addr(cluster,
+							   image_buf, bpb);
+	}
+	if (i < n)
+	    break;
+    }
+
+    ck->nodes[idx].subtree = subtree;
+    ck->nodes[idx].clean = clean;
+    ck->nodes[idx].subtree_clean = subtree_clean
+	&& oldn != NULL && oldn->subtree == subtree;
+    ck->nodes[idx].next = ck->n_nodes;
+    return idx;
+}
+
+/* ckpt_build hashes the metadata of the image, and works out which
+   directories are unchanged since the old checkpoint (which may be
+   NULL) */
+struct ckpt *ckpt_build(struct ckpt *old, uint8_t *image_buf,
+			struct bpb33* bpb)
+{
+    struct ckpt *ck = ckpt_alloc(bpb);
+    uint8_t *fat = fat_addr(0, image_buf, bpb);
+    uint32_t b;
+
+    for (b = 0; b < ck->n_fat_blocks; b++) {
+	ck->fat_hash[b] = hash_bytes(fat + b * ck->bytes_per_sec,
+				     ck->bytes_per_sec, b);
+	ck->fat_changed[b] = old == NULL || old->fat_hash[b] != ck->fat_hash[b];
+    }
+    build_node(ck, old, MSDOSFSROOT, 0, 0, image_buf, bpb);
+    return ck;
+}
@@ -0,0 +1,49 @@
+/* checkpoints of the metadata hashes of a disk image, so that
+   dos_scandisk can skip directories that haven't changed since the
+   last scan */
+
+#include <stdint.h>
+
+/* a run of clusters referenced by a directory */
+struct ckpt_extent {
+    uint16_t start;
+    uint16_t len;
+};
+
+/* one directory in the tree */
+struct ckpt_node {
+    uint16_t cluster;		/* start cluster, 0 for the root */
+    uint16_t clean;		/* directory unchanged since the checkpoint */
+    uint16_t subtree_clean;	/* ... and so is everything below it */
+    uint16_t pad;
+    uint32_t parent;		/* index of the parent node */
+    uint32_t next;		/* index of the node after this subtree */
+    uint64_t hash;		/* hash of the directory's own clusters */
+    uint64_t subtree;		/* hash of this node and its children */
+    uint32_t first_extent;	/* clusters of the directory and its files */
+    uint32_t n_extents;
+};
+
+struct ckpt {
+    uint16_t bytes_per_sec;
+    uint16_t sectors;
+    uint16_t fat_secs;
+    uint16_t root_ents;
+    uint32_t n_fat_blocks;	/* one hash per sector of the first FAT */
+    uint64_t *fat_hash;
+    uint8_t *fat_changed;	/* sectors that differ from the old checkpoint */
+    uint32_t n_nodes, max_nodes;
+    struct ckpt_node *nodes;	/* in depth-first order, root first */
+    uint32_t n_extents, max_extents;
+    struct ckpt_extent *extents;
+    uint32_t *by_cluster;	/* node index by start cluster */
+};
+
+struct ckpt *ckpt_read(char *filename, struct bpb33* bpb);
+int ckpt_write(struct ckpt *ck, char *filename);
+struct ckpt *ckpt_build(struct ckpt *old, uint8_t *image_buf,
+			struct bpb33* bpb);
+struct ckpt_node *ckpt_find(struct ckpt *ck, uint16_t cluster);
+void ckpt_mark_used(struct ckpt *ck, struct ckpt_node *node,
+		    int nonEmptyClusters[], int total_clusters);
+void ckpt_free(struct ckpt *ck);
@@ -0,0 +1,186 @@
+/* repair deltas, written by the preview backend and read by dos_delta */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+#include "sum.h"
+
+#define DELTA_MAGIC "DSDL"
+#define DELTA_VERSION 1
+
+/* the on-disk header; each run follows as a struct delta_run_header,
+   then its sectors before the repair, then its sectors after it */
+struct delta_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t sec_size;
+    uint32_t n_runs;
+    uint64_t image_size;
+};
+
+struct delta_run_header {
+    uint32_t first;
+    uint32_t count;
+    uint32_t crc_before;
+    uint32_t crc_after;
+};
+
+uint32_t delta_crc(uint8_t *p, uint32_t len)
+{
+    struct sum_state s;
+
+    sum_init(&s, 0);
+    sum_update(&s, p, len);
+    return sum_crc(&s);
+}
+
+struct delta *delta_new(uint32_t sec_size, uint64_t image_size)
+{
+    struct delta *d = calloc(1, sizeof(struct delta));
+    d->sec_size = sec_size;
+    d->image_size = image_size;
+    return d;
+}
+
+/* delta_add records that count sectors from first changed from before
+   to after; both are copied */
+void delta_add(struct delta *d, uint32_t first, uint32_t count,
+	       uint8_t *before, uint8_t *after)
+{
+    struct delta_run *run;
+    uint32_t len = count * d->sec_size;
+
+    if (d->n_runs == d->max_runs) {
+	d->max_runs = d->max_runs ? 2 * d->max_runs : 16;
+	d->runs = realloc(d->runs, d->max_runs * sizeof(struct delta_run));
+    }
+    run = &d->runs[d->n_runs++];
+    run->first = first;
+    run->count = count;
+    run->before = malloc(len);
+    run->after = malloc(len);
+    memcpy(run->before, before, len);
+    memcpy(run->after, after, len);
+    run->crc_before = delta_crc(before, len);
+    run->crc_after = delta_crc(after, len);
+}
+
+void delta_free(struct delta *d)
+{
+    uint32_t i;
+
+    if (d == NULL)
+	return;
+    for (i = 0; i < d->n_runs; i++) {
+	free(d->runs[i].before);
+	free(d->runs[i].after);
+    }
+    free(d->runs);
+    free(d);
+}
+
+/* delta_write saves a delta, returning 0 on success */
+int delta_write(struct delta *d, char *filename)
+{
+    struct delta_header hdr;
+    struct delta_run_header rh;
+    FILE *fd;
+    uint32_t i;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DELTA_MAGIC, 4);
+    hdr.version = DELTA_VERSION;
+    hdr.sec_size = d->sec_size;
+    hdr.n_runs = d->n_runs;
+    hdr.image_size = d->image_size;
+
+    fd = fopen(filename, "w");
+    if (fd == NULL) {
+	fprintf(stderr, "Can't write delta %s\n", filename);
+	return -1;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fd) == 1;
+    for (i = 0; ok && i < d->n_runs; i++) {
+	struct delta_run *run = &d->runs[i];
+	uint32_t len = run->count * d->sec_size;
+	rh.first = run->first;
+	rh.count = run->count;
+	rh.crc_before = run->crc_before;
+	rh.crc_after = run->crc_after;
+	ok = fwrite(&rh, sizeof(rh), 1, fd) == 1
+	    && fwrite(run->before, 1, len, fd) == len
+	    && fwrite(run->after, 1, len, fd) == len;
+    }
+    if (fclose(fd) != 0 || !ok) {
+	fprintf(stderr, "Can't write delta %s\n", filename);
+	unlink(filename);
+	return -1;
+    }
+    return 0;
+}
+
+/* delta_read loads a delta, returning NULL if it can't be read or its
+   contents don't match their checksums */
+struct delta *delta_read(char *filename)
+{
+    struct delta_header hdr;
+    struct delta_run_header rh;
+    struct delta *d;
+    FILE *fd;
+    uint32_t i;
+    int ok;
+
+    fd = fopen(filename, "r");
+    if (fd == NULL) {
+	fprintf(stderr, "Can't read delta %s\n", filename);
+	return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fd) != 1
+	|| memcmp(hdr.magic, DELTA_MAGIC, 4) != 0
+	|| hdr.version != DELTA_VERSION
+	|| hdr.sec_size == 0) {
+	fprintf(stderr, "%s isn't a repair delta\n", filename);
+	fclose(fd);
+	return NULL;
+    }
+
+    d = delta_new(hdr.sec_size, hdr.image_size);
+    ok = 1;
+    for (i = 0; ok && i < hdr.n_runs; i++) {
+	struct delta_run *run;
+	uint64_t len;
+	if (fread(&rh, sizeof(rh), 1, fd) != 1
+	    || rh.count == 0
+	    || ((uint64_t)rh.first + rh.count) * hdr.sec_size > hdr.image_size) {
+	    ok = 0;
+	    break;
+	}
+	len = (uint64_t)rh.count * hdr.sec_size;
+	if (d->n_runs == d->max_runs) {
+	    d->max_runs = d->max_runs ? 2 * d->max_runs : 16;
+	    d->runs = realloc(d->runs, d->max_runs * sizeof(struct delta_run));
+	}
+	run = &d->runs[d->n_runs++];
+	run->first = rh.first;
+	run->count = rh.count;
+	run->crc_before = rh.crc_before;
+	run->crc_after = rh.crc_after;
+	run->before = malloc(len);
+	run->after = malloc(len);
+	ok = fread(run->before, 1, len, fd) == len
+	    && fread(run->after, 1, len, fd) == len
+	    && delta_crc(run->before, len) == rh.crc_before
+	    && delta_crc(run->after, len) == rh.crc_after;
+    }
+    fclose(fd);
+    if (!ok) {
+	fprintf(stderr, "Delta %s is truncated or corrupt\n", filename);
+	delta_free(d);
+	return NULL;
+    }
+    return d;
+}
@@ -0,0 +1,30 @@
+/* repair deltas: the sectors a repair changed, with their contents
+   before and after and a checksum of each, so the repair can be
+   reviewed, applied to the image later, or taken back out again */
+
+#include <stdint.h>
+
+/* a run of consecutive changed sectors */
+struct delta_run {
+    uint32_t first;		/* first sector */
+    uint32_t count;
+    uint32_t crc_before;	/* CRC32C of the sectors before the repair */
+    uint32_t crc_after;		/* ... and after it */
+    uint8_t *before;		/* count sectors of each */
+    uint8_t *after;
+};
+
+struct delta {
+    uint32_t sec_size;
+    uint64_t image_size;
+    uint32_t n_runs, max_runs;
+    struct delta_run *runs;
+};
+
+struct delta *delta_new(uint32_t sec_size, uint64_t image_size);
+void delta_add(struct delta *d, uint32_t first, uint32_t count,
+	       uint8_t *before, uint8_t *after);
+int delta_write(struct delta *d, char *filename);
+struct delta *delta_read(char *filename);
+void delta_free(struct delta *d);
+uint32_t delta_crc(uint8_t *p, uint32_t len);
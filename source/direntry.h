@@ -83,6 +83,34 @@ struct direntry {
 	u_int8_t	deFileSize[4];	/* size of file in bytes */
 };
 
+/*
+ * Structure of a Win95 long name directory entry
+ */
+struct winentry {
+	u_int8_t	weCnt;
+#define	WIN_LAST	0x40
+#define	WIN_CNT		0x3f
+	u_int8_t	wePart1[10];
+	u_int8_t	weAttributes;
+#define	ATTR_WIN95	0x0f
+	u_int8_t	weReserved1;
+	u_int8_t	weChksum;
+	u_int8_t	wePart2[12];
+	u_int16_t	weReserved2;
+	u_int8_t	wePart3[4];
+};
+#define	WIN_CHARS	13	/* Number of chars per winentry */
+
+/*
+ * Maximum number of winentries for a filename.
+ */
+#define	WIN_MAXSUBENTRIES 20
+
+/*
+ * Maximum filename length in Win95
+ */
+#define	WIN_MAXLEN	255
+
 
 /*
  * This is the format of the contents of the deTime field in the direntry
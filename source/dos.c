@@ -15,13 +15,15 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "io.h"
+#include "sidecar.h"
 
 
 /* memory map the FAT-12  disk image file */
 uint8_t *mmap_file(char *filename, int *fd)
 {
     struct stat statbuf;
-    int size;
+    uint64_t size;
     uint8_t *image_buf;
     char pathname[MAXPATHLEN+1];
 
@@ -75,6 +77,7 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     struct bootsector33* bootsect;
     struct byte_bpb33* bpb;  /* BIOS parameter block */
     struct bpb33* bpb2;
+    uint32_t root_secs;
 
     bootsect = (struct bootsector33*)image_buf;
     if (bootsect->bsJump[0] == 0xe9 ||
@@ -109,7 +112,7 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     /* bpb is a byte-based struct, because this data is unaligned.
        This makes it hard to access the multi-byte fields, so we copy
        it to a slightly larger struct that is word-aligned */
-    bpb2 = malloc(sizeof(struct bpb33));
+    bpb2 = &((struct volume*)malloc(sizeof(struct volume)))->bpb;
 
     bpb2->bpbBytesPerSec = getushort(bpb->bpbBytesPerSec);
     bpb2->bpbSecPerClust = bpb->bpbSecPerClust;
@@ -132,64 +135,203 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     printf("Number of hidden sectors: %d\n", bpb2->bpbHiddenSecs);
 #endif
 
+    /* set_geometry divides by these, so anything that is not a FAT
+       volume (the arguments the wrong way round, say) stops here */
+    root_secs = bpb2->bpbBytesPerSec == 0 ? 0
+	: (bpb2->bpbRootDirEnts * sizeof(struct direntry)
+	   + bpb2->bpbBytesPerSec - 1) / bpb2->bpbBytesPerSec;
+    if (bpb2->bpbBytesPerSec < sizeof(struct direntry)
+	|| (bpb2->bpbBytesPerSec & (bpb2->bpbBytesPerSec - 1)) != 0
+	|| bpb2->bpbSecPerClust == 0
+	|| (bpb2->bpbSecPerClust & (bpb2->bpbSecPerClust - 1)) != 0
+	|| bpb2->bpbFATs == 0 || bpb2->bpbFATsecs == 0
+	|| bpb2->bpbSectors <= (uint32_t)bpb2->bpbResSectors
+	   + bpb2->bpbFATs * bpb2->bpbFATsecs + root_secs) {
+	fprintf(stderr, "Not a FAT-12 disk image: bad BIOS parameter block "
+		"(%u bytes per sector, %u sectors per cluster, %u sectors)\n",
+		bpb2->bpbBytesPerSec, bpb2->bpbSecPerClust, bpb2->bpbSectors);
+	exit(1);
+    }
+
+    set_geometry(bpb2);
+    if (io_current != NULL && io_current->meta == image_buf)
+	sidecar_attach(image_buf, bpb2);
     return bpb2;
 }
 
-/* get_fat_entry returns the value from the FAT entry for
-   clusternum. */
+/* set_geometry works out where the regions of the volume are from its
+   BPB, which must be inside a struct volume.  The data area starts
+   straight after the root directory entries, as it always has here;
+   the cluster count rounds the root directory up to whole sectors. */
+void set_geometry(struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+    uint32_t root_secs;
+
+    g->fat_offset = bpb->bpbBytesPerSec * bpb->bpbResSectors;
+    g->fat_bytes = bpb->bpbBytesPerSec * bpb->bpbFATsecs;
+    g->root_offset = g->fat_offset + bpb->bpbFATs * g->fat_bytes;
+    g->data_offset = g->root_offset 
+	+ bpb->bpbRootDirEnts * sizeof(struct direntry);
+    g->clust_bytes = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    root_secs = (bpb->bpbRootDirEnts * sizeof(struct direntry)
+		 + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+    g->clusters = (bpb->bpbSectors - bpb->bpbResSectors 
+		   - bpb->bpbFATs * bpb->bpbFATsecs - root_secs)
+	/ bpb->bpbSecPerClust + CLUST_FIRST;
+
+    for (g->clust_shift = 0; (1u << g->clust_shift) < g->clust_bytes; 
+	 g->clust_shift++)
+	;
+    if (g->clust_bytes == 512)
+	g->layout = GEOM_512;
+    else if (g->clust_bytes == 1024)
+	g->layout = GEOM_1K;
+    else if ((1u << g->clust_shift) == g->clust_bytes)
+	g->layout = GEOM_SHIFT;
+    else
+	g->layout = GEOM_ANY;
+}
+
+/* bytes of the primary FAT that have been modified by set_fat_entry
+   since the last flush_fat.  The other copies are brought up to date
+   in bulk when the caller flushes, rather than on every entry. */
+static uint32_t fat_dirty_lo = UINT32_MAX;
+static uint32_t fat_dirty_hi = 0;
+/* ... and the volume they were made to, for flush_fat_pending */
+static uint8_t *fat_dirty_image;
+static struct bpb33 *fat_dirty_bpb;
+
+/* fat_addr returns the address of the start of FAT copy fatnum (the
+   primary FAT is copy 0) */
+uint8_t *fat_addr(int fatnum, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+    return image_buf + g->fat_offset + fatnum * g->fat_bytes;
+}
+
+/* fat12_entry unpacks entry clusternum from a FAT.  Entry n is the 12
+   bits starting at nibble 3n, so it is in the two bytes from 3n/2:
+   the low 12 bits of them if n is even, the high 12 if it's odd.
+   This probably only works on a little-endian machine. */
+static inline uint16_t fat12_entry(uint8_t *fat, uint16_t clusternum)
+{
+    uint8_t *p = fat + clusternum + clusternum / 2;
+    uint16_t value = p[0] | p[1] << 8;
+    return (clusternum & 1) ? value >> 4 : value & 0x0fff;
+}
+
+/* get_fat_entry_n returns the value from the FAT entry for
+   clusternum in FAT copy fatnum. */
+uint16_t get_fat_entry_n(uint16_t clusternum, int fatnum,
+			 uint8_t *image_buf, struct bpb33* bpb)
+{
+    return fat12_entry(fat_addr(fatnum, image_buf, bpb), clusternum);
+}
+
+/* get_fat_entry returns the value from the primary FAT entry for
+   clusternum, from the sidecar's decoded copy if the volume has one. */
 uint16_t get_fat_entry(uint16_t clusternum, 
 		       uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    uint16_t value;
-    uint8_t b1, b2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) {
-    case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
-	/* mjh: little-endian CPUs are ugly! */
-	value = ((0x0f & b2) << 8) | b1;
-	break;
-    case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
-	value = b2 << 4 | ((0xf0 & b1) >> 4);
-	break;
-    }
-    return value;
+    if (bpb == sidecar_bpb && clusternum < sidecar_entries)
+	return sidecar_fat[clusternum];
+    return fat12_entry(image_buf + geometry(bpb)->fat_offset, clusternum);
 }
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
+/* set_fat_entry sets the value of the FAT entry for clusternum to
+   value.  Only the primary FAT is written; call flush_fat to copy the
+   change to the other FATs. */
 void set_fat_entry(uint16_t clusternum, uint16_t value,
 		   uint8_t *image_buf, struct bpb33* bpb)
 {
     uint32_t offset;
     uint8_t *p1, *p2;
+    uint8_t *fat;
     
     /* this involves some really ugly bit shifting.  This probably
        only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
+    fat = fat_addr(0, image_buf, bpb);
+    offset = 3 * (clusternum/2);
     switch(clusternum % 2) {
     case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
+	p1 = fat + offset;
+	p2 = fat + offset + 1;
 	/* mjh: little-endian CPUs are really ugly! */
 	*p1 = (uint8_t)(0xff & value);
 	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
 	break;
-    case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
+    default:
+	p1 = fat + offset + 1;
+	p2 = fat + offset + 2;
 	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
 	*p2 = (uint8_t)(0xff & (value >> 4));
 	break;
     }
+    mark_dirty(p1, 2);
+
+    /* remember which bytes need mirroring */
+    if (offset < fat_dirty_lo)
+	fat_dirty_lo = offset;
+    if (offset + 3 > fat_dirty_hi)
+	fat_dirty_hi = offset + 3;
+    fat_dirty_image = image_buf;
+    fat_dirty_bpb = bpb;
+}
+
+/* find_free_cluster returns the first free cluster from from on, or 0
+   if the volume is full.  With a sidecar, it's looked up in the free
+   bitmap rather than by reading the FAT entries one by one. */
+uint16_t find_free_cluster(uint16_t from, uint8_t *image_buf, 
+			   struct bpb33* bpb)
+{
+    uint32_t c, limit = geometry(bpb)->clusters;
+
+    if (bpb == sidecar_bpb)
+	return sidecar_next_free(from);
+    for (c = from < CLUST_FIRST ? CLUST_FIRST : from; c < limit; c++) {
+	if (get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    return c;
+    }
+    return 0;
+}
+
+/* copy_fat_range copies bytes [lo, hi) of the primary FAT over the
+   same bytes of every other FAT copy */
+void copy_fat_range(uint32_t lo, uint32_t hi, 
+		    uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    uint8_t *primary;
+    int i;
+
+    if (hi > fat_bytes)
+	hi = fat_bytes;
+    if (lo >= hi)
+	return;
+    primary = fat_addr(0, image_buf, bpb);
+    for (i = 1; i < bpb->bpbFATs; i++) {
+	memcpy(fat_addr(i, image_buf, bpb) + lo, primary + lo, hi - lo);
+	mark_dirty(fat_addr(i, image_buf, bpb) + lo, hi - lo);
+    }
+}
+
+/* flush_fat propagates everything set_fat_entry has changed in the
+   primary FAT to the other FAT copies, in one copy per FAT */
+void flush_fat(uint8_t *image_buf, struct bpb33* bpb)
+{
+    copy_fat_range(fat_dirty_lo, fat_dirty_hi, image_buf, bpb);
+    fat_dirty_lo = UINT32_MAX;
+    fat_dirty_hi = 0;
+}
+
+/* flush_fat_pending mirrors anything set_fat_entry has changed that no
+   one has flushed yet.  flush_image calls it, so the FAT copies can't
+   be left out of step by a tool that forgets to. */
+void flush_fat_pending(void)
+{
+    if (fat_dirty_lo < fat_dirty_hi)
+	flush_fat(fat_dirty_image, fat_dirty_bpb);
 }
 
 
@@ -208,28 +350,43 @@ int is_end_of_file(uint16_t cluster) {
    start of the root directory, as indicated in the boot sector */
 uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    return image_buf + geometry(bpb)->root_offset;
+}
+
+/* cluster_offset returns the byte offset of a data cluster.  The
+   common floppy cluster sizes are spelt out as constants, so their
+   cases compile to a shift and an add; the layout was picked when the
+   BPB was read. */
+static inline uint64_t cluster_offset(struct geometry *g, uint16_t cluster)
+{
+    uint64_t n = (int64_t)cluster - CLUST_FIRST;
+
+    switch (g->layout) {
+    case GEOM_512:
+	return g->data_offset + n * 512;
+    case GEOM_1K:
+	return g->data_offset + n * 1024;
+    case GEOM_SHIFT:
+	return g->data_offset + (n << g->clust_shift);
+    default:
+	return g->data_offset + n * g->clust_bytes;
+    }
 }
 
 /* cluster_to_addr returns the memory location where the memory mapped
-   cluster actually starts */
+   cluster actually starts.  If the image was opened with a backend that
+   doesn't keep the data area resident, the backend fetches it. */
 
 uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
 			 struct bpb33* bpb)
 {
-    uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	    * (cluster - CLUST_FIRST);
-    }
-    return p;
-}
+    struct geometry *g = geometry(bpb);
+    uint64_t offset;
 
+    if (cluster == MSDOSFSROOT)
+	return image_buf + g->root_offset;
+    offset = cluster_offset(g, cluster);
+    if (io_current != NULL && offset >= io_current->meta_len)
+	return io_current->ops->cluster(io_current, offset);
+    return image_buf + offset;
+}
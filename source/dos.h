@@ -12,13 +12,63 @@
 
 #include <stdint.h>
 
+/* where everything is in a volume, worked out once from the BPB when
+   the image is opened rather than on every access.  check_bootsector
+   allocates the BPB inside a struct volume, so geometry() can get from
+   the BPB every function is passed to its geometry. */
+struct geometry {
+    uint32_t fat_offset;	/* the primary FAT */
+    uint32_t fat_bytes;		/* each FAT copy */
+    uint32_t root_offset;	/* the root directory */
+    uint32_t data_offset;	/* cluster 2 */
+    uint32_t clust_bytes;
+    uint32_t clusters;		/* first cluster number past the data area */
+    int layout;			/* GEOM_*, which cluster_to_addr path to use */
+    int clust_shift;		/* log2 of clust_bytes, for GEOM_SHIFT */
+};
+
+#define GEOM_ANY 0		/* cluster size isn't a power of two */
+#define GEOM_SHIFT 1		/* power of two cluster size */
+#define GEOM_512 2		/* 512 byte clusters: 1.44M and 1.2M floppies */
+#define GEOM_1K 3		/* 1K clusters: 720K and 360K floppies */
+
+struct volume {
+    struct bpb33 bpb;
+    struct geometry geom;
+};
+
+static inline struct geometry *geometry(struct bpb33* bpb)
+{
+    return &((struct volume*)bpb)->geom;
+}
+
 uint8_t *mmap_file(char *filename, int *fd);
 struct bpb33* check_bootsector(uint8_t *image_buf);
+void set_geometry(struct bpb33* bpb);
+uint8_t *fat_addr(int fatnum, uint8_t *image_buf, struct bpb33* bpb);
 uint16_t get_fat_entry(uint16_t clusternum, uint8_t *image_buf, 
 		       struct bpb33* bpb);
+uint16_t get_fat_entry_n(uint16_t clusternum, int fatnum,
+			 uint8_t *image_buf, struct bpb33* bpb);
 void set_fat_entry(uint16_t clusternum, uint16_t value, 
 		   uint8_t *image_buf, struct bpb33* bpb);
+uint16_t find_free_cluster(uint16_t from, uint8_t *image_buf, 
+			   struct bpb33* bpb);
+void copy_fat_range(uint32_t lo, uint32_t hi, 
+		    uint8_t *image_buf, struct bpb33* bpb);
+void flush_fat(uint8_t *image_buf, struct bpb33* bpb);
+void flush_fat_pending(void);
 int is_end_of_file(uint16_t cluster) ;
 uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb);
 uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
 			 struct bpb33* bpb);
+
+/* prototypes for functions in io.c */
+
+#include <stddef.h>
+
+uint8_t *open_image(char *filename, int *fd);
+uint8_t *open_image_preview(char *filename, int *fd, char *delta_file);
+void mark_dirty(uint8_t *addr, size_t len);
+void flush_image(uint8_t *image_buf);
+void close_image(uint8_t *image_buf);
@@ -0,0 +1,542 @@
+/* dos_build: fill an empty FAT-12 disk image, as made by dos_mkfs,
+   from a directory tree on the host.  Everything is sized before the
+   image is touched, and laid out with the directories packed together
+   at the start of the data area and every file in one contiguous run
+   after them, in tree order or in the order given by an access list.
+   The FATs, directories and file data then go to the image in a single
+   sequential pass. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "lfn.h"
+
+/* how much file data is copied at a time */
+#define COPY_BYTES (64 * 1024)
+
+/* a file or directory in the host tree; node 0 is the top of the tree,
+   which becomes the root directory */
+struct node {
+    char *path;			/* on the host */
+    char *rel;			/* relative to the top, as in the access list */
+    char *name;			/* the last part of rel */
+    int dir;
+    int parent;
+    int first, count;		/* a directory's children, in name order */
+    uint32_t size;
+    time_t mtime;
+    int slots;			/* directory slots its entry takes */
+    uint32_t clusters;
+    uint16_t start;
+    int order;			/* place in the access list, or -1 */
+};
+
+struct build {
+    struct node *nodes;
+    int n, alloc;
+    uint32_t clust_bytes;
+    int per_cluster;		/* directory slots in a cluster */
+    int ndirs, nfiles;
+    uint32_t dir_clusters;
+    uint64_t file_clusters;
+    int *layout;		/* files with data, in cluster order */
+    int nlayout;
+};
+
+/* a file's place in the layout: its access list position first, then
+   where it is in the tree */
+struct place {
+    int order;
+    int node;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_build [-n] [-o <access list>] <imagename> <directory>\n");
+    fprintf(stderr, "  -n  plan the layout and say whether it fits, but don't write it\n");
+    fprintf(stderr, "  -o  a file of paths, relative to the directory, one per line,\n");
+    fprintf(stderr, "      of files to put first and in that order\n");
+    exit(1);
+}
+
+int add_node(struct build *b, char *path, char *rel, int parent,
+	     struct stat *st)
+{
+    struct node *node;
+    char *slash;
+
+    if (b->n == b->alloc) {
+	b->alloc = b->alloc ? b->alloc * 2 : 64;
+	b->nodes = realloc(b->nodes, b->alloc * sizeof(struct node));
+    }
+    node = &b->nodes[b->n];
+    memset(node, 0, sizeof(struct node));
+    node->path = strdup(path);
+    node->rel = strdup(rel);
+    slash = strrchr(node->rel, '/');
+    node->name = slash != NULL ? slash + 1 : node->rel;
+    node->dir = S_ISDIR(st->st_mode);
+    node->parent = parent;
+    node->mtime = st->st_mtime;
+    node->order = -1;
+    if (!node->dir) {
+	if (st->st_size > UINT32_MAX) {
+	    fprintf(stderr, "%s is too big for a FAT file\n", path);
+	    exit(1);
+	}
+	node->size = st->st_size;
+    }
+    return b->n++;
+}
+
+/* scan_dir adds the children of directory d, then their children */
+void scan_dir(struct build *b, int d)
+{
+    struct dirent **list;
+    struct stat st;
+    char path[PATH_MAX], rel[PATH_MAX];
+    int i, n;
+
+    n = scandir(b->nodes[d].path, &list, NULL, alphasort);
+    if (n < 0) {
+	fprintf(stderr, "Cannot read directory %s: %s\n",
+		b->nodes[d].path, strerror(errno));
+	exit(1);
+    }
+    b->nodes[d].first = b->n;
+    for (i = 0; i < n; i++) {
+	if (strcmp(list[i]->d_name, ".") == 0
+	    || strcmp(list[i]->d_name, "..") == 0) {
+	    free(list[i]);
+	    continue;
+	}
+	snprintf(path, sizeof(path), "%s/%s", b->nodes[d].path,
+		 list[i]->d_name);
+	if (d == 0)
+	    snprintf(rel, sizeof(rel), "%s", list[i]->d_name);
+	else
+	    snprintf(rel, sizeof(rel), "%s/%s", b->nodes[d].rel,
+		     list[i]->d_name);
+	free(list[i]);
+	if (lstat(path, &st) < 0) {
+	    fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+	    exit(1);
+	}
+	if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+	    fprintf(stderr, "Skipping %s: not a file or directory\n", path);
+	    continue;
+	}
+	add_node(b, path, rel, d, &st);
+    }
+    free(list);
+    b->nodes[d].count = b->n - b->nodes[d].first;
+
+    for (i = b->nodes[d].first; i < b->nodes[d].first + b->nodes[d].count;
+	 i++) {
+	if (b->nodes[i].dir)
+	    scan_dir(b, i);
+    }
+}
+
+/* dir_clusters works out how many clusters a subdirectory needs.  The
+   entries follow each other, long name slots and all, from one
+   cluster into the next, and there's always a free slot left at the
+   end, to mark where the directory ends. */
+uint32_t dir_clusters(struct build *b, int d)
+{
+    uint32_t used = 3;		/* ".", ".." and the end */
+    int i;
+
+    for (i = b->nodes[d].first; i < b->nodes[d].first + b->nodes[d].count;
+	 i++)
+	used += b->nodes[i].slots;
+    return (used + b->per_cluster - 1) / b->per_cluster;
+}
+
+/* read_access_list gives the files named in the access list their
+   places in it */
+void read_access_list(struct build *b, char *filename)
+{
+    FILE *f;
+    char line[PATH_MAX], *rel;
+    int i, pos = 0;
+
+    f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "Cannot read access list %s: %s\n", filename,
+		strerror(errno));
+	exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+	line[strcspn(line, "\r\n")] = '\0';
+	rel = line;
+	while (strncmp(rel, "./", 2) == 0)
+	    rel += 2;
+	if (*rel == '\0')
+	    continue;
+	for (i = 1; i < b->n; i++) {
+	    if (!b->nodes[i].dir && strcmp(b->nodes[i].rel, rel) == 0)
+		break;
+	}
+	if (i == b->n) {
+	    fprintf(stderr, "%s isn't a file in the tree\n", rel);
+	    continue;
+	}
+	if (b->nodes[i].order < 0)
+	    b->nodes[i].order = pos++;
+    }
+    fclose(f);
+}
+
+int place_cmp(const void *a, const void *b)
+{
+    const struct place *pa = a, *pb = b;
+
+    if (pa->order != pb->order)
+	return pa->order < pb->order ? -1 : 1;
+    return pa->node - pb->node;
+}
+
+/* plan sizes every directory and file and gives each its clusters:
+   the subdirectories first, in tree order, then the files */
+void plan(struct build *b, int root_free, uint32_t limit)
+{
+    struct node *node;
+    struct place *places;
+    uint32_t next = CLUST_FIRST;
+    int i, root_slots = 0;
+
+    for (i = 1; i < b->n; i++) {
+	node = &b->nodes[i];
+	node->slots = lfn_slots(node->name);
+	if (node->slots < 0) {
+	    fprintf(stderr, "%s: the name is too long\n", node->path);
+	    exit(1);
+	}
+	if (node->parent == 0)
+	    root_slots += node->slots;
+    }
+    if (root_slots > root_free) {
+	fprintf(stderr, "The root directory needs %d entries, but only has "
+		"room for %d\n", root_slots, root_free);
+	exit(1);
+    }
+
+    for (i = 1; i < b->n; i++) {
+	node = &b->nodes[i];
+	if (!node->dir)
+	    continue;
+	node->clusters = dir_clusters(b, i);
+	node->start = next;
+	next += node->clusters;
+	b->ndirs++;
+	b->dir_clusters += node->clusters;
+    }
+
+    places = malloc(b->n * sizeof(struct place));
+    b->layout = malloc(b->n * sizeof(int));
+    for (i = 1; i < b->n; i++) {
+	node = &b->nodes[i];
+	if (node->dir)
+	    continue;
+	b->nfiles++;
+	node->clusters = (node->size + b->clust_bytes - 1) / b->clust_bytes;
+	if (node->clusters == 0)
+	    continue;
+	places[b->nlayout].order = node->order >= 0 ? node->order : INT_MAX;
+	places[b->nlayout].node = i;
+	b->nlayout++;
+    }
+    qsort(places, b->nlayout, sizeof(struct place), place_cmp);
+    for (i = 0; i < b->nlayout; i++) {
+	b->layout[i] = places[i].node;
+	b->file_clusters += b->nodes[places[i].node].clusters;
+    }
+    free(places);
+
+    /* nothing has been written yet, so a tree that's too big is only
+       an error message */
+    if ((uint64_t)b->dir_clusters + b->file_clusters > limit - CLUST_FIRST) {
+	fprintf(stderr, "The tree needs %llu clusters, but the volume only "
+		"has %u\n", (unsigned long long)b->dir_clusters
+		+ b->file_clusters, limit - CLUST_FIRST);
+	exit(1);
+    }
+    for (i = 0; i < b->nlayout; i++) {
+	node = &b->nodes[b->layout[i]];
+	node->start = next;
+	next += node->clusters;
+    }
+}
+
+/* check_empty makes sure the volume has nothing on it but a label,
+   and returns how many root directory slots are free */
+int check_empty(uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    uint32_t c, limit = geometry(bpb)->clusters;
+    int i;
+
+    for (c = CLUST_FIRST; c < limit; c++) {
+	if (get_fat_entry(c, image_buf, bpb) != (FAT12_MASK & CLUST_FREE)) {
+	    fprintf(stderr, "The disk image isn't empty: cluster %u is in "
+		    "use\n", c);
+	    exit(1);
+	}
+    }
+    dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
+    for (i = 0; i < bpb->bpbRootDirEnts; i++) {
+	if (dirent[i].deName[0] == SLOT_EMPTY)
+	    break;
+	if (dirent[i].deName[0] != SLOT_DELETED
+	    && (dirent[i].deAttributes & ATTR_VOLUME) == 0) {
+	    fprintf(stderr, "The disk image isn't empty: the root directory "
+		    "has entries\n");
+	    exit(1);
+	}
+    }
+    return bpb->bpbRootDirEnts - i;
+}
+
+/* set_times gives an entry the host's modification time, for every
+   time it has */
+void set_times(struct direntry *dirent, time_t mtime)
+{
+    struct tm *tm = localtime(&mtime);
+    uint16_t date, hms;
+
+    if (tm == NULL || tm->tm_year < 80) {
+	/* the earliest date FAT can hold */
+	date = 1 << DD_MONTH_SHIFT | 1 << DD_DAY_SHIFT;
+	hms = 0;
+    } else {
+	date = (tm->tm_year > 80 + 127 ? 127 : tm->tm_year - 80)
+	    << DD_YEAR_SHIFT
+	    | (tm->tm_mon + 1) << DD_MONTH_SHIFT | tm->tm_mday << DD_DAY_SHIFT;
+	hms = tm->tm_hour << DT_HOURS_SHIFT | tm->tm_min << DT_MINUTES_SHIFT
+	    | (tm->tm_sec / 2) << DT_2SECONDS_SHIFT;
+    }
+    putushort(dirent->deCTime, hms);
+    putushort(dirent->deCDate, date);
+    putushort(dirent->deADate, date);
+    putushort(dirent->deMTime, hms);
+    putushort(dirent->deMDate, date);
+}
+
+void set_chain(uint16_t start, uint32_t count, uint8_t *image_buf,
+	       struct bpb33* bpb)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+	set_fat_entry(start + i, i + 1 < count ? start + i + 1
+		      : FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    }
+}
+
+/* fill_dir makes the entries of directory d, in the directory
+   clusters at the end of image_buf */
+void fill_dir(struct build *b, int d, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct node *dir = &b->nodes[d], *node;
+    struct direntry *dirent;
+    struct dir_index *di;
+    int i;
+
+    if (d != 0) {
+	/* "." and ".." come first */
+	dirent = (struct direntry*)cluster_to_addr(dir->start, image_buf,
+						   bpb);
+	memset(dirent[0].deName, ' ', 11);
+	dirent[0].deName[0] = '.';
+	dirent[0].deAttributes = ATTR_DIRECTORY;
+	putushort(dirent[0].deStartCluster, dir->start);
+	set_times(&dirent[0], dir->mtime);
+	memset(dirent[1].deName, ' ', 11);
+	dirent[1].deName[0] = '.';
+	dirent[1].deName[1] = '.';
+	dirent[1].deAttributes = ATTR_DIRECTORY;
+	putushort(dirent[1].deStartCluster, b->nodes[dir->parent].start);
+	set_times(&dirent[1], b->nodes[dir->parent].mtime);
+    }
+
+    for (i = dir->first; i < dir->first + dir->count; i++) {
+	node = &b->nodes[i];
+
+	/* names that differ only in case are the same name here */
+	di = dir_index_get(dir->start, image_buf, bpb);
+	dirent = dir_index_find(di, node->name, image_buf, bpb);
+	if (dirent != NULL) {
+	    fprintf(stderr, "%s: another name in the directory is the same "
+		    "but for case\n", node->path);
+	    exit(1);
+	}
+	dirent = lfn_create(dir->start, node->name,
+			    node->dir ? ATTR_DIRECTORY : ATTR_NORMAL,
+			    node->clusters ? node->start : 0,
+			    node->dir ? 0 : node->size, image_buf, bpb);
+	if (dirent == NULL) {
+	    fprintf(stderr, "%s: cannot make a directory entry for it\n",
+		    node->path);
+	    exit(1);
+	}
+	set_times(dirent, node->mtime);
+    }
+}
+
+/* copy_file writes a file's data to its clusters, zeroing the rest of
+   the last one */
+void copy_file(struct build *b, struct node *node, uint8_t *buf, int fd,
+	       struct bpb33* bpb)
+{
+    uint64_t offset, total, done, n;
+    int host_fd;
+
+    host_fd = open(node->path, O_RDONLY);
+    if (host_fd < 0) {
+	fprintf(stderr, "Cannot read %s: %s\n", node->path, strerror(errno));
+	exit(1);
+    }
+    offset = geometry(bpb)->data_offset
+	+ (uint64_t)(node->start - CLUST_FIRST) * b->clust_bytes;
+    total = (uint64_t)node->clusters * b->clust_bytes;
+    for (done = 0; done < total; done += n) {
+	n = total - done < COPY_BYTES ? total - done : COPY_BYTES;
+	if (read_fully(host_fd, buf, n, done) < 0) {
+	    fprintf(stderr, "Cannot read %s: %s\n", node->path,
+		    strerror(errno));
+	    exit(1);
+	}
+	/* only as much as was planned for, if the file has grown */
+	if (done + n > node->size)
+	    memset(buf + (node->size > done ? node->size - done : 0), 0,
+		   done + n - (node->size > done ? node->size : done));
+	if (write_fully(fd, buf, n, offset + done) < 0) {
+	    fprintf(stderr, "Write to disk image failed: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    close(host_fd);
+}
+
+int main(int argc, char** argv)
+{
+    struct build b;
+    struct stat st;
+    struct bpb33 *bpb;
+    struct geometry *g;
+    uint8_t *image_buf, *buf;
+    uint64_t meta_len;
+    char *access_list = NULL;
+    int fd, opt, i, root_free, dry_run = 0;
+
+    while ((opt = getopt(argc, argv, "no:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    dry_run = 1;
+	    break;
+	case 'o':
+	    access_list = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 2) {
+	usage();
+    }
+
+    fd = open(argv[optind], dry_run ? O_RDONLY : O_RDWR);
+    if (fd < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+
+    /* the boot sector, to find out how much metadata there is */
+    image_buf = malloc(512);
+    if (read_fully(fd, image_buf, 512, 0) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+    bpb = check_bootsector(image_buf);
+    g = geometry(bpb);
+    image_buf = realloc(image_buf, g->data_offset);
+    if (read_fully(fd, image_buf, g->data_offset, 0) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+    root_free = check_empty(image_buf, bpb);
+
+    memset(&b, 0, sizeof(b));
+    b.clust_bytes = g->clust_bytes;
+    b.per_cluster = g->clust_bytes / sizeof(struct direntry);
+    if (stat(argv[optind + 1], &st) < 0 || !S_ISDIR(st.st_mode)) {
+	fprintf(stderr, "%s isn't a directory\n", argv[optind + 1]);
+	exit(1);
+    }
+    add_node(&b, argv[optind + 1], "", -1, &st);
+    scan_dir(&b, 0);
+    if (access_list != NULL)
+	read_access_list(&b, access_list);
+    plan(&b, root_free, g->clusters);
+
+    /* the FATs, root directory and subdirectories are made in memory,
+       where the directory code can get at them like a mapped image */
+    meta_len = g->data_offset + (uint64_t)b.dir_clusters * b.clust_bytes;
+    image_buf = realloc(image_buf, meta_len);
+    memset(image_buf + g->data_offset, 0, meta_len - g->data_offset);
+    for (i = 1; i < b.n; i++) {
+	if (b.nodes[i].clusters != 0)
+	    set_chain(b.nodes[i].start, b.nodes[i].clusters, image_buf, bpb);
+    }
+    flush_fat(image_buf, bpb);
+    for (i = 0; i < b.n; i++) {
+	if (b.nodes[i].dir)
+	    fill_dir(&b, i, image_buf, bpb);
+    }
+
+    if (!dry_run) {
+	if (write_fully(fd, image_buf, meta_len, 0) < 0) {
+	    fprintf(stderr, "Write to disk image failed: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+	buf = malloc(COPY_BYTES);
+	for (i = 0; i < b.nlayout; i++)
+	    copy_file(&b, &b.nodes[b.layout[i]], buf, fd, bpb);
+	free(buf);
+	if (fsync(fd) < 0) {
+	    fprintf(stderr, "Write to disk image failed: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    close(fd);
+
+    printf("%d directories in %u clusters, %d files in %u clusters, "
+	   "%u clusters free\n", b.ndirs, b.dir_clusters, b.nfiles,
+	   (uint32_t)b.file_clusters, g->clusters - CLUST_FIRST
+	   - b.dir_clusters - (uint32_t)b.file_clusters);
+    free(image_buf);
+    free(bpb);
+    exit(0);
+}
@@ -17,194 +17,124 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
-
-/* get_name retrieves the filename from a directory entry */
-
-void get_name(char *fullname, struct direntry *dirent) 
+#include "chain.h"
+#include "lfn.h"
+#include "sum.h"
+#include "lock.h"
+
+/* find_dir walks the directories of a path, finding each one by name
+   (long or short, with case ignored) through an index of the
+   directory, which is only built the first time.  It sets *cluster to the directory the last part of the
+   path is in, and *leaf to that last part, and returns FALSE if a
+   directory on the way doesn't exist.  Each directory is locked
+   shared while it's looked up, in case another process is adding to
+   it. */
+
+int find_dir(char *path, char *buf, uint16_t *cluster, char **leaf,
+	     uint8_t *image_buf, struct bpb33* bpb)
 {
-    char name[9];
-    char extension[4];
-    int i;
-
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
+    struct dir_index *di;
+    struct direntry *dirent;
+    char *seek_name, *next_name;
 
-    /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
+    strncpy(buf, path, MAXPATHLEN);
+    buf[MAXPATHLEN - 1] = '\0';
+    seek_name = buf;
+    *cluster = 0;
 
-    /* extensions aren't normally space padded - but remove the
-       padding anyway if it's there */
-    for (i = 3; i > 0; i--) {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
-    fullname[0]='\0';
-    strcat(fullname, name);
+    while (1) {
+	/* trim leading slashes */
+	while (*seek_name == '/' || *seek_name == '\\') {
+	    seek_name++;
+	}
 
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
-	strcat(fullname, ".");
-	strcat(fullname, extension);
+	/* search for any more slashes - if so, it's a dirname */
+	for (next_name = seek_name; *next_name != '\0'; next_name++) {
+	    if (*next_name == '/' || *next_name == '\\') {
+		break;
+	    }
+	}
+	if (*next_name == '\0') {
+	    *leaf = seek_name;
+	    return TRUE;
+	}
+	*next_name++ = '\0';
+
+	lock_dir(*cluster, FALSE);
+	di = dir_index_get(*cluster, image_buf, bpb);
+	dirent = dir_index_find(di, seek_name, image_buf, bpb);
+	unlock_dir(*cluster);
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+	    return FALSE;
+	}
+	*cluster = getushort(dirent->deStartCluster);
+	seek_name = next_name;
     }
 }
 
 /* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
-
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
+   until it finds the named file or directory */
 
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
+struct direntry* find_file(char *infilename, 
 			   uint8_t *image_buf, struct bpb33* bpb)
 {
     char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
+    struct dir_index *di;
     struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
+    uint16_t cluster;
+    char *leaf;
 
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
-
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
-
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') {
-	seek_name++;
-    }
-
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) {
-	if (*next_name == '/' || *next_name == '\\') {
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
-	}
-	if (*next_name == '\0') {
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) {
-		return dirent;
-	    }
-	    break;
-	}
-	next_name++;
-    }
-
-    while (1) {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) {
-	    if (dirent->deName[0] == SLOT_EMPTY) {
-		/* we failed to find the file */
-		return NULL;
-	    }
-	    if (dirent->deName[0] == SLOT_DELETED) {
-		/* skip over a deleted file */
-		dirent++;
-		continue;
-	    }
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
-		    /* it's a directory */
-		    if (next_name == NULL) {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} else if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} else {
-		    /* assume it's a file */
-		    return dirent;
-		}
-	    }
-	    dirent++;
-	}
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) {
-	    // root dir is special
-	    dirent++;
-	} else {
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
-	}
+    if (!find_dir(infilename, buf, &cluster, &leaf, image_buf, bpb)
+	|| *leaf == '\0') {
+	return NULL;
     }
+    lock_dir(cluster, FALSE);
+    di = dir_index_get(cluster, image_buf, bpb);
+    dirent = dir_index_find(di, leaf, image_buf, bpb);
+    unlock_dir(cluster);
+    return dirent;
 }
 
-/* copy_out_file actually does the work of copying, recursing through
-   the clusters of the memory disk image, and copying out a cluster at
-   a time */
+/* copy_out_file actually does the work of copying, following the
+   chain of clusters through the memory disk image, and copying out a
+   cluster at a time.  The chain reader fetches the clusters ahead of
+   us when the image isn't memory mapped.  If sum isn't NULL, the data
+   is checksummed on the way past. */
 
 void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+		   struct sum_state *sum, uint8_t *image_buf, struct bpb33* bpb)
 {
-    int total_clusters, clust_size;
+    uint32_t clust_size, len;
+    struct chain_reader *cr;
     uint8_t *p;
 
     clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    if (cluster == 0) {
-	fprintf(stderr, "Bad file termination\n");
+    if (bytes_remaining == 0) {
 	return;
-    } else if (is_end_of_file(cluster)) {
-	return;	
-    } else if (cluster > total_clusters) {
-	abort(); /* this shouldn't be able to happen */
     }
-
-    /* map the cluster number to the data location */
-    p = cluster_to_addr(cluster, image_buf, bpb);
-
-    if (bytes_remaining <= clust_size) {
-	/* this is the last cluster */
-	fwrite(p, bytes_remaining, 1, fd);
-    } else {
-	/* more clusters after this one */
-	fwrite(p, clust_size, 1, fd);
-
-	/* recurse, continuing to copy */
-	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+    cr = chain_open(cluster, (bytes_remaining + clust_size - 1) / clust_size,
+		    image_buf, bpb);
+    while (bytes_remaining > 0 && (p = chain_next(cr, &cluster)) != NULL) {
+	/* the last cluster may be only partly used */
+	len = bytes_remaining < clust_size ? bytes_remaining : clust_size;
+	if (sum != NULL) {
+	    sum_update(sum, p, len);
+	}
+	if (fd != NULL) {
+	    fwrite(p, len, 1, fd);
+	}
+	bytes_remaining -= len;
+    }
+    chain_close(cr);
+    if (bytes_remaining > 0) {
+	fprintf(stderr, "Bad file termination\n");
     }
-    return;
 }
 
 /* copyout copies a file from the FAT-12 memory disk image to a
    regular file in the file system */
 
-void copyout(char *infilename, char* outfilename,
+void copyout(char *infilename, char* outfilename, struct sum_state *sum,
 	     uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
@@ -217,12 +147,20 @@ void copyout(char *infilename, char* outfilename,
     infilename+=2;
 
     /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
+    dirent = find_file(infilename, image_buf, bpb);
     if (dirent == NULL) {
 	fprintf(stderr, "No file called %s exists in the disk image\n",
 		infilename);
 	exit(1);
     }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	exit(1);
+    }
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) {
+	fprintf(stderr, "Cannot copy out a volume\n");
+	exit(1);
+    }
 
     /* open the real file for writing */
     fd = fopen(outfilename, "w");
@@ -235,183 +173,140 @@ void copyout(char *infilename, char* outfilename,
     /* do the actual copy out*/
     start_cluster = getushort(dirent->deStartCluster);
     size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
+    copy_out_file(fd, start_cluster, size, sum, image_buf, bpb);
+    if (sum != NULL) {
+	sum_manifest_line(stdout, sum, infilename, size, start_cluster);
+    }
     
     fclose(fd);
 }
 
 /* copy_in_file actually does the copying of the file into the memory
    image, updates the FAT, and returns the starting cluster of the
-   file */
+   file.  If sum isn't NULL, the data is checksummed as it's read.
+   The data is read a batch of clusters at a time, and the clusters
+   for a whole batch are allocated in one short hold of the FAT lock,
+   so other processes copying in at the same time aren't kept
+   waiting while the data is written. */
+
+#define COPY_BATCH 16
 
 uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
-		      uint32_t *size)
+		      uint32_t *size, struct sum_state *sum)
 {
-    uint32_t clust_size, total_clusters, i;
-    uint8_t *buf;
+    uint32_t clust_size, n, i, k, run;
+    uint8_t *buf, *p;
     size_t bytes;
+    uint16_t clusters[COPY_BATCH];
     uint16_t start_cluster = 0;
     uint16_t prev_cluster = 0;
     
     clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    buf = malloc(clust_size);
-    while(1) {
-	/* read a block of data, and store it */
-	bytes = fread(buf, 1, clust_size, fd);
-	if (bytes > 0) {
-	    *size += bytes;
-
-	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) {
-		    break;
-		}
-	    }
-
-	    if (i == total_clusters) {
+    buf = malloc(COPY_BATCH * clust_size);
+    do {
+	/* read a batch of data */
+	bytes = fread(buf, 1, COPY_BATCH * clust_size, fd);
+	if (bytes == 0) {
+	    /* we either got a read error, or reached end of file */
+	    break;
+	}
+	*size += bytes;
+	if (sum != NULL) {
+	    sum_update(sum, buf, bytes);
+	}
+	n = (bytes + clust_size - 1) / clust_size;
+	/* the end of the last cluster isn't part of the file */
+	memset(buf + bytes, 0, n * clust_size - bytes);
+
+	/* find free clusters for it.  Everything before the last one
+	   we took was in use, so each search carries on from there. */
+	lock_fat();
+	for (i = 0; i < n; i++) {
+	    clusters[i] = find_free_cluster(prev_cluster + 1, image_buf, bpb);
+	    if (clusters[i] == 0) {
 		/* oops - we ran out of disk space */
 		fprintf(stderr, "No more space in filesystem\n");
-		/* we should clean up here, rather than just exit */ 
+		/* give back the part of the chain we'd made */
+		while (start_cluster >= CLUST_FIRST
+		       && !is_end_of_file(start_cluster)) {
+		    prev_cluster = get_fat_entry(start_cluster, image_buf, bpb);
+		    set_fat_entry(start_cluster, CLUST_FREE, image_buf, bpb);
+		    start_cluster = prev_cluster;
+		}
+		flush_fat(image_buf, bpb);
+		unlock_fat();
+		close_image(image_buf);
 		exit(1);
 	    }
 
 	    /* remember the first cluster, as we need to store this in
 	       the dirent */
 	    if (start_cluster == 0) {
-		start_cluster = i;
+		start_cluster = clusters[i];
 	    } else {
 		/* link the previous cluster to this one in the FAT */
 		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
+		set_fat_entry(prev_cluster, clusters[i], image_buf, bpb);
 	    }
 	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
-
-	    /* copy the data into the cluster */
-	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
+	    set_fat_entry(clusters[i], FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+	    prev_cluster = clusters[i];
 	}
-	if (bytes < clust_size) {
-	    /* We didn't real a full cluster, so we either got a read
-	       error, or reached end of file.  We exit anyway */
-	    break;
+	/* bring the other FAT copies up to date with the new chain */
+	flush_fat(image_buf, bpb);
+	unlock_fat();
+
+	/* copy the data into the clusters, a contiguous run at a time */
+	for (i = 0; i < n; i = run) {
+	    for (run = i + 1; run < n && clusters[run] == clusters[run - 1] + 1;
+		 run++) {
+	    }
+	    lock_extent(clusters[i], run - i);
+	    for (k = i; k < run; k++) {
+		p = cluster_to_addr(clusters[k], image_buf, bpb);
+		memcpy(p, buf + k * clust_size, clust_size);
+		mark_dirty(p, clust_size);
+	    }
+	    unlock_extent(clusters[i], run - i);
 	}
-	prev_cluster = i;
-    }
+    } while (bytes == COPY_BATCH * clust_size);
 
     free(buf);
     return start_cluster;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
-
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) {
-	if (p2[i] == '/' || p2[i] == '\\') {
-	    uppername = p2+i+1;
-	}
-    }
-
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) {
-	uppername[i] = toupper(uppername[i]);
-    }
-
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    } else {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
-    }
-    if (strlen(uppername)>8) {
-	uppername[8]='\0';
-    }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
-
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
-
-    /* a real filesystem would set the time and date here, but it's
-       not necessary for this coursework */
-}
-
-
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
-
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
-{
-    while(1) {
-	if (dirent->deName[0] == SLOT_EMPTY) {
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
-	if (dirent->deName[0] == SLOT_DELETED) {
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
-	}
-	dirent++;
-    }
-}
-
 /* copyin copies a file from a regular file on the filesystem into a
    file in the FAT-12 memory disk image  */
 
-void copyin(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
+void copyin(char *infilename, char* outfilename, struct sum_state *sum,
+	    uint8_t *image_buf, struct bpb33* bpb)
 {
-    struct direntry *dirent = (void*)1;
+    char buf[MAXPATHLEN];
     FILE *fd;
-    uint16_t start_cluster;
+    struct dir_index *di;
+    uint16_t start_cluster, dir_cluster, cluster;
     uint32_t size = 0;
+    char *leaf;
+    int failed;
 
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
     /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) {
+    if (find_file(outfilename, image_buf, bpb) != NULL) {
 	fprintf(stderr, "File %s already exists\n", outfilename);
 	exit(1);
     }
 
-    /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
-    if (dirent == NULL) {
+    /* find the directory to put the file in */
+    if (!find_dir(outfilename, buf, &dir_cluster, &leaf, image_buf, bpb)) {
 	fprintf(stderr, "Directory does not exists in the disk image\n");
 	exit(1);
     }
+    if (*leaf == '\0') {
+	fprintf(stderr, "No filename given\n");
+	exit(1);
+    }
 
     /* open the real file for reading */
     fd = fopen(infilename, "r");
@@ -422,46 +317,249 @@ void copyin(char *infilename, char* outfilename,
     }
 
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
-
-    /* create the directory entry */
-    create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    start_cluster = copy_in_file(fd, image_buf, bpb, &size, sum);
+
+    /* create the directory entry, with a long name if the name isn't
+       8.3.  This reads the directory afresh, rather than using the
+       index from the lookups above, and with it locked, as another
+       process may have made a file of the same name meanwhile.
+       lfn_create then uses the same index. */
+    lock_dir(dir_cluster, TRUE);
+    dir_index_drop(dir_cluster);
+    di = dir_index_get(dir_cluster, image_buf, bpb);
+    failed = dir_index_find(di, leaf, image_buf, bpb) != NULL;
+    if (failed) {
+	fprintf(stderr, "File %s already exists\n", outfilename);
+    } else if (lfn_create(dir_cluster, leaf, ATTR_NORMAL, start_cluster,
+			  size, image_buf, bpb) == NULL) {
+	fprintf(stderr, "No room in the directory for %s\n", leaf);
+	failed = TRUE;
+    } else if (sum != NULL) {
+	sum_manifest_line(stdout, sum, outfilename, size, start_cluster);
+    }
+    if (failed) {
+	/* give the clusters back */
+	lock_fat();
+	while (start_cluster >= CLUST_FIRST && !is_end_of_file(start_cluster)) {
+	    cluster = get_fat_entry(start_cluster, image_buf, bpb);
+	    set_fat_entry(start_cluster, CLUST_FREE, image_buf, bpb);
+	    start_cluster = cluster;
+	}
+	flush_fat(image_buf, bpb);
+	unlock_fat();
+    }
+    unlock_dir(dir_cluster);
     
     fclose(fd);
+    if (failed) {
+	/* write back the clusters given up before saying so */
+	close_image(image_buf);
+	exit(1);
+    }
+}
+
+/* a manifest lists every file in the image with its checksums */
+
+struct manifest_entry {
+    char *path;
+    uint16_t cluster;
+    uint32_t size;
+    struct sum_state sum;
+};
+
+struct manifest {
+    struct manifest_entry *files;
+    int n, max;
+};
+
+/* manifest_dir adds the files in a directory and its subdirectories to
+   the manifest, without reading any file data yet */
+
+void manifest_dir(struct manifest *m, uint16_t cluster, char *path,
+		  int depth, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct manifest_entry *e;
+    struct lfn_state ls;
+    char name[LFN_MAX_UTF8];
+    char *subpath;
+    long steps = 0;
+    int d;
+
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 1);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		continue;
+	    }
+	    if (lfn_feed(&ls, dirent)) {
+		continue;
+	    }
+	    lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		continue;
+	    }
+	    sprintf(subpath, "%s%s", path, name);
+
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+		strcat(subpath, "/");
+		if (depth < MAXPATHLEN / 2) {
+		    manifest_dir(m, getushort(dirent->deStartCluster),
+				 subpath, depth + 1, image_buf, bpb);
+		}
+		/* the subdirectory may have pushed this cluster out of
+		   the I/O backend's cache, so look it up again */
+		if (cluster != 0) {
+		    dirent = (struct direntry*)
+			(cluster_to_addr(cluster, image_buf, bpb) + d);
+		}
+		continue;
+	    }
+	    if (m->n == m->max) {
+		m->max = m->max ? m->max * 2 : 64;
+		m->files = realloc(m->files,
+				   m->max * sizeof(struct manifest_entry));
+	    }
+	    e = &m->files[m->n++];
+	    e->path = strdup(subpath);
+	    e->cluster = getushort(dirent->deStartCluster);
+	    e->size = getulong(dirent->deFileSize);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry)) {
+		break;
+	    }
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || is_end_of_file(cluster)
+		|| steps++ >= bpb->bpbSectors) {
+		break;
+	    }
+	    dirent = (struct direntry*)cluster_to_addr(cluster, 
+						       image_buf, bpb);
+	}
+    }
+    free(subpath);
+}
+
+int by_cluster(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = *(struct manifest_entry**)a;
+    const struct manifest_entry *eb = *(struct manifest_entry**)b;
+    return (int)ea->cluster - (int)eb->cluster;
+}
+
+/* manifest prints the checksums of every file in the image.  The files
+   are read in the order they start on the disk, so the data clusters
+   are read once, mostly front to back, and the chain reader can keep
+   ahead of us. */
+
+void manifest(int hash64, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct manifest m;
+    struct manifest_entry **order;
+    int i;
+
+    memset(&m, 0, sizeof(m));
+    manifest_dir(&m, 0, "", 0, image_buf, bpb);
+
+    order = malloc((m.n + 1) * sizeof(struct manifest_entry*));
+    for (i = 0; i < m.n; i++) {
+	order[i] = &m.files[i];
+    }
+    qsort(order, m.n, sizeof(struct manifest_entry*), by_cluster);
+    for (i = 0; i < m.n; i++) {
+	sum_init(&order[i]->sum, hash64);
+	copy_out_file(NULL, order[i]->cluster, order[i]->size,
+		      &order[i]->sum, image_buf, bpb);
+    }
+
+    /* but list them in directory order */
+    for (i = 0; i < m.n; i++) {
+	sum_manifest_line(stdout, &m.files[i].sum, m.files[i].path,
+			  m.files[i].size, m.files[i].cluster);
+	free(m.files[i].path);
+    }
+    free(order);
+    free(m.files);
 }
 
 void usage()
 {
     fprintf(stderr, "Usage:\n");
-    fprintf(stderr, "  dos_cp <imagename> a:<filename1> <filename2>\n");
+    fprintf(stderr, "  dos_cp [-s] [-x] <imagename> a:<filename1> <filename2>\n");
     fprintf(stderr, "    copies file called filename1 from disk image to a normal file\n");
-    fprintf(stderr, "  dos_cp <imagename> <filename3> a:<filename4>\n");
+    fprintf(stderr, "  dos_cp [-s] [-x] <imagename> <filename3> a:<filename4>\n");
     fprintf(stderr, "    copies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "  dos_cp -m [-x] <imagename>\n");
+    fprintf(stderr, "    lists the checksum, size, first cluster and path of every file\n");
+    fprintf(stderr, "  -s  print the CRC32C of the data copied\n");
+    fprintf(stderr, "  -x  print a 64-bit hash of the data as well\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
+    int fd, opt, sums = 0, hash64 = 0, manifest_mode = 0;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4) {
+    struct sum_state sum;
+
+    while ((opt = getopt(argc, argv, "msx")) != -1) {
+	switch (opt) {
+	case 'm':
+	    manifest_mode = 1;
+	    break;
+	case 's':
+	    sums = 1;
+	    break;
+	case 'x':
+	    sums = 1;
+	    hash64 = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != (manifest_mode ? 1 : 3)) {
 	usage();
     }
+    argv += optind;
 
-    image_buf = mmap_file(argv[1], &fd);
+    /* copying in may happen alongside other dos_cps copying in, so
+       the image is opened for region locking */
+    if (!manifest_mode && strncmp("a:", argv[1], 2) != 0) {
+	image_buf = open_image_locked(argv[0], &fd);
+    } else {
+	image_buf = open_image(argv[0], &fd);
+    }
     bpb = check_bootsector(image_buf);
+    lock_attach(bpb);
+    sum_init(&sum, hash64);
 
-    /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) {
+    if (manifest_mode) {
+	manifest(hash64, image_buf, bpb);
+    } else if (strncmp("a:", argv[1], 2)==0) {
+	/* use the "a:" bit to determine whether we're copying in or out */
 	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
-    } else if (strncmp("a:", argv[3], 2)==0) {
+	copyout(argv[1], argv[2], sums ? &sum : NULL, image_buf, bpb);
+    } else if (strncmp("a:", argv[2], 2)==0) {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	copyin(argv[1], argv[2], sums ? &sum : NULL, image_buf, bpb);
     } else {
 	usage();
     }
-    close(fd);
+    close_image(image_buf);
     exit(0);
 }
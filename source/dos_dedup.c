@@ -0,0 +1,418 @@
+/* dos_dedup: measure how much data is duplicated within and across a
+   set of FAT-12 disk images, a cluster at a time and a file at a time,
+   without extracting anything */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "lfn.h"
+#include "sum.h"
+
+/* default memory for the cluster index, in MiB */
+#define DEFAULT_INDEX_MB 64
+
+/* where some content was first seen */
+struct location {
+    uint16_t image;
+    uint32_t file;		/* index into files, or NO_FILE */
+    uint32_t offset;		/* cluster number within the file */
+};
+
+#define NO_FILE 0xffffffff
+
+/* one distinct cluster (or file) content.  The key is the content's
+   XXH64 and CRC32C together, 96 bits, so a collision would need both
+   to collide. */
+struct index_entry {
+    uint64_t hash;
+    uint32_t crc;
+    uint32_t count;		/* 0 means the slot is empty */
+    struct location first;
+};
+
+struct index {
+    struct index_entry *slots;
+    uint32_t mask;
+    uint32_t used, max_used;
+    long dropped;		/* contents not indexed as it was full */
+};
+
+/* a file found in one of the images */
+struct file {
+    char *path;
+    uint16_t image;
+    uint16_t cluster;
+    uint32_t size;
+    int is_dir;
+};
+
+struct dedup {
+    char **images;
+    struct index clusters_ix;
+    struct index contents;	/* whole files */
+    struct file *files;
+    uint32_t nfiles, max_files;
+    int verbose;
+
+    /* per image, and reset for each: which file owns each cluster, and
+       the hash of each cluster's content */
+    uint32_t *owner;
+    uint32_t *offset;
+    uint64_t *chash;
+    uint32_t *ccrc;
+
+    long clusters, dup_clusters, dup_within;
+    uint64_t bytes, dup_bytes;
+    long nondir_files, dup_files;
+    uint64_t file_bytes, dup_file_bytes;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_dedup [-v] [-m <index MiB>] <imagename>...\n");
+    fprintf(stderr, "  -v  list each duplicate file and what it duplicates\n");
+    fprintf(stderr, "  -m  memory for the cluster index (default %d)\n",
+	    DEFAULT_INDEX_MB);
+    exit(1);
+}
+
+void index_init(struct index *ix, uint64_t bytes)
+{
+    uint32_t size = 1024;
+
+    while ((uint64_t)size * 2 * sizeof(struct index_entry) <= bytes
+	   && size < 0x40000000)
+	size *= 2;
+    ix->slots = calloc(size, sizeof(struct index_entry));
+    if (ix->slots == NULL) {
+	fprintf(stderr, "Not enough memory for the index\n");
+	exit(1);
+    }
+    ix->mask = size - 1;
+    ix->used = 0;
+    ix->max_used = size / 4 * 3;
+    ix->dropped = 0;
+}
+
+/* index_add looks a content up, adding it with this location if it's
+   new.  It returns the entry, whose count is 1 if the content is new,
+   or NULL if it's new and the index is full; memory stays bounded
+   whatever is scanned, at the cost of missing some duplicates. */
+struct index_entry *index_add(struct index *ix, uint64_t hash, uint32_t crc,
+			      struct location *loc)
+{
+    struct index_entry *e;
+    uint32_t h;
+
+    for (h = hash & ix->mask; ix->slots[h].count != 0; h = (h + 1) & ix->mask) {
+	e = &ix->slots[h];
+	if (e->hash == hash && e->crc == crc) {
+	    e->count++;
+	    return e;
+	}
+    }
+    if (ix->used >= ix->max_used) {
+	ix->dropped++;
+	return NULL;
+    }
+    ix->used++;
+    e = &ix->slots[h];
+    e->hash = hash;
+    e->crc = crc;
+    e->count = 1;
+    e->first = *loc;
+    return e;
+}
+
+uint32_t add_file(struct dedup *dd, char *path, struct direntry *dirent,
+		  uint16_t image)
+{
+    struct file *f;
+
+    if (dd->nfiles == dd->max_files) {
+	dd->max_files = dd->max_files ? dd->max_files * 2 : 256;
+	dd->files = realloc(dd->files, dd->max_files * sizeof(struct file));
+    }
+    f = &dd->files[dd->nfiles];
+    f->path = strdup(path);
+    f->image = image;
+    f->cluster = getushort(dirent->deStartCluster);
+    f->size = getulong(dirent->deFileSize);
+    f->is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+    return dd->nfiles++;
+}
+
+/* claim_chain records which file each cluster of a chain belongs to,
+   and where in the file it is */
+void claim_chain(struct dedup *dd, uint32_t file, uint32_t limit,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t cluster = dd->files[file].cluster;
+    uint32_t n = 0;
+
+    while (cluster >= CLUST_FIRST && cluster < limit
+	   && dd->owner[cluster] == NO_FILE) {
+	dd->owner[cluster] = file;
+	dd->offset[cluster] = n++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+/* follow_dir finds the files in a directory, and claims their clusters */
+void follow_dir(struct dedup *dd, uint16_t cluster, char *path, int depth,
+		uint16_t image, uint32_t limit,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct lfn_state ls;
+    char name[LFN_MAX_UTF8];
+    char *subpath;
+    uint32_t file;
+    long steps = 0;
+    int d;
+
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 1);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		continue;
+	    }
+	    if (lfn_feed(&ls, dirent))
+		continue;
+	    lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		continue;
+
+	    sprintf(subpath, "%s%s", path, name);
+	    file = add_file(dd, subpath, dirent, image);
+	    claim_chain(dd, file, limit, image_buf, bpb);
+	    if (dd->files[file].is_dir) {
+		strcat(subpath, "/");
+		if (depth < MAXPATHLEN / 2)
+		    follow_dir(dd, dd->files[file].cluster, subpath, depth + 1,
+			       image, limit, image_buf, bpb);
+		/* the subdirectory may have pushed this cluster out of
+		   the I/O backend's cache, so look it up again */
+		if (cluster != 0)
+		    dirent = (struct direntry*)
+			(cluster_to_addr(cluster, image_buf, bpb) + d);
+	    }
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= limit
+		|| steps++ >= limit)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+    free(subpath);
+}
+
+void print_location(struct dedup *dd, struct location *loc)
+{
+    if (loc->file == NO_FILE)
+	printf("%s (unreferenced cluster)", dd->images[loc->image]);
+    else
+	printf("%s:%s", dd->images[loc->image], dd->files[loc->file].path);
+}
+
+/* scan_clusters hashes every allocated cluster once, in the order
+   they are on the disk, and adds it to the cluster index.  Only the
+   bytes a file actually uses are hashed, so a file's last cluster
+   isn't told apart by whatever is in the slack after it. */
+void scan_clusters(struct dedup *dd, uint16_t image, uint32_t limit,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct index_entry *e;
+    struct location loc;
+    struct sum_state sum;
+    struct file *f;
+    uint16_t cluster, fat;
+    uint32_t len;
+
+    for (cluster = CLUST_FIRST; cluster < limit; cluster++) {
+	fat = get_fat_entry(cluster, image_buf, bpb);
+	if (fat == CLUST_FREE || fat == (FAT12_MASK & CLUST_BAD))
+	    continue;
+	len = clust_size;
+	f = dd->owner[cluster] == NO_FILE ? NULL : &dd->files[dd->owner[cluster]];
+	if (f != NULL && !f->is_dir) {
+	    if ((uint64_t)dd->offset[cluster] * clust_size >= f->size)
+		len = 0;	/* past the end of the file */
+	    else if (f->size - (uint64_t)dd->offset[cluster] * clust_size < len)
+		len = f->size - dd->offset[cluster] * clust_size;
+	}
+	sum_init(&sum, TRUE);
+	sum_update(&sum, cluster_to_addr(cluster, image_buf, bpb), len);
+	dd->chash[cluster] = sum_hash64(&sum);
+	dd->ccrc[cluster] = sum_crc(&sum);
+	if (len == 0)
+	    continue;
+
+	loc.image = image;
+	loc.file = dd->owner[cluster];
+	loc.offset = dd->offset[cluster];
+	dd->clusters++;
+	dd->bytes += len;
+	e = index_add(&dd->clusters_ix, dd->chash[cluster], dd->ccrc[cluster],
+		      &loc);
+	if (e != NULL && e->count > 1) {
+	    dd->dup_clusters++;
+	    dd->dup_bytes += len;
+	    if (e->first.image == image)
+		dd->dup_within++;
+	}
+    }
+}
+
+/* match_files hashes each file's sequence of cluster hashes, in chain
+   order, to find whole files that are duplicates */
+void match_files(struct dedup *dd, uint32_t first_file, uint32_t limit,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct index_entry *e;
+    struct location loc;
+    struct sum_state sum;
+    struct file *f;
+    uint32_t i, n;
+    uint16_t cluster;
+    uint8_t buf[12];
+
+    for (i = first_file; i < dd->nfiles; i++) {
+	f = &dd->files[i];
+	if (f->is_dir || f->size == 0)
+	    continue;
+	dd->nondir_files++;
+	dd->file_bytes += f->size;
+
+	sum_init(&sum, TRUE);
+	putulong(buf, f->size);
+	sum_update(&sum, buf, 4);
+	cluster = f->cluster;
+	for (n = 0; cluster >= CLUST_FIRST && cluster < limit
+		 && dd->owner[cluster] == i; n++) {
+	    memcpy(buf, &dd->chash[cluster], 8);
+	    memcpy(buf + 8, &dd->ccrc[cluster], 4);
+	    sum_update(&sum, buf, 12);
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	}
+
+	loc.image = f->image;
+	loc.file = i;
+	loc.offset = 0;
+	e = index_add(&dd->contents, sum_hash64(&sum), sum_crc(&sum), &loc);
+	if (e != NULL && e->count > 1) {
+	    dd->dup_files++;
+	    dd->dup_file_bytes += f->size;
+	    if (dd->verbose) {
+		print_location(dd, &loc);
+		printf(" (%u bytes) duplicates ", f->size);
+		print_location(dd, &e->first);
+		printf("\n");
+	    }
+	}
+    }
+}
+
+void scan_image(struct dedup *dd, uint16_t image)
+{
+    uint8_t *image_buf;
+    struct bpb33* bpb;
+    uint32_t limit, first_file = dd->nfiles, c;
+    int fd;
+
+    image_buf = open_image(dd->images[image], &fd);
+    bpb = check_bootsector(image_buf);
+    limit = geometry(bpb)->clusters;
+
+    dd->owner = realloc(dd->owner, limit * sizeof(uint32_t));
+    dd->offset = realloc(dd->offset, limit * sizeof(uint32_t));
+    dd->chash = realloc(dd->chash, limit * sizeof(uint64_t));
+    dd->ccrc = realloc(dd->ccrc, limit * sizeof(uint32_t));
+    for (c = 0; c < limit; c++)
+	dd->owner[c] = NO_FILE;
+
+    follow_dir(dd, 0, "", 0, image, limit, image_buf, bpb);
+    scan_clusters(dd, image, limit, image_buf, bpb);
+    match_files(dd, first_file, limit, image_buf, bpb);
+
+    close_image(image_buf);
+    free(bpb);
+}
+
+int main(int argc, char** argv)
+{
+    struct dedup dd;
+    long index_mb = DEFAULT_INDEX_MB;
+    int opt, i;
+
+    memset(&dd, 0, sizeof(dd));
+    while ((opt = getopt(argc, argv, "vm:")) != -1) {
+	switch (opt) {
+	case 'v':
+	    dd.verbose = 1;
+	    break;
+	case 'm':
+	    index_mb = atol(optarg);
+	    if (index_mb < 1)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind < 1 || argc - optind > 65535) {
+	usage();
+    }
+    dd.images = argv + optind;
+
+    /* most of the memory goes on clusters; files are far fewer */
+    index_init(&dd.clusters_ix, (uint64_t)index_mb * 1024 * 1024 / 8 * 7);
+    index_init(&dd.contents, (uint64_t)index_mb * 1024 * 1024 / 8);
+
+    for (i = 0; i < argc - optind; i++)
+	scan_image(&dd, i);
+
+    printf("Images: %d\n", argc - optind);
+    printf("Clusters: %ld in use, %llu bytes\n", dd.clusters,
+	   (unsigned long long)dd.bytes);
+    printf("Duplicate clusters: %ld (%.1f%%), %llu bytes; %ld within an image, %ld across images\n",
+	   dd.dup_clusters, dd.clusters ? 100.0 * dd.dup_clusters / dd.clusters : 0.0,
+	   (unsigned long long)dd.dup_bytes, dd.dup_within,
+	   dd.dup_clusters - dd.dup_within);
+    printf("Files: %ld, %llu bytes\n", dd.nondir_files,
+	   (unsigned long long)dd.file_bytes);
+    printf("Duplicate files: %ld (%.1f%%), %llu bytes\n", dd.dup_files,
+	   dd.nondir_files ? 100.0 * dd.dup_files / dd.nondir_files : 0.0,
+	   (unsigned long long)dd.dup_file_bytes);
+    if (dd.clusters_ix.dropped > 0 || dd.contents.dropped > 0) {
+	printf("Index full: %ld clusters and %ld files not indexed; use -m for more\n",
+	       dd.clusters_ix.dropped, dd.contents.dropped);
+    }
+    exit(0);
+}
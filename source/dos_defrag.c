@@ -0,0 +1,409 @@
+/* dos_defrag: make the files and directories in a FAT-12 disk image
+   contiguous, moving as few clusters as possible */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+/* owner values for clusters that don't belong to a file we know about */
+#define OWNER_FREE (-1)
+#define OWNER_OTHER (-2)
+
+/* a file or directory found in the image.  The dirent is found again
+   through its parent each time it's needed, because moving the parent
+   directory moves the dirent too. */
+struct dfile {
+    int parent;		/* index of the parent directory, -1 for root */
+    int slot;		/* index of the dirent within the parent */
+    int is_dir;
+    uint16_t start;	/* start cluster */
+    uint16_t *chain;	/* the clusters, in file order */
+    int nclusters;
+};
+
+struct defrag {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    struct dfile *files;
+    int nfiles, maxfiles;
+    int *owner;		/* file index for each cluster */
+    uint32_t limit;	/* first cluster number past the end of the disk */
+    uint32_t clust_size;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_defrag [-n] [-m <moves>] [-t <seconds>] <imagename>\n");
+    fprintf(stderr, "  -n  only report what would be moved\n");
+    fprintf(stderr, "  -m  stop after moving this many clusters\n");
+    fprintf(stderr, "  -t  stop after this many seconds\n");
+    exit(1);
+}
+
+/* dir_slot returns the address of dirent number slot in the directory
+   whose file index is dir (-1 for the root directory) */
+struct direntry *dir_slot(struct defrag *df, int dir, int slot)
+{
+    int per_clust = df->clust_size / sizeof(struct direntry);
+    uint16_t cluster;
+
+    if (dir < 0) {
+	return (struct direntry*)root_dir_addr(df->image_buf, df->bpb) + slot;
+    }
+    cluster = df->files[dir].chain[slot / per_clust];
+    return (struct direntry*)cluster_to_addr(cluster, df->image_buf, df->bpb)
+	+ slot % per_clust;
+}
+
+/* read_chain fills in the clusters of a file from the FAT, stopping at
+   the end of file or anything that isn't a sane cluster number */
+void read_chain(struct defrag *df, struct dfile *f)
+{
+    int max = 16;
+    uint16_t cluster = f->start;
+
+    f->chain = malloc(max * sizeof(uint16_t));
+    f->nclusters = 0;
+    while (cluster >= CLUST_FIRST && cluster < df->limit
+	   && f->nclusters < df->limit) {
+	if (f->nclusters == max) {
+	    max *= 2;
+	    f->chain = realloc(f->chain, max * sizeof(uint16_t));
+	}
+	f->chain[f->nclusters++] = cluster;
+	cluster = get_fat_entry(cluster, df->image_buf, df->bpb);
+    }
+}
+
+/* scan_dir adds everything in the directory with file index dir (-1
+   for the root) to the file list, recursing into subdirectories */
+void scan_dir(struct defrag *df, int dir, int depth)
+{
+    int per_clust = df->clust_size / sizeof(struct direntry);
+    int nslots, slot;
+    struct direntry *dirent;
+    struct dfile *f;
+
+    if (dir < 0) {
+	nslots = df->bpb->bpbRootDirEnts;
+    } else {
+	nslots = df->files[dir].nclusters * per_clust;
+    }
+    for (slot = 0; slot < nslots; slot++) {
+	dirent = dir_slot(df, dir, slot);
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    return;
+	if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.')
+	    continue;
+	if ((dirent->deAttributes & ATTR_VOLUME) != 0)
+	    continue;
+	if (getushort(dirent->deStartCluster) < CLUST_FIRST)
+	    continue;
+
+	if (df->nfiles == df->maxfiles) {
+	    df->maxfiles = df->maxfiles ? df->maxfiles * 2 : 64;
+	    df->files = realloc(df->files, df->maxfiles * sizeof(struct dfile));
+	}
+	f = &df->files[df->nfiles++];
+	f->parent = dir;
+	f->slot = slot;
+	f->is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	f->start = getushort(dirent->deStartCluster);
+	read_chain(df, f);
+	if (f->is_dir && depth < MAXPATHLEN / 2) {
+	    scan_dir(df, df->nfiles - 1, depth + 1);
+	}
+    }
+}
+
+/* count_extents returns the number of contiguous runs in a chain */
+int count_extents(struct dfile *f)
+{
+    int i, extents = f->nclusters > 0 ? 1 : 0;
+    for (i = 1; i < f->nclusters; i++) {
+	if (f->chain[i] != f->chain[i-1] + 1)
+	    extents++;
+    }
+    return extents;
+}
+
+void report(char *when, struct defrag *df)
+{
+    int i, fragmented = 0, extents = 0, n;
+    for (i = 0; i < df->nfiles; i++) {
+	n = count_extents(&df->files[i]);
+	extents += n;
+	if (n > 1)
+	    fragmented++;
+    }
+    printf("%s: %d files, %d fragmented (%.1f%%), %d extents\n", when,
+	   df->nfiles, fragmented,
+	   df->nfiles ? 100.0 * fragmented / df->nfiles : 0.0, extents);
+}
+
+/* plan_move finds the window of nclusters clusters that needs the
+   fewest clusters of file idx moving to make it contiguous.  Every
+   cluster in the window must be free or already belong to the file.
+   It returns the start of the window and sets *cost, or returns 0 if
+   there's nowhere to put the file. */
+uint16_t plan_move(struct defrag *df, int idx, int *cost)
+{
+    struct dfile *f = &df->files[idx];
+    int n = f->nclusters;
+    int *blocked, *score;
+    uint32_t c, s, best = 0;
+    int best_score = -1, i;
+
+    /* blocked[c] is the number of clusters below c the file can't use */
+    blocked = malloc((df->limit + 1) * sizeof(int));
+    blocked[0] = blocked[1] = blocked[2] = 0;
+    for (c = CLUST_FIRST; c < df->limit; c++) {
+	blocked[c+1] = blocked[c]
+	    + (df->owner[c] != OWNER_FREE && df->owner[c] != idx);
+    }
+
+    /* a window starting at s keeps cluster i of the file in place if
+       chain[i] == s + i, so only those starts can score above zero */
+    score = calloc(df->limit, sizeof(int));
+    for (i = 0; i < n; i++) {
+	if (f->chain[i] >= CLUST_FIRST + i) {
+	    score[f->chain[i] - i]++;
+	}
+    }
+    for (s = CLUST_FIRST; s + n <= df->limit; s++) {
+	if (blocked[s+n] - blocked[s] != 0)
+	    continue;
+	if (score[s] > best_score) {
+	    best_score = score[s];
+	    best = s;
+	}
+    }
+    free(blocked);
+    free(score);
+    if (best_score < 0)
+	return 0;
+    *cost = n - best_score;
+    return best;
+}
+
+/* claim_window records file idx as living in the window starting at
+   dest: in the owner map, so later plans see where it went, and in
+   its chain.  A dry run does only this, so it plans what a real run
+   would. */
+void claim_window(struct defrag *df, int idx, uint16_t dest)
+{
+    struct dfile *f = &df->files[idx];
+    uint16_t cluster;
+    int i;
+
+    for (i = 0; i < f->nclusters; i++) {
+	cluster = f->chain[i];
+	if (cluster < dest || cluster >= dest + f->nclusters)
+	    df->owner[cluster] = OWNER_FREE;
+    }
+    for (i = 0; i < f->nclusters; i++) {
+	df->owner[dest + i] = idx;
+	f->chain[i] = dest + i;
+    }
+    f->start = dest;
+}
+
+/* move_file copies file idx into the window starting at dest, and
+   rewrites its FAT chain and every dirent that refers to it */
+void move_file(struct defrag *df, int idx, uint16_t dest)
+{
+    struct dfile *f = &df->files[idx];
+    uint8_t *buf;
+    int i, j;
+    uint16_t cluster;
+    struct direntry *dirent;
+
+    /* take a copy of the data first, since the window may overlap the
+       file's current clusters */
+    buf = malloc(f->nclusters * df->clust_size);
+    for (i = 0; i < f->nclusters; i++) {
+	memcpy(buf + i * df->clust_size,
+	       cluster_to_addr(f->chain[i], df->image_buf, df->bpb),
+	       df->clust_size);
+    }
+    for (i = 0; i < f->nclusters; i++) {
+	if (f->chain[i] != dest + i) {
+	    memcpy(cluster_to_addr(dest + i, df->image_buf, df->bpb),
+		   buf + i * df->clust_size, df->clust_size);
+	    mark_dirty(cluster_to_addr(dest + i, df->image_buf, df->bpb),
+		       df->clust_size);
+	}
+    }
+    free(buf);
+
+    /* free the old clusters that are outside the window, then chain
+       the window together */
+    for (i = 0; i < f->nclusters; i++) {
+	cluster = f->chain[i];
+	if (cluster < dest || cluster >= dest + f->nclusters)
+	    set_fat_entry(cluster, CLUST_FREE, df->image_buf, df->bpb);
+    }
+    for (i = 0; i < f->nclusters; i++) {
+	cluster = dest + i;
+	if (i == f->nclusters - 1) {
+	    set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS,
+			  df->image_buf, df->bpb);
+	} else {
+	    set_fat_entry(cluster, cluster + 1, df->image_buf, df->bpb);
+	}
+    }
+    claim_window(df, idx, dest);
+
+    /* point the dirent at the new start */
+    dirent = dir_slot(df, f->parent, f->slot);
+    putushort(dirent->deStartCluster, dest);
+    mark_dirty((uint8_t*)dirent, sizeof(struct direntry));
+
+    if (f->is_dir) {
+	/* the directory's own "." entry, and the ".." entries of its
+	   subdirectories */
+	dirent = (struct direntry*)cluster_to_addr(dest, df->image_buf,
+						   df->bpb);
+	if (dirent->deName[0] == '.' && dirent->deName[1] == ' ') {
+	    putushort(dirent->deStartCluster, dest);
+	    mark_dirty((uint8_t*)dirent, sizeof(struct direntry));
+	}
+	for (j = 0; j < df->nfiles; j++) {
+	    if (df->files[j].parent != idx || !df->files[j].is_dir)
+		continue;
+	    dirent = (struct direntry*)cluster_to_addr(df->files[j].start,
+						       df->image_buf, df->bpb);
+	    if (dirent[1].deName[0] == '.' && dirent[1].deName[1] == '.') {
+		putushort(dirent[1].deStartCluster, dest);
+		mark_dirty((uint8_t*)&dirent[1], sizeof(struct direntry));
+	    }
+	}
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt, i, pass, cost;
+    int dry_run = 0;
+    long move_budget = -1;
+    double time_budget = -1;
+    long moves = 0;
+    int moved_files = 0, skipped = 0, unplaced = 0;
+    struct bpb33* bpb;
+    struct defrag df;
+    struct timespec t0, now;
+    uint32_t c;
+    uint16_t dest;
+
+    while ((opt = getopt(argc, argv, "nm:t:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    dry_run = 1;
+	    break;
+	case 'm':
+	    move_budget = atol(optarg);
+	    break;
+	case 't':
+	    time_budget = atof(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    image_buf = open_image(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    memset(&df, 0, sizeof(df));
+    df.image_buf = image_buf;
+    df.bpb = bpb;
+    df.limit = geometry(bpb)->clusters;
+    df.clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    scan_dir(&df, -1, 0);
+
+    /* work out who owns each cluster */
+    df.owner = malloc(df.limit * sizeof(int));
+    for (c = 0; c < df.limit; c++) {
+	if (c >= CLUST_FIRST
+	    && get_fat_entry(c, image_buf, bpb) == CLUST_FREE) {
+	    df.owner[c] = OWNER_FREE;
+	} else {
+	    df.owner[c] = OWNER_OTHER;
+	}
+    }
+    for (i = 0; i < df.nfiles; i++) {
+	for (c = 0; c < df.files[i].nclusters; c++) {
+	    df.owner[df.files[i].chain[c]] = i;
+	}
+    }
+
+    report("Before", &df);
+
+    /* directories first, since every walk of the tree reads them */
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < df.nfiles; i++) {
+	    struct dfile *f = &df.files[i];
+	    if (f->is_dir != (pass == 0) || count_extents(f) <= 1)
+		continue;
+	    if (time_budget >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - t0.tv_sec
+		    + (now.tv_nsec - t0.tv_nsec) / 1e9 > time_budget) {
+		    skipped++;
+		    continue;
+		}
+	    }
+	    dest = plan_move(&df, i, &cost);
+	    if (dest == 0) {
+		unplaced++;
+		continue;
+	    }
+	    if (move_budget >= 0 && moves + cost > move_budget) {
+		skipped++;
+		continue;
+	    }
+	    if (dry_run) {
+		printf("Move %d clusters to make %d contiguous at %d\n",
+		       cost, f->nclusters, dest);
+		claim_window(&df, i, dest);
+	    } else {
+		move_file(&df, i, dest);
+	    }
+	    moves += cost;
+	    moved_files++;
+	}
+    }
+
+    if (!dry_run) {
+	flush_fat(image_buf, bpb);
+	report("After", &df);
+    }
+    printf("%s %ld clusters in %d files", dry_run ? "Would move" : "Moved",
+	   moves, moved_files);
+    if (skipped > 0)
+	printf(", %d skipped over budget", skipped);
+    if (unplaced > 0)
+	printf(", %d with no room to be made contiguous", unplaced);
+    printf("\n");
+
+    close_image(image_buf);
+    exit(0);
+}
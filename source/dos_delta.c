@@ -0,0 +1,186 @@
+/* dos_delta: review a repair delta saved by dos_scandisk -n, and apply
+   it to the image or revert it */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "delta.h"
+
+/* what a run of sectors currently holds in the image */
+#define HOLDS_BEFORE 0
+#define HOLDS_AFTER 1
+#define HOLDS_OTHER 2
+
+char *holds_names[] = { "not applied", "applied", "changed since" };
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_delta [-a | -r] [-f] <imagename> <delta>\n");
+    fprintf(stderr, "  with no -a or -r, lists the changes and whether they're applied\n");
+    fprintf(stderr, "  -a  apply the repair to the image\n");
+    fprintf(stderr, "  -r  revert an applied repair\n");
+    fprintf(stderr, "  -f  go ahead even where the image has changed since\n");
+    exit(1);
+}
+
+/* describe says which part of the volume a byte offset is in */
+void describe(char *buf, uint64_t offset, struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+
+    if (offset < g->fat_offset) {
+	sprintf(buf, "boot sector");
+    } else if (offset < g->root_offset) {
+	sprintf(buf, "FAT %u from entry %u",
+		(unsigned)((offset - g->fat_offset) / g->fat_bytes) + 1,
+		(unsigned)((offset - g->fat_offset) % g->fat_bytes * 2 / 3));
+    } else if (offset < g->data_offset) {
+	sprintf(buf, "root directory entry %u",
+		(unsigned)((offset - g->root_offset) / sizeof(struct direntry)));
+    } else {
+	sprintf(buf, "cluster %u",
+		(unsigned)((offset - g->data_offset) / g->clust_bytes)
+		+ CLUST_FIRST);
+    }
+}
+
+/* holds compares a run with what's in the image now */
+int holds(struct delta *d, struct delta_run *run, uint8_t *buf)
+{
+    uint32_t len = run->count * d->sec_size;
+
+    if (memcmp(buf, run->before, len) == 0)
+	return HOLDS_BEFORE;
+    if (memcmp(buf, run->after, len) == 0)
+	return HOLDS_AFTER;
+    return HOLDS_OTHER;
+}
+
+int main(int argc, char** argv)
+{
+    struct delta *d;
+    struct bpb33* bpb;
+    struct stat statbuf;
+    uint8_t boot[512];
+    uint8_t *buf;
+    uint32_t i, max_len = 0, written = 0;
+    int fd, opt, mode = -1, force = 0, refused = 0;
+    int *state;
+
+    while ((opt = getopt(argc, argv, "arf")) != -1) {
+	switch (opt) {
+	case 'a':
+	    mode = HOLDS_AFTER;
+	    break;
+	case 'r':
+	    mode = HOLDS_BEFORE;
+	    break;
+	case 'f':
+	    force = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 2) {
+	usage();
+    }
+
+    d = delta_read(argv[optind + 1]);
+    if (d == NULL)
+	exit(1);
+    fd = open(argv[optind], mode < 0 ? O_RDONLY : O_RDWR);
+    if (fd < 0 || fstat(fd, &statbuf) < 0
+	|| read_fully(fd, boot, sizeof(boot), 0) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		argv[optind], strerror(errno));
+	exit(1);
+    }
+    if ((uint64_t)statbuf.st_size != d->image_size) {
+	fprintf(stderr, "The delta is for an image of %llu bytes, not %llu\n",
+		(unsigned long long)d->image_size,
+		(unsigned long long)statbuf.st_size);
+	exit(1);
+    }
+    bpb = check_bootsector(boot);
+
+    /* see what every run holds before touching anything, so a delta
+       that doesn't fit is refused as a whole */
+    for (i = 0; i < d->n_runs; i++) {
+	if (d->runs[i].count * d->sec_size > max_len)
+	    max_len = d->runs[i].count * d->sec_size;
+    }
+    buf = malloc(max_len > 0 ? max_len : 1);
+    state = malloc((d->n_runs + 1) * sizeof(int));
+    for (i = 0; i < d->n_runs; i++) {
+	struct delta_run *run = &d->runs[i];
+	if (read_fully(fd, buf, run->count * d->sec_size,
+		       (uint64_t)run->first * d->sec_size) < 0) {
+	    fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		    argv[optind], strerror(errno));
+	    exit(1);
+	}
+	state[i] = holds(d, run, buf);
+	if (mode < 0) {
+	    char where[64];
+	    describe(where, (uint64_t)run->first * d->sec_size, bpb);
+	    printf("sectors %6u-%-6u %08x -> %08x  %-13s %s\n", run->first,
+		   run->first + run->count - 1, run->crc_before, run->crc_after,
+		   holds_names[state[i]], where);
+	} else if (state[i] == HOLDS_OTHER) {
+	    refused++;
+	}
+    }
+
+    if (mode < 0) {
+	uint32_t secs = 0;
+	for (i = 0; i < d->n_runs; i++)
+	    secs += d->runs[i].count;
+	printf("%u sectors of %u bytes changed, in %u runs\n", secs,
+	       d->sec_size, d->n_runs);
+	exit(0);
+    }
+    if (refused > 0 && !force) {
+	fprintf(stderr, "%d runs have changed since the delta was made; "
+		"use -f to %s anyway\n", refused,
+		mode == HOLDS_AFTER ? "apply" : "revert");
+	exit(1);
+    }
+
+    for (i = 0; i < d->n_runs; i++) {
+	struct delta_run *run = &d->runs[i];
+	if (state[i] == mode)
+	    continue;
+	if (write_fully(fd, mode == HOLDS_AFTER ? run->after : run->before,
+			run->count * d->sec_size,
+			(uint64_t)run->first * d->sec_size) < 0) {
+	    fprintf(stderr, "Write to disk image failed: %s\n",
+		    strerror(errno));
+	    exit(1);
+	}
+	written += run->count;
+    }
+    if (fsync(fd) < 0) {
+	fprintf(stderr, "Write to disk image failed: %s\n", strerror(errno));
+	exit(1);
+    }
+    printf("%s %u sectors\n", mode == HOLDS_AFTER ? "Applied" : "Reverted",
+	   written);
+    close(fd);
+    free(buf);
+    free(state);
+    delta_free(d);
+    exit(0);
+}
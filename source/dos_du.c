@@ -0,0 +1,260 @@
+/* dos_du: how much space each directory of a FAT-12 disk image takes,
+   including what's lost to the unused tails of clusters, worked out in
+   one walk of the tree */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "lfn.h"
+
+/* space used by a file, or by a directory and everything below it */
+struct usage {
+    uint64_t apparent;		/* bytes the directory entries say */
+    uint64_t allocated;		/* bytes of the clusters in the chains */
+    uint64_t slack;		/* allocated to files but past their ends */
+    uint32_t files;
+};
+
+/* one line of output, kept back in -n mode until the walk is over */
+struct entry {
+    struct usage u;
+    char *path;
+};
+
+struct walk {
+    int all;			/* list files as well as directories */
+    int top;			/* only the largest this many, or 0 */
+    struct entry *heap;		/* min-heap on allocated, in -n mode */
+    int n;
+    uint32_t limit;		/* first cluster past the data area */
+    uint32_t clust_bytes;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_du [-a] [-n <count>] <imagename>\n");
+    fprintf(stderr, "  lists every directory after what's in it, with its total\n");
+    fprintf(stderr, "  -a  list the files too\n");
+    fprintf(stderr, "  -n  list only the largest, by space allocated\n");
+    exit(1);
+}
+
+/* chain_bytes returns the space allocated to the chain from cluster,
+   stopping at anything that isn't a data cluster and at loops */
+uint64_t chain_bytes(struct walk *w, uint16_t cluster, uint8_t *image_buf,
+		     struct bpb33* bpb)
+{
+    uint32_t n = 0;
+
+    while (cluster >= CLUST_FIRST && cluster < w->limit && n < w->limit) {
+	n++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return (uint64_t)n * w->clust_bytes;
+}
+
+void heap_down(struct walk *w, int i)
+{
+    struct entry e = w->heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < w->n) {
+	if (child + 1 < w->n
+	    && w->heap[child + 1].u.allocated < w->heap[child].u.allocated)
+	    child++;
+	if (w->heap[child].u.allocated >= e.u.allocated)
+	    break;
+	w->heap[i] = w->heap[child];
+	i = child;
+    }
+    w->heap[i] = e;
+}
+
+/* report prints a line, or in -n mode keeps it if it's among the
+   largest so far */
+void report(struct walk *w, struct usage *u, char *path)
+{
+    int i;
+
+    if (w->top == 0) {
+	printf("%10llu %10llu %10llu %7u  %s\n",
+	       (unsigned long long)u->allocated,
+	       (unsigned long long)u->apparent,
+	       (unsigned long long)u->slack, u->files, path);
+	return;
+    }
+    if (w->n == w->top) {
+	/* full: only something bigger than the smallest gets in */
+	if (u->allocated <= w->heap[0].u.allocated)
+	    return;
+	free(w->heap[0].path);
+	w->heap[0].u = *u;
+	w->heap[0].path = strdup(path);
+	heap_down(w, 0);
+	return;
+    }
+    i = w->n++;
+    while (i > 0 && w->heap[(i - 1) / 2].u.allocated > u->allocated) {
+	w->heap[i] = w->heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    w->heap[i].u = *u;
+    w->heap[i].path = strdup(path);
+}
+
+void add_usage(struct usage *to, struct usage *u)
+{
+    to->apparent += u->apparent;
+    to->allocated += u->allocated;
+    to->slack += u->slack;
+    to->files += u->files;
+}
+
+/* follow_dir adds up the space used below a directory, reporting each
+   subdirectory once everything in it has been counted */
+void follow_dir(struct walk *w, uint16_t cluster, char *path, int depth,
+		struct usage *total, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct lfn_state ls;
+    struct usage u;
+    char name[LFN_MAX_UTF8];
+    char *subpath;
+    int d;
+    long steps = 0;
+
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 2);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		continue;
+	    }
+	    if (lfn_feed(&ls, dirent))
+		continue;
+	    lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		continue;
+
+	    sprintf(subpath, "%s%s", path, name);
+	    memset(&u, 0, sizeof(u));
+	    u.allocated = chain_bytes(w, getushort(dirent->deStartCluster),
+				      image_buf, bpb);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+		u.apparent = getulong(dirent->deFileSize);
+		if (u.allocated > u.apparent)
+		    u.slack = u.allocated - u.apparent;
+		u.files = 1;
+		if (w->all)
+		    report(w, &u, subpath);
+	    } else {
+		/* a directory's own clusters count, but aren't slack */
+		if (depth < MAXPATHLEN / 2) {
+		    strcat(subpath, "/");
+		    follow_dir(w, getushort(dirent->deStartCluster), subpath,
+			       depth + 1, &u, image_buf, bpb);
+		    subpath[strlen(subpath) - 1] = '\0';
+		}
+		report(w, &u, subpath);
+		/* the subdirectory may have pushed this cluster out of
+		   the I/O backend's cache, so look it up again */
+		if (cluster != 0)
+		    dirent = (struct direntry*)
+			(cluster_to_addr(cluster, image_buf, bpb) + d);
+	    }
+	    add_usage(total, &u);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= w->limit
+		|| steps++ >= w->limit)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+    free(subpath);
+}
+
+int by_allocated(const void *a, const void *b)
+{
+    const struct entry *ea = a, *eb = b;
+
+    if (ea->u.allocated != eb->u.allocated)
+	return ea->u.allocated > eb->u.allocated ? -1 : 1;
+    return strcmp(ea->path, eb->path);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt, i;
+    struct bpb33* bpb;
+    struct walk w;
+    struct usage total;
+
+    memset(&w, 0, sizeof(w));
+    while ((opt = getopt(argc, argv, "an:")) != -1) {
+	switch (opt) {
+	case 'a':
+	    w.all = 1;
+	    break;
+	case 'n':
+	    w.top = atoi(optarg);
+	    if (w.top < 1)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+
+    image_buf = open_image(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+    w.limit = geometry(bpb)->clusters;
+    w.clust_bytes = geometry(bpb)->clust_bytes;
+    if (w.top > 0)
+	w.heap = malloc((w.top + 1) * sizeof(struct entry));
+
+    printf("%10s %10s %10s %7s  %s\n", "allocated", "apparent", "slack",
+	   "files", "path");
+    memset(&total, 0, sizeof(total));
+    follow_dir(&w, 0, "", 0, &total, image_buf, bpb);
+    report(&w, &total, "/");
+
+    if (w.top > 0) {
+	qsort(w.heap, w.n, sizeof(struct entry), by_allocated);
+	w.top = 0;
+	for (i = 0; i < w.n; i++) {
+	    report(&w, &w.heap[i].u, w.heap[i].path);
+	    free(w.heap[i].path);
+	}
+	free(w.heap);
+    }
+    close_image(image_buf);
+    exit(0);
+}
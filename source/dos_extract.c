@@ -0,0 +1,411 @@
+/* dos_extract: copy every file in a FAT-12 disk image out to a
+   directory tree on the host, in one pass over the directories and
+   with the file data copied by a pool of threads */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "cimg.h"
+#include "lfn.h"
+#include "sum.h"
+
+/* most threads we'll start, whatever -j says */
+#define MAX_THREADS 64
+
+/* one file or directory to create on the host */
+struct job {
+    char *path;
+    uint16_t cluster;
+    uint32_t size;
+    uint8_t attr;
+    uint16_t date, time;	/* DOS format last modified time */
+    struct sum_state sum;	/* checksums of what was written */
+    int seq;			/* order the walk found it in */
+};
+
+struct job_list {
+    struct job *jobs;
+    int n, max;
+};
+
+/* the image is mapped read only and never remapped, so cluster_to_addr
+   is plain arithmetic and the workers can share it without locking */
+struct extract {
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    uint32_t limit;		/* first cluster number past the image */
+    struct job_list files;
+    struct job_list dirs;
+    uint8_t *dir_seen;		/* directory clusters already walked */
+    int preserve;
+    int sums;			/* checksum files as they're written */
+    int hash64;
+    pthread_mutex_t lock;
+    int next;			/* next file for a worker to take */
+    int errors;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_extract [-j <threads>] [-p] [-s] [-x] <imagename> <directory>\n");
+    fprintf(stderr, "  -j  number of threads copying files (default: one per CPU)\n");
+    fprintf(stderr, "  -p  preserve modification times and read-only attributes\n");
+    fprintf(stderr, "  -s  print a manifest, like dos_cp -m, of what was written\n");
+    fprintf(stderr, "  -x  include a 64-bit hash in the manifest\n");
+    exit(1);
+}
+
+/* map_image maps the image read only; extraction never writes to it */
+uint8_t *map_image(char *filename, uint64_t *size)
+{
+    struct stat statbuf;
+    uint8_t *image_buf;
+    int fd;
+
+    if (cimg_is_compressed(filename)) {
+	fprintf(stderr, "%s is compressed; unpack it with dos_pack -d first\n",
+		filename);
+	exit(1);
+    }
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &statbuf) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		filename, strerror(errno));
+	exit(1);
+    }
+    *size = statbuf.st_size;
+    image_buf = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (image_buf == MAP_FAILED) {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+    close(fd);
+    return image_buf;
+}
+
+void add_job(struct job_list *list, char *path, struct direntry *dirent)
+{
+    struct job *job;
+
+    if (list->n == list->max) {
+	list->max = list->max ? list->max * 2 : 64;
+	list->jobs = realloc(list->jobs, list->max * sizeof(struct job));
+    }
+    job = &list->jobs[list->n];
+    job->seq = list->n++;
+    job->path = strdup(path);
+    job->cluster = getushort(dirent->deStartCluster);
+    job->size = getulong(dirent->deFileSize);
+    job->attr = dirent->deAttributes;
+    job->date = getushort(dirent->deMDate);
+    job->time = getushort(dirent->deMTime);
+}
+
+/* follow_dir walks one directory, creating its subdirectories on the
+   host as it finds them and queueing its files for the workers */
+void follow_dir(struct extract *ex, uint16_t cluster, char *path)
+{
+    struct bpb33 *bpb = ex->bpb;
+    struct direntry *dirent;
+    struct lfn_state ls;
+    char name[LFN_MAX_UTF8];
+    char *subpath, *p;
+    uint16_t sub;
+    int d;
+
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 1);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, ex->image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		continue;
+	    }
+	    if (lfn_feed(&ls, dirent))
+		continue;
+	    lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		continue;
+
+	    /* the host won't take a slash in a name */
+	    for (p = name; *p != '\0'; p++) {
+		if (*p == '/')
+		    *p = '_';
+	    }
+	    sprintf(subpath, "%s/%s", path, name);
+
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+		add_job(&ex->files, subpath, dirent);
+		continue;
+	    }
+	    if (mkdir(subpath, 0777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create directory %s: %s\n", subpath,
+			strerror(errno));
+		ex->errors++;
+		continue;
+	    }
+	    add_job(&ex->dirs, subpath, dirent);
+	    /* a damaged image can link a directory into itself */
+	    sub = getushort(dirent->deStartCluster);
+	    if (sub < CLUST_FIRST || sub >= ex->limit || ex->dir_seen[sub])
+		continue;
+	    ex->dir_seen[sub] = TRUE;
+	    follow_dir(ex, sub, subpath);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(ex->image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, ex->image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= ex->limit
+		|| ex->dir_seen[cluster])
+		break;
+	    ex->dir_seen[cluster] = TRUE;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       ex->image_buf, bpb);
+	}
+    }
+    free(subpath);
+}
+
+/* set_times gives a host file the modification time from its dirent;
+   DOS times are local time */
+void set_times(struct job *job)
+{
+    struct timeval tv[2];
+    struct tm tm;
+
+    if (job->date == 0)
+	return;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = (job->date >> 9) + 80;
+    tm.tm_mon = ((job->date >> 5) & 0x0f) - 1;
+    tm.tm_mday = job->date & 0x1f;
+    tm.tm_hour = job->time >> 11;
+    tm.tm_min = (job->time >> 5) & 0x3f;
+    tm.tm_sec = (job->time & 0x1f) * 2;
+    tm.tm_isdst = -1;
+    tv[0].tv_sec = tv[1].tv_sec = mktime(&tm);
+    tv[0].tv_usec = tv[1].tv_usec = 0;
+    if (tv[0].tv_sec != (time_t)-1)
+	utimes(job->path, tv);
+}
+
+/* extract_file copies one file out.  Runs of consecutive clusters are
+   contiguous in the mapping, so each run goes to the host in a single
+   write rather than a cluster at a time. */
+int extract_file(struct extract *ex, struct job *job)
+{
+    uint32_t clust_size = ex->bpb->bpbBytesPerSec * ex->bpb->bpbSecPerClust;
+    uint32_t remaining = job->size, len;
+    uint16_t cluster = job->cluster, first, next;
+    uint64_t offset = 0;
+    long steps = 0;
+    int fd;
+
+    sum_init(&job->sum, ex->hash64);
+    fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+	fprintf(stderr, "Can't open file %s to copy data out: %s\n",
+		job->path, strerror(errno));
+	return -1;
+    }
+    while (remaining > 0 && cluster >= CLUST_FIRST && cluster < ex->limit
+	   && steps < ex->limit) {
+	/* find the end of this run of clusters */
+	first = cluster;
+	len = clust_size;
+	next = get_fat_entry(cluster, ex->image_buf, ex->bpb);
+	while (len < remaining && next == cluster + 1 && next < ex->limit
+	       && steps++ < ex->limit) {
+	    cluster = next;
+	    len += clust_size;
+	    next = get_fat_entry(cluster, ex->image_buf, ex->bpb);
+	}
+	steps++;
+	if (len > remaining)
+	    len = remaining;
+	if (ex->sums)
+	    sum_update(&job->sum,
+		       cluster_to_addr(first, ex->image_buf, ex->bpb), len);
+	if (write_fully(fd, cluster_to_addr(first, ex->image_buf, ex->bpb),
+			len, offset) < 0) {
+	    fprintf(stderr, "Write to %s failed: %s\n", job->path,
+		    strerror(errno));
+	    close(fd);
+	    return -1;
+	}
+	offset += len;
+	remaining -= len;
+	cluster = next;
+    }
+    if (remaining > 0) {
+	fprintf(stderr, "%s: bad file termination\n", job->path);
+    }
+    if (close(fd) < 0) {
+	fprintf(stderr, "Write to %s failed: %s\n", job->path,
+		strerror(errno));
+	return -1;
+    }
+    if (ex->preserve) {
+	set_times(job);
+	if ((job->attr & ATTR_READONLY) != 0)
+	    chmod(job->path, 0444);
+    }
+    return remaining > 0 ? -1 : 0;
+}
+
+void *worker(void *arg)
+{
+    struct extract *ex = arg;
+    int i, failed = 0;
+
+    while (1) {
+	pthread_mutex_lock(&ex->lock);
+	ex->errors += failed;
+	i = ex->next++;
+	pthread_mutex_unlock(&ex->lock);
+	if (i >= ex->files.n)
+	    return NULL;
+	failed = extract_file(ex, &ex->files.jobs[i]) < 0;
+    }
+}
+
+/* biggest files first, so one large file doesn't start last and keep
+   the other threads waiting */
+int by_size(const void *a, const void *b)
+{
+    const struct job *ja = a, *jb = b;
+    return ja->size < jb->size ? 1 : ja->size > jb->size ? -1 : 0;
+}
+
+int by_seq(const void *a, const void *b)
+{
+    const struct job *ja = a, *jb = b;
+    return ja->seq - jb->seq;
+}
+
+int main(int argc, char** argv)
+{
+    struct extract ex;
+    pthread_t threads[MAX_THREADS];
+    uint64_t image_size;
+    struct geometry *g;
+    long nthreads;
+    int opt, i;
+
+    memset(&ex, 0, sizeof(ex));
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "j:psx")) != -1) {
+	switch (opt) {
+	case 'j':
+	    nthreads = atol(optarg);
+	    if (nthreads < 1)
+		usage();
+	    break;
+	case 'p':
+	    ex.preserve = 1;
+	    break;
+	case 's':
+	    ex.sums = 1;
+	    break;
+	case 'x':
+	    ex.sums = 1;
+	    ex.hash64 = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 2) {
+	usage();
+    }
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > MAX_THREADS)
+	nthreads = MAX_THREADS;
+
+    ex.image_buf = map_image(argv[optind], &image_size);
+    ex.bpb = check_bootsector(ex.image_buf);
+    /* no cluster we touch may be outside the mapping, if the image
+       has been truncated */
+    g = geometry(ex.bpb);
+    ex.limit = g->clusters;
+    if (image_size < g->data_offset)
+	ex.limit = CLUST_FIRST;
+    else if ((image_size - g->data_offset) / g->clust_bytes + CLUST_FIRST
+	     < ex.limit)
+	ex.limit = (image_size - g->data_offset) / g->clust_bytes
+	    + CLUST_FIRST;
+    ex.dir_seen = calloc(ex.limit > CLUST_FIRST ? ex.limit : CLUST_FIRST, 1);
+    if (mkdir(argv[optind + 1], 0777) < 0 && errno != EEXIST) {
+	fprintf(stderr, "Can't create directory %s: %s\n", argv[optind + 1],
+		strerror(errno));
+	exit(1);
+    }
+
+    /* walk the tree once, then hand the files out to the threads */
+    follow_dir(&ex, 0, argv[optind + 1]);
+    qsort(ex.files.jobs, ex.files.n, sizeof(struct job), by_size);
+    if (nthreads > ex.files.n)
+	nthreads = ex.files.n > 0 ? ex.files.n : 1;
+    pthread_mutex_init(&ex.lock, NULL);
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&threads[i], NULL, worker, &ex) != 0) {
+	    fprintf(stderr, "Can't start thread\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+
+    /* creating the files changed the directories' times, so set those
+       last, innermost first */
+    if (ex.preserve) {
+	for (i = ex.dirs.n - 1; i >= 0; i--) {
+	    set_times(&ex.dirs.jobs[i]);
+	    if ((ex.dirs.jobs[i].attr & ATTR_READONLY) != 0)
+		chmod(ex.dirs.jobs[i].path, 0555);
+	}
+    }
+
+    if (ex.sums) {
+	/* list the files in directory order, with paths relative to the
+	   directory they went in, as dos_cp -m does */
+	qsort(ex.files.jobs, ex.files.n, sizeof(struct job), by_seq);
+	for (i = 0; i < ex.files.n; i++) {
+	    sum_manifest_line(stdout, &ex.files.jobs[i].sum,
+			      ex.files.jobs[i].path + strlen(argv[optind + 1]) + 1,
+			      ex.files.jobs[i].size, ex.files.jobs[i].cluster);
+	}
+    } else {
+	printf("%d files, %d directories extracted to %s\n", ex.files.n,
+	       ex.dirs.n, argv[optind + 1]);
+    }
+    exit(ex.errors > 0 ? 1 : 0);
+}
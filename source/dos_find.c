@@ -0,0 +1,344 @@
+/* dos_find: list the files in a FAT-12 disk image that match a set of
+   tests, looking at the directory entries as they are walked rather
+   than formatting the tree and searching the text */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "lfn.h"
+
+/* the tests a file has to pass; a file matches if it passes them all */
+struct query {
+    char *name;			/* glob on the long or 8.3 name */
+    char *parts[MAXPATHLEN / 2];	/* glob on the path, by component */
+    int n_parts;
+    int type;			/* 'f', 'd' or 0 for either */
+    uint8_t attr_set;		/* attributes that must be set */
+    uint8_t attr_clear;		/* ... and clear */
+    int has_size, has_date, has_cluster;
+    uint32_t size_lo, size_hi;
+    uint16_t date_lo, date_hi;	/* DOS dates, which sort as numbers */
+    uint32_t cluster_lo, cluster_hi;
+    int max_depth;		/* -1 for no limit */
+    char end;			/* what each path is followed by */
+    uint32_t limit;		/* first cluster past the data area */
+    long matched, dirs, pruned;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_find [options] <imagename>\n");
+    fprintf(stderr, "  -n <glob>      the long or 8.3 name matches, ignoring case\n");
+    fprintf(stderr, "  -p <glob>      the whole path matches, a component at a time\n");
+    fprintf(stderr, "  -t f|d         only files, or only directories\n");
+    fprintf(stderr, "  -s <lo>,<hi>   size in bytes, k or M suffixes allowed\n");
+    fprintf(stderr, "  -d <lo>,<hi>   modification date, as YYYY-MM-DD\n");
+    fprintf(stderr, "  -c <lo>,<hi>   start cluster\n");
+    fprintf(stderr, "  -a <attrs>     these attributes set, from rhsda\n");
+    fprintf(stderr, "  -A <attrs>     these attributes clear\n");
+    fprintf(stderr, "  -m <depth>     go no deeper than this, 0 being the root directory\n");
+    fprintf(stderr, "  -0             end each path with a NUL, not a newline\n");
+    fprintf(stderr, "  -v             say how much of the tree was looked at\n");
+    fprintf(stderr, "  either end of a range may be left out\n");
+    exit(1);
+}
+
+uint32_t parse_size(char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    if (end == s)
+	usage();
+    if (*end == 'k' || *end == 'K')
+	n *= 1024;
+    else if (*end == 'M')
+	n *= 1024 * 1024;
+    else if (*end != '\0')
+	usage();
+    return n;
+}
+
+uint32_t parse_number(char *s)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    if (end == s || *end != '\0')
+	usage();
+    return n;
+}
+
+/* parse_date turns YYYY-MM-DD into a DOS date */
+uint32_t parse_date(char *s)
+{
+    int y, m, d;
+
+    if (sscanf(s, "%d-%d-%d", &y, &m, &d) != 3 || y < 1980 || y > 2107
+	|| m < 1 || m > 12 || d < 1 || d > 31)
+	usage();
+    return (y - 1980) << DD_YEAR_SHIFT | m << DD_MONTH_SHIFT
+	| d << DD_DAY_SHIFT;
+}
+
+/* parse_range reads "lo,hi", where either end may be missing */
+void parse_range(char *s, uint32_t (*parse)(char *), uint32_t *lo,
+		 uint32_t *hi, uint32_t max)
+{
+    char *comma = strchr(s, ',');
+
+    *lo = 0;
+    *hi = max;
+    if (comma == NULL) {
+	/* a single value */
+	*lo = *hi = parse(s);
+	return;
+    }
+    *comma = '\0';
+    if (s[0] != '\0')
+	*lo = parse(s);
+    if (comma[1] != '\0')
+	*hi = parse(comma + 1);
+}
+
+uint8_t parse_attrs(char *s)
+{
+    uint8_t attrs = 0;
+
+    for (; *s != '\0'; s++) {
+	switch (*s) {
+	case 'r': attrs |= ATTR_READONLY; break;
+	case 'h': attrs |= ATTR_HIDDEN; break;
+	case 's': attrs |= ATTR_SYSTEM; break;
+	case 'd': attrs |= ATTR_DIRECTORY; break;
+	case 'a': attrs |= ATTR_ARCHIVE; break;
+	default: usage();
+	}
+    }
+    return attrs;
+}
+
+/* matches applies the tests that only need the entry itself */
+int matches(struct query *q, struct direntry *dirent, char *name,
+	    int is_long, int depth)
+{
+    char short_name[13];
+    uint32_t n;
+
+    if (q->type == 'f' && (dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	return 0;
+    if (q->type == 'd' && (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	return 0;
+    if ((dirent->deAttributes & q->attr_set) != q->attr_set
+	|| (dirent->deAttributes & q->attr_clear) != 0)
+	return 0;
+    if (q->has_size) {
+	n = getulong(dirent->deFileSize);
+	if (n < q->size_lo || n > q->size_hi)
+	    return 0;
+    }
+    if (q->has_date) {
+	n = getushort(dirent->deMDate);
+	if (n < q->date_lo || n > q->date_hi)
+	    return 0;
+    }
+    if (q->has_cluster) {
+	n = getushort(dirent->deStartCluster);
+	if (n < q->cluster_lo || n > q->cluster_hi)
+	    return 0;
+    }
+    if (q->n_parts > 0
+	&& (depth != q->n_parts - 1
+	    || fnmatch(q->parts[depth], name, FNM_CASEFOLD) != 0))
+	return 0;
+    if (q->name != NULL && fnmatch(q->name, name, FNM_CASEFOLD) != 0) {
+	/* a long name can be matched by its 8.3 alias too */
+	if (!is_long)
+	    return 0;
+	lfn_short_name(dirent, short_name, sizeof(short_name));
+	if (fnmatch(q->name, short_name, FNM_CASEFOLD) != 0)
+	    return 0;
+    }
+    return 1;
+}
+
+/* descend says whether anything below a directory at this depth could
+   match, so whole subtrees can be skipped without reading them */
+int descend(struct query *q, char *name, int depth)
+{
+    if (q->max_depth >= 0 && depth >= q->max_depth)
+	return 0;
+    if (q->n_parts > 0
+	&& (depth >= q->n_parts - 1
+	    || fnmatch(q->parts[depth], name, FNM_CASEFOLD) != 0))
+	return 0;
+    return 1;
+}
+
+/* follow_dir walks the directory tree, printing each entry that
+   matches as it goes */
+void follow_dir(struct query *q, uint16_t cluster, char *path, int depth,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct lfn_state ls;
+    char name[LFN_MAX_UTF8];
+    char *subpath;
+    int d, is_long, is_dir;
+    long steps = 0;
+
+    q->dirs++;
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 2);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		continue;
+	    }
+	    if (lfn_feed(&ls, dirent))
+		continue;
+	    is_long = lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		continue;
+
+	    is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+	    sprintf(subpath, "%s%s", path, name);
+	    if (matches(q, dirent, name, is_long, depth)) {
+		fputs(subpath, stdout);
+		putchar(q->end);
+		q->matched++;
+	    }
+	    if (!is_dir)
+		continue;
+	    if (!descend(q, name, depth)) {
+		q->pruned++;
+		continue;
+	    }
+	    strcat(subpath, "/");
+	    if (depth < MAXPATHLEN / 2)
+		follow_dir(q, getushort(dirent->deStartCluster), subpath,
+			   depth + 1, image_buf, bpb);
+	    /* the subdirectory may have pushed this cluster out of
+	       the I/O backend's cache, so look it up again */
+	    if (cluster != 0)
+		dirent = (struct direntry*)
+		    (cluster_to_addr(cluster, image_buf, bpb) + d);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= q->limit
+		|| steps++ >= q->limit)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+    free(subpath);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt, verbose = 0;
+    struct bpb33* bpb;
+    struct query q;
+    uint32_t lo, hi;
+    char *p;
+
+    memset(&q, 0, sizeof(q));
+    q.max_depth = -1;
+    q.end = '\n';
+    while ((opt = getopt(argc, argv, "n:p:t:s:d:c:a:A:m:0v")) != -1) {
+	switch (opt) {
+	case 'n':
+	    q.name = optarg;
+	    break;
+	case 'p':
+	    /* split the pattern at the slashes, so each level of the
+	       tree is matched against its own component */
+	    q.n_parts = 0;
+	    for (p = strtok(optarg, "/"); p != NULL; p = strtok(NULL, "/")) {
+		if (q.n_parts == MAXPATHLEN / 2)
+		    usage();
+		q.parts[q.n_parts++] = p;
+	    }
+	    break;
+	case 't':
+	    if (strcmp(optarg, "f") != 0 && strcmp(optarg, "d") != 0)
+		usage();
+	    q.type = optarg[0];
+	    break;
+	case 's':
+	    parse_range(optarg, parse_size, &q.size_lo, &q.size_hi,
+			UINT32_MAX);
+	    q.has_size = 1;
+	    break;
+	case 'd':
+	    parse_range(optarg, parse_date, &lo, &hi, UINT16_MAX);
+	    q.date_lo = lo;
+	    q.date_hi = hi;
+	    q.has_date = 1;
+	    break;
+	case 'c':
+	    parse_range(optarg, parse_number, &q.cluster_lo, &q.cluster_hi,
+			UINT16_MAX);
+	    q.has_cluster = 1;
+	    break;
+	case 'a':
+	    q.attr_set |= parse_attrs(optarg);
+	    break;
+	case 'A':
+	    q.attr_clear |= parse_attrs(optarg);
+	    break;
+	case 'm':
+	    q.max_depth = parse_number(optarg);
+	    break;
+	case '0':
+	    q.end = '\0';
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+
+    image_buf = open_image(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+    q.limit = geometry(bpb)->clusters;
+    follow_dir(&q, 0, "", 0, image_buf, bpb);
+    fflush(stdout);
+    if (verbose) {
+	fprintf(stderr, "%ld matched, %ld directories read, %ld skipped\n",
+		q.matched, q.dirs, q.pruned);
+    }
+    close_image(image_buf);
+    exit(q.matched > 0 ? 0 : 1);
+}
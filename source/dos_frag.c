@@ -0,0 +1,218 @@
+/* dos_frag: list the extents of every file in a FAT-12 disk image,
+   and summarise how fragmented the files and free space are */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+/* free runs are counted in power-of-two buckets by length */
+#define HIST_BUCKETS 17
+
+struct frag_stats {
+    int files;
+    int fragmented;
+    long extents;
+    long clusters;
+};
+
+int quiet = 0;
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_frag [-s] <imagename>\n");
+    fprintf(stderr, "  -s  only print the volume summary\n");
+    exit(1);
+}
+
+/* print_extents walks the chain of one file, printing each run of
+   contiguous clusters as it goes, and adds it to the totals */
+void print_extents(char *path, uint16_t cluster, struct frag_stats *st,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    uint16_t first = cluster, last = cluster;
+    long steps = 0;
+    int extents = 0;
+
+    if (!quiet)
+	printf("%s:", path);
+    while (cluster >= CLUST_FIRST && cluster < limit && steps++ < limit) {
+	uint16_t next = get_fat_entry(cluster, image_buf, bpb);
+	st->clusters++;
+	if (next != cluster + 1) {
+	    /* end of an extent */
+	    extents++;
+	    if (!quiet) {
+		if (first == last)
+		    printf(" %u", first);
+		else
+		    printf(" %u-%u", first, last);
+	    }
+	    first = next;
+	}
+	cluster = next;
+	last = next;
+    }
+    if (!quiet)
+	printf(" (%d extent%s)\n", extents, extents == 1 ? "" : "s");
+    st->files++;
+    st->extents += extents;
+    if (extents > 1)
+	st->fragmented++;
+}
+
+void follow_dir(uint16_t cluster, char *path, int depth,
+		struct frag_stats *st, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    int d, i, len;
+    char name[9];
+    char extension[4];
+    char subpath[MAXPATHLEN+1];
+    uint16_t file_cluster;
+
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED
+		|| dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+
+	    /* names and extensions are space padded */
+	    memcpy(name, dirent->deName, 8);
+	    memcpy(extension, dirent->deExtension, 3);
+	    for (i = 8; i > 0 && (i == 8 || name[i] == ' '); i--)
+		name[i] = '\0';
+	    for (i = 3; i > 0 && (i == 3 || extension[i] == ' '); i--)
+		extension[i] = '\0';
+
+	    len = snprintf(subpath, sizeof(subpath), "%s%s", path, name);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0
+		&& extension[0] != '\0' && len < MAXPATHLEN) {
+		snprintf(subpath + len, sizeof(subpath) - len, ".%s",
+			 extension);
+	    }
+
+	    file_cluster = getushort(dirent->deStartCluster);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+		/* the directory's own chain is an extent list too */
+		strncat(subpath, "/", MAXPATHLEN - strlen(subpath));
+		print_extents(subpath, file_cluster, st, image_buf, bpb);
+		if (depth < MAXPATHLEN / 2)
+		    follow_dir(file_cluster, subpath, depth + 1, st,
+			       image_buf, bpb);
+		/* the subdirectory may have pushed this cluster out of
+		   the I/O backend's cache, so look it up again */
+		if (cluster != 0)
+		    dirent = (struct direntry*)
+			(cluster_to_addr(cluster, image_buf, bpb) + d);
+	    } else if (file_cluster != 0) {
+		print_extents(subpath, file_cluster, st, image_buf, bpb);
+	    }
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		return;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= geometry(bpb)->clusters)
+		return;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+}
+
+/* free_space makes one pass over the FAT, counting the free runs into
+   a histogram */
+void free_space(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    long hist[HIST_BUCKETS];
+    long free_clusters = 0, runs = 0, largest = 0, run = 0;
+    uint32_t c;
+    int b;
+
+    memset(hist, 0, sizeof(hist));
+    for (c = CLUST_FIRST; c <= limit; c++) {
+	if (c < limit && get_fat_entry(c, image_buf, bpb) == CLUST_FREE) {
+	    run++;
+	    free_clusters++;
+	    continue;
+	}
+	if (run > 0) {
+	    runs++;
+	    if (run > largest)
+		largest = run;
+	    for (b = 0; b < HIST_BUCKETS - 1 && (2L << b) <= run; b++)
+		;
+	    hist[b]++;
+	}
+	run = 0;
+    }
+
+    printf("Free clusters: %ld in %ld runs, largest run %ld\n",
+	   free_clusters, runs, largest);
+    for (b = 0; b < HIST_BUCKETS; b++) {
+	if (hist[b] == 0)
+	    continue;
+	if (b == HIST_BUCKETS - 1)
+	    printf("  %6ld+       : %ld\n", 1L << b, hist[b]);
+	else
+	    printf("  %6ld-%-6ld: %ld\n", 1L << b, (2L << b) - 1, hist[b]);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt;
+    struct bpb33* bpb;
+    struct frag_stats st;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+	switch (opt) {
+	case 's':
+	    quiet = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+
+    image_buf = open_image(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    memset(&st, 0, sizeof(st));
+    follow_dir(0, "", 0, &st, image_buf, bpb);
+
+    printf("Files: %d, fragmented: %d (%.1f%%)\n", st.files, st.fragmented,
+	   st.files ? 100.0 * st.fragmented / st.files : 0.0);
+    printf("Extents: %ld, mean length %.1f clusters\n", st.extents,
+	   st.extents ? (double)st.clusters / st.extents : 0.0);
+    free_space(image_buf, bpb);
+
+    close_image(image_buf);
+    exit(0);
+}
@@ -0,0 +1,230 @@
+/* dos_iobench: compare the I/O backends by reading every directory and
+   file cluster of a disk image, first with a cold page cache and then
+   again with everything warm */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "chain.h"
+#include "cimg.h"
+
+struct bench_stats {
+    long clusters;
+    uint64_t sum;	/* so the reads can't be optimised away */
+};
+
+/* read file chains through chain readers rather than cluster by cluster */
+int use_chain = 0;
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_iobench [-n <passes>] [-c] <imagename> [<backend> ...]\n");
+    fprintf(stderr, "  -c  read files through chain readers\n");
+    fprintf(stderr, "  backends default to all of them, plus pread with chain\n");
+    fprintf(stderr, "  readers; DOS_IO_CACHE sets the cache or window budget in KiB\n");
+    exit(1);
+}
+
+/* sum_cluster touches every word of a cluster */
+void sum_cluster(uint8_t *p, struct bench_stats *st, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint64_t w, sum = 0;
+    uint32_t i;
+
+    for (i = 0; i + 8 <= clust_size; i += 8) {
+	memcpy(&w, p + i, 8);
+	sum ^= w;
+    }
+    st->sum += sum;
+    st->clusters++;
+}
+
+/* read_chain reads every cluster of a file or directory */
+void read_chain(uint16_t cluster, struct bench_stats *st,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct chain_reader *cr;
+    uint8_t *p;
+    long steps = 0;
+
+    if (use_chain) {
+	cr = chain_open(cluster, 0, image_buf, bpb);
+	while ((p = chain_next(cr, &cluster)) != NULL)
+	    sum_cluster(p, st, bpb);
+	chain_close(cr);
+	return;
+    }
+    while (cluster >= CLUST_FIRST && !is_end_of_file(cluster)
+	   && steps++ < bpb->bpbSectors) {
+	sum_cluster(cluster_to_addr(cluster, image_buf, bpb), st, bpb);
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+}
+
+void follow_dir(uint16_t cluster, int depth, struct bench_stats *st,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    struct direntry *dirent;
+    uint32_t d;
+    long steps = 0;
+
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < clust_size; d += sizeof(struct direntry), dirent++) {
+	    uint16_t file_cluster;
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return;
+	    if (dirent->deName[0] == SLOT_DELETED
+		|| dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    file_cluster = getushort(dirent->deStartCluster);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+		read_chain(file_cluster, st, image_buf, bpb);
+		if (depth < MAXPATHLEN / 2)
+		    follow_dir(file_cluster, depth + 1, st, image_buf, bpb);
+	    } else {
+		read_chain(file_cluster, st, image_buf, bpb);
+	    }
+	    /* reading may have pushed this cluster out of the cache */
+	    if (cluster != 0)
+		dirent = (struct direntry*)
+		    (cluster_to_addr(cluster, image_buf, bpb) + d);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		return;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || is_end_of_file(cluster)
+		|| steps++ >= bpb->bpbSectors)
+		return;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* drop_cache asks the kernel to forget the image's cached pages */
+void drop_cache(char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+	fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void run(char *filename, struct io_backend *backend, int passes)
+{
+    uint8_t *image_buf;
+    struct bpb33* bpb;
+    struct bench_stats st;
+    char name[32];
+    double t, cold, warm = 0;
+    uint32_t clust_size;
+    int fd, pass;
+
+    drop_cache(filename);
+    t = now();
+    image_buf = open_image_backend(filename, &fd, backend);
+    bpb = check_bootsector(image_buf);
+    memset(&st, 0, sizeof(st));
+    follow_dir(0, 0, &st, image_buf, bpb);
+    cold = now() - t;
+
+    for (pass = 0; pass < passes; pass++) {
+	t = now();
+	follow_dir(0, 0, &st, image_buf, bpb);
+	warm += now() - t;
+    }
+    warm /= passes;
+    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    close_image(image_buf);
+    free(bpb);
+
+    st.clusters /= passes + 1;
+    snprintf(name, sizeof(name), "%s%s", backend->name,
+	     use_chain ? "+chain" : "");
+    printf("%-12s %8ld %10.3f %10.1f %10.3f %10.1f   (%016llx)\n",
+	   name, st.clusters, cold * 1000,
+	   st.clusters * clust_size / cold / 1e6, warm * 1000,
+	   st.clusters * clust_size / warm / 1e6,
+	   (unsigned long long)st.sum);
+}
+
+int main(int argc, char** argv)
+{
+    struct io_backend *backend;
+    int passes = 5;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "n:c")) != -1) {
+	switch (opt) {
+	case 'c':
+	    use_chain = 1;
+	    break;
+	case 'n':
+	    passes = atoi(optarg);
+	    if (passes < 1)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind < 1) {
+	usage();
+    }
+
+    printf("%-12s %8s %10s %10s %10s %10s\n", "backend", "clusters",
+	   "cold ms", "cold MB/s", "warm ms", "warm MB/s");
+    if (argc - optind == 1 && cimg_is_compressed(argv[optind])) {
+	run(argv[optind], &io_cimg_backend, passes);
+	use_chain = 1;
+	run(argv[optind], &io_cimg_backend, passes);
+    } else if (argc - optind == 1) {
+	run(argv[optind], &io_mmap_backend, passes);
+	run(argv[optind], &io_pread_backend, passes);
+	run(argv[optind], &io_window_backend, passes);
+	use_chain = 1;
+	run(argv[optind], &io_pread_backend, passes);
+    }
+    for (i = optind + 1; i < argc; i++) {
+	backend = io_find_backend(argv[i]);
+	if (backend == NULL) {
+	    fprintf(stderr, "Unknown I/O backend %s\n", argv[i]);
+	    exit(1);
+	}
+	run(argv[optind], backend, passes);
+    }
+    exit(0);
+}
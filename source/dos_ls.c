@@ -15,6 +15,7 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "lfn.h"
 
 
 void print_indent(int indent)
@@ -28,7 +29,10 @@ void follow_dir(uint16_t cluster, int indent,
 		uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent;
-    int d, i;
+    struct lfn_state ls;
+    char long_name[LFN_MAX_UTF8];
+    int d, i, is_long;
+    lfn_reset(&ls);
     dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
     while (1) {
 	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
@@ -45,8 +49,18 @@ void follow_dir(uint16_t cluster, int indent,
 		return;
 
 	    /* skip over deleted entries */
-	    if (((uint8_t)name[0]) == SLOT_DELETED)
+	    if (((uint8_t)name[0]) == SLOT_DELETED) {
+		lfn_reset(&ls);
+		dirent++;
 		continue;
+	    }
+
+	    /* long name slots come before the entry they name */
+	    if (lfn_feed(&ls, dirent)) {
+		dirent++;
+		continue;
+	    }
+	    is_long = lfn_name(&ls, dirent, long_name, sizeof(long_name));
 
 	    /* names are space padded - remove the spaces */
 	    for (i = 8; i > 0; i--) {
@@ -78,22 +92,35 @@ void follow_dir(uint16_t cluster, int indent,
             printf("Volume: %s\n", name);
 	    } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
 	        print_indent(indent);
-            printf("%s (directory)\n", name);
+            printf("%s (directory)\n", is_long ? long_name : name);
             file_cluster = getushort(dirent->deStartCluster);
             follow_dir(file_cluster, indent+2, image_buf, bpb);
+	    /* the subdirectory may have pushed this cluster out of
+	       the I/O backend's cache, so look it up again */
+	    if (cluster != 0)
+		dirent = (struct direntry*)
+		    (cluster_to_addr(cluster, image_buf, bpb) + d);
 	    } else {
 		size = getulong(dirent->deFileSize);
 	        print_indent(indent);
-            printf("%s.%s (%u bytes)\n", name, extension, size);
+	    if (is_long)
+		printf("%s (%u bytes)\n", long_name, size);
+	    else
+		printf("%s.%s (%u bytes)\n", name, extension, size);
 	    }
 	    dirent++;
 	}
 	if (cluster == 0) {
 	    // root dir is special
-	    dirent++;
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		return;
 	} else {
 	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
+	    /* a directory that fills its last cluster has no end marker */
+	    if (cluster < CLUST_FIRST || cluster >= geometry(bpb)->clusters)
+		return;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
 						       image_buf, bpb);
 	}
     }
@@ -114,9 +141,9 @@ int main(int argc, char** argv)
 	usage();
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = open_image(argv[1], &fd);
     bpb = check_bootsector(image_buf);
     follow_dir(0, 0, image_buf, bpb);
-    close(fd);
+    close_image(image_buf);
     exit(0);
 }
@@ -0,0 +1,315 @@
+/* dos_mkfs: make a new, empty FAT-12 disk image, from one of the usual
+   floppy formats or from a geometry given on the command line.  Only
+   the boot sector, FATs and root directory are written; the data area
+   is left as a hole in the file, so making an image costs the same
+   however big it is. */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+
+/* the most clusters a FAT-12 volume can have */
+#define FAT12_MAX_CLUSTERS 4084
+
+struct format {
+    char *name;
+    uint16_t sectors;
+    uint8_t sec_per_clust;
+    uint16_t root_ents;
+    uint8_t media;
+    uint16_t sec_per_track;
+    uint16_t heads;
+};
+
+/* the standard floppy formats, by size in KiB */
+struct format presets[] = {
+    { "160",  320,  1,  64, 0xfe,  8, 1 },
+    { "180",  360,  1,  64, 0xfc,  9, 1 },
+    { "320",  640,  2, 112, 0xff,  8, 2 },
+    { "360",  720,  2, 112, 0xfd,  9, 2 },
+    { "720",  1440, 2, 112, 0xf9,  9, 2 },
+    { "1200", 2400, 1, 224, 0xf9, 15, 2 },
+    { "1440", 2880, 1, 224, 0xf0, 18, 2 },
+    { "2880", 5760, 2, 240, 0xf0, 36, 2 },
+    { NULL }
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_mkfs [options] <imagename>\n");
+    fprintf(stderr, "  -t <format>    a floppy format: 160, 180, 320, 360, 720, 1200,\n");
+    fprintf(stderr, "                 1440 (the default) or 2880\n");
+    fprintf(stderr, "  -s <sectors>   total sectors, for a volume of some other size\n");
+    fprintf(stderr, "  -b <bytes>     bytes per sector (512)\n");
+    fprintf(stderr, "  -c <sectors>   sectors per cluster (enough for FAT-12 with -s)\n");
+    fprintf(stderr, "  -r <entries>   root directory entries\n");
+    fprintf(stderr, "  -n <count>     number of FATs (2)\n");
+    fprintf(stderr, "  -R <sectors>   reserved sectors (1)\n");
+    fprintf(stderr, "  -L <label>     volume label\n");
+    fprintf(stderr, "  -i <hex>       volume ID, rather than one from the time\n");
+    fprintf(stderr, "  -a             allocate the data area, rather than leave a hole\n");
+    fprintf(stderr, "  -f             overwrite the image if it exists\n");
+    exit(1);
+}
+
+uint32_t parse_number(char *s, uint32_t lo, uint32_t hi)
+{
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+
+    if (end == s || *end != '\0' || n < lo || n > hi)
+	usage();
+    return n;
+}
+
+int power_of_two(uint32_t n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+/* fat_sectors works out how big each FAT has to be.  The FATs come
+   out of the same sectors as the clusters they describe, so this goes
+   round until the size stops growing. */
+uint16_t fat_sectors(uint32_t sectors, uint32_t bytes_per_sec,
+		     uint32_t sec_per_clust, uint32_t reserved,
+		     uint32_t fats, uint32_t root_secs)
+{
+    uint32_t fat_secs = 1, clusters, need;
+    uint32_t used;
+
+    while (1) {
+	used = reserved + fats * fat_secs + root_secs;
+	clusters = sectors > used ? (sectors - used) / sec_per_clust : 0;
+	/* 12 bits for each cluster, and for the two reserved entries */
+	need = ((clusters + CLUST_FIRST) * 3 / 2 + 1 + bytes_per_sec - 1)
+	    / bytes_per_sec;
+	if (need <= fat_secs)
+	    return fat_secs;
+	fat_secs = need;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    struct format fmt, *preset = &presets[6];
+    struct bootsector50 *bs;
+    struct byte_bpb50 *bpb;
+    struct extboot *ext;
+    struct direntry *dirent;
+    struct bpb33 *vol;
+    uint32_t bytes_per_sec = 512, reserved = 1, fats = 2;
+    uint32_t sectors = 0, sec_per_clust = 0, root_ents = 0;
+    uint32_t root_secs, fat_secs, volume_id, clusters, i;
+    uint64_t meta_len, size;
+    uint8_t *meta, *fat;
+    char label[12];
+    char *filename, *end;
+    int fd, opt, force = 0, allocate = 0, has_id = 0, has_label = 0;
+
+    while ((opt = getopt(argc, argv, "t:s:b:c:r:n:R:L:i:af")) != -1) {
+	switch (opt) {
+	case 't':
+	    for (preset = presets; preset->name != NULL; preset++) {
+		if (strcmp(preset->name, optarg) == 0)
+		    break;
+	    }
+	    if (preset->name == NULL)
+		usage();
+	    break;
+	case 's':
+	    /* the BPB we read only has the 16 bit sector count */
+	    sectors = parse_number(optarg, 16, 65535);
+	    break;
+	case 'b':
+	    bytes_per_sec = parse_number(optarg, 512, 4096);
+	    if (!power_of_two(bytes_per_sec))
+		usage();
+	    break;
+	case 'c':
+	    sec_per_clust = parse_number(optarg, 1, 128);
+	    if (!power_of_two(sec_per_clust))
+		usage();
+	    break;
+	case 'r':
+	    root_ents = parse_number(optarg, 16, 4096);
+	    break;
+	case 'n':
+	    fats = parse_number(optarg, 1, 4);
+	    break;
+	case 'R':
+	    reserved = parse_number(optarg, 1, 64);
+	    break;
+	case 'L':
+	    /* labels are 8.3 style names, without the dot */
+	    memset(label, ' ', 11);
+	    for (i = 0; optarg[i] != '\0'; i++) {
+		if (i == 11)
+		    usage();
+		label[i] = toupper((unsigned char)optarg[i]);
+	    }
+	    label[11] = '\0';
+	    has_label = 1;
+	    break;
+	case 'i':
+	    volume_id = strtoul(optarg, &end, 16);
+	    if (end == optarg || *end != '\0')
+		usage();
+	    has_id = 1;
+	    break;
+	case 'a':
+	    allocate = 1;
+	    break;
+	case 'f':
+	    force = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+    filename = argv[optind];
+
+    fmt = *preset;
+    if (sectors != 0) {
+	/* a volume of some other size: like a hard disk partition */
+	fmt.sectors = sectors;
+	fmt.media = 0xf8;
+	fmt.sec_per_track = 32;
+	fmt.heads = 64;
+	fmt.root_ents = 512;
+	fmt.sec_per_clust = 0;
+    }
+    if (sec_per_clust != 0)
+	fmt.sec_per_clust = sec_per_clust;
+    if (root_ents != 0)
+	fmt.root_ents = root_ents;
+    /* the root directory is a whole number of sectors */
+    fmt.root_ents = (fmt.root_ents * sizeof(struct direntry) + bytes_per_sec
+		     - 1) / bytes_per_sec * bytes_per_sec
+	/ sizeof(struct direntry);
+    root_secs = fmt.root_ents * sizeof(struct direntry) / bytes_per_sec;
+
+    if (fmt.sec_per_clust == 0) {
+	/* the smallest clusters that FAT-12 can count */
+	for (fmt.sec_per_clust = 1; fmt.sec_per_clust < 128;
+	     fmt.sec_per_clust *= 2) {
+	    fat_secs = fat_sectors(fmt.sectors, bytes_per_sec,
+				   fmt.sec_per_clust, reserved, fats,
+				   root_secs);
+	    if ((fmt.sectors - reserved - fats * fat_secs - root_secs)
+		/ fmt.sec_per_clust <= FAT12_MAX_CLUSTERS)
+		break;
+	}
+    }
+    fat_secs = fat_sectors(fmt.sectors, bytes_per_sec, fmt.sec_per_clust,
+			   reserved, fats, root_secs);
+    if (reserved + fats * fat_secs + root_secs + fmt.sec_per_clust
+	> fmt.sectors) {
+	fprintf(stderr, "%u sectors is too small for a volume\n",
+		fmt.sectors);
+	exit(1);
+    }
+
+    /* the boot sector, FATs and root directory, all zeroes to start */
+    meta_len = (uint64_t)(reserved + fats * fat_secs + root_secs)
+	* bytes_per_sec;
+    meta = calloc(meta_len, 1);
+
+    bs = (struct bootsector50*)meta;
+    bs->bsJump[0] = 0xeb;
+    bs->bsJump[1] = 0x3c;
+    bs->bsJump[2] = 0x90;
+    memcpy(bs->bsOemName, "BSD  4.4", 8);
+    bpb = (struct byte_bpb50*)bs->bsBPB;
+    putushort(bpb->bpbBytesPerSec, bytes_per_sec);
+    bpb->bpbSecPerClust = fmt.sec_per_clust;
+    putushort(bpb->bpbResSectors, reserved);
+    bpb->bpbFATs = fats;
+    putushort(bpb->bpbRootDirEnts, fmt.root_ents);
+    putushort(bpb->bpbSectors, fmt.sectors);
+    bpb->bpbMedia = fmt.media;
+    putushort(bpb->bpbFATsecs, fat_secs);
+    putushort(bpb->bpbSecPerTrack, fmt.sec_per_track);
+    putushort(bpb->bpbHeads, fmt.heads);
+    putulong(bpb->bpbHiddenSecs, 0);
+    putulong(bpb->bpbHugeSectors, 0);
+
+    if (!has_id)
+	volume_id = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    ext = (struct extboot*)bs->bsExt;
+    ext->exDriveNumber = fmt.media == 0xf8 ? 0x80 : 0;
+    ext->exBootSignature = EXBOOTSIG;
+    putulong(ext->exVolumeID, volume_id);
+    memcpy(ext->exVolumeLabel, has_label ? label : "NO NAME    ", 11);
+    memcpy(ext->exFileSysType, "FAT12   ", 8);
+    /* not bootable: ask the BIOS to try the next device */
+    bs->bsBootCode[0] = 0xcd;
+    bs->bsBootCode[1] = 0x18;
+    bs->bsBootSectSig0 = BOOTSIG0;
+    bs->bsBootSectSig1 = BOOTSIG1;
+
+    /* check it reads back, and that FAT-12 can count the clusters */
+    vol = check_bootsector(meta);
+    clusters = geometry(vol)->clusters - CLUST_FIRST;
+    if (clusters > FAT12_MAX_CLUSTERS) {
+	fprintf(stderr, "%u clusters is too many for FAT-12; "
+		"use bigger clusters\n", clusters);
+	exit(1);
+    }
+
+    /* the first two FAT entries hold the media byte and an end of
+       chain mark */
+    for (i = 0; i < fats; i++) {
+	fat = fat_addr(i, meta, vol);
+	fat[0] = fmt.media;
+	fat[1] = 0xff;
+	fat[2] = 0xff;
+    }
+    if (has_label) {
+	dirent = (struct direntry*)root_dir_addr(meta, vol);
+	memcpy(dirent->deName, label, 11);
+	dirent->deAttributes = ATTR_VOLUME;
+    }
+
+    fd = open(filename, O_RDWR | O_CREAT | (force ? O_TRUNC : O_EXCL), 0666);
+    if (fd < 0) {
+	fprintf(stderr, "Cannot create disk image file %s:\n%s\n",
+		filename, strerror(errno));
+	exit(1);
+    }
+    size = (uint64_t)fmt.sectors * bytes_per_sec;
+    if (ftruncate(fd, size) < 0
+	|| write_fully(fd, meta, meta_len, 0) < 0
+	|| (allocate && (errno = posix_fallocate(fd, meta_len,
+						 size - meta_len)) != 0)
+	|| fsync(fd) < 0) {
+	fprintf(stderr, "Write to disk image failed: %s\n", strerror(errno));
+	unlink(filename);
+	exit(1);
+    }
+    close(fd);
+
+    printf("%s: %u sectors of %u bytes, %u clusters of %u bytes, "
+	   "volume ID %04x-%04x\n", filename, fmt.sectors, bytes_per_sec,
+	   clusters, geometry(vol)->clust_bytes, volume_id >> 16,
+	   volume_id & 0xffff);
+    free(vol);
+    free(meta);
+    exit(0);
+}
@@ -0,0 +1,170 @@
+/* dos_pack: convert a FAT-12 disk image to the compressed image format
+   that the other tools can read directly, and back again */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "cimg.h"
+
+/* default chunk size in KiB */
+#define DEFAULT_CHUNK_KB 64
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_pack [-c <chunk KiB>] <imagename> <packedname>\n");
+    fprintf(stderr, "       dos_pack -d <packedname> <imagename>\n");
+    fprintf(stderr, "  -c  size of the independently compressed chunks (default %d)\n",
+	    DEFAULT_CHUNK_KB);
+    fprintf(stderr, "  -d  unpack a compressed image to a plain one\n");
+    exit(1);
+}
+
+int open_output(char *filename)
+{
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+	fprintf(stderr, "Can't open file %s to write: %s\n", filename,
+		strerror(errno));
+	exit(1);
+    }
+    return fd;
+}
+
+void failed(char *what, char *filename)
+{
+    fprintf(stderr, "%s %s failed: %s\n", what, filename, strerror(errno));
+    exit(1);
+}
+
+void pack(char *in_name, char *out_name, uint32_t chunk_kb)
+{
+    struct cimg c;
+    struct stat statbuf;
+    uint8_t boot[512], *buf;
+    uint64_t meta_len;
+    uint32_t clust_size, chunk_size, i;
+    int in, out;
+
+    in = open(in_name, O_RDONLY);
+    if (in < 0 || fstat(in, &statbuf) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		in_name, strerror(errno));
+	exit(1);
+    }
+    if (read_fully(in, boot, sizeof(boot), 0) < 0)
+	failed("Read from", in_name);
+    meta_len = io_meta_length(boot, &clust_size);
+    if (clust_size == 0 || meta_len == 0 || meta_len > statbuf.st_size) {
+	fprintf(stderr, "Bad geometry in boot sector of %s\n", in_name);
+	exit(1);
+    }
+
+    /* chunks are whole clusters, so no cluster spans two of them */
+    chunk_size = chunk_kb * 1024 / clust_size * clust_size;
+    if (chunk_size == 0)
+	chunk_size = clust_size;
+
+    out = open_output(out_name);
+    cimg_create(&c, out, statbuf.st_size, meta_len, chunk_size);
+    buf = malloc(chunk_size > meta_len ? chunk_size : meta_len);
+    for (i = 0; i < c.nchunks; i++) {
+	if (read_fully(in, buf, cimg_chunk_len(&c, i),
+		       cimg_chunk_start(&c, i)) < 0)
+	    failed("Read from", in_name);
+	if (cimg_write_chunk(&c, i, buf) < 0)
+	    failed("Write to", out_name);
+    }
+    if (cimg_write_index(&c) < 0)
+	failed("Write to", out_name);
+
+    printf("%s: %u chunks of %u bytes, %llu -> %llu bytes (%.1f%%)\n",
+	   out_name, c.nchunks, chunk_size,
+	   (unsigned long long)c.image_size, (unsigned long long)c.end,
+	   c.image_size ? 100.0 * c.end / c.image_size : 0.0);
+    free(buf);
+    cimg_free(&c);
+    close(in);
+    if (close(out) < 0)
+	failed("Write to", out_name);
+}
+
+void unpack(char *in_name, char *out_name)
+{
+    struct cimg c;
+    uint8_t *buf;
+    uint32_t i, len, j;
+    int in, out;
+
+    in = open(in_name, O_RDONLY);
+    if (in < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		in_name, strerror(errno));
+	exit(1);
+    }
+    if (cimg_open(&c, in) < 0) {
+	fprintf(stderr, "%s is not a compressed disk image\n", in_name);
+	exit(1);
+    }
+
+    out = open_output(out_name);
+    buf = malloc(c.chunk_size > c.first_len ? c.chunk_size : c.first_len);
+    for (i = 0; i < c.nchunks; i++) {
+	if (cimg_read_chunk(&c, i, buf) < 0)
+	    failed("Read from", in_name);
+	/* chunks of zeros are left as holes */
+	len = cimg_chunk_len(&c, i);
+	for (j = 0; j < len && buf[j] == 0; j++)
+	    ;
+	if (j < len && write_fully(out, buf, len, cimg_chunk_start(&c, i)) < 0)
+	    failed("Write to", out_name);
+    }
+    if (ftruncate(out, c.image_size) < 0)
+	failed("Write to", out_name);
+    free(buf);
+    cimg_free(&c);
+    close(in);
+    if (close(out) < 0)
+	failed("Write to", out_name);
+}
+
+int main(int argc, char** argv)
+{
+    int opt, unpacking = 0;
+    long chunk_kb = DEFAULT_CHUNK_KB;
+
+    while ((opt = getopt(argc, argv, "c:d")) != -1) {
+	switch (opt) {
+	case 'c':
+	    chunk_kb = atol(optarg);
+	    if (chunk_kb < 1 || chunk_kb > 65536)
+		usage();
+	    break;
+	case 'd':
+	    unpacking = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 2) {
+	usage();
+    }
+
+    if (unpacking)
+	unpack(argv[optind], argv[optind+1]);
+    else
+	pack(argv[optind], argv[optind+1], chunk_kb);
+    exit(0);
+}
@@ -14,6 +14,9 @@
 #include "direntry.h"
 #include "fat.h"
 #include "dos.h"
+#include "ckpt.h"
+#include "chain.h"
+#include "sidecar.h"
 
 //finds all the clusters that are in used
 void assign_used_clusters(int nonEmptyClusters[], uint16_t cluster, uint32_t size, uint8_t *image_buf, struct bpb33* bpb)
@@ -79,50 +82,128 @@ int check_file_size(uint16_t cluster, uint32_t size, uint8_t *image_buf, struct
     }
 }
 
+//copies out a directory entry's name and extension without the space padding
+void split_name(struct direntry *dirent, char *name, char *extension)
+{
+    int i;
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+    
+    /* names are space padded - remove the spaces */
+    for (i = 8; i > 0; i--) {
+        if (name[i] == ' ')
+            name[i] = '\0';
+        else
+            break;
+    }
+    
+    /* remove the spaces from extensions */
+    for (i = 3; i > 0; i--) {
+        if (extension[i] == ' ')
+            extension[i] = '\0';
+        else
+            break;
+    }
+}
+
+//checks one file found in a directory
+//if check = 0 it marks the file's clusters used
+//if check = 1 it checks the file's size against its chain
+void check_file(int check, int nonEmptyClusters[], struct direntry *dirent, char *name, char *extension, uint8_t *image_buf, struct bpb33* bpb)
+{
+    //the start cluster of the file
+    uint16_t file_cluster = getushort(dirent->deStartCluster);
+    //the size of file in bytes
+    uint32_t size = getulong(dirent->deFileSize);
+    //an empty file has no clusters to follow
+    if (file_cluster < CLUST_FIRST) {
+        return;
+    }
+    //check for used clusters
+    if (check == 0) {
+        //store the clusters that are in used
+        assign_used_clusters(nonEmptyClusters, file_cluster, size, image_buf, bpb);
+    }
+    //check for inconsistent size files
+    else if (check == 1) {
+        //check whether both dirent file size and FAT file size are the same
+        int file_size = check_file_size(file_cluster, size, image_buf, bpb);
+        //if file sizes are inconsistent
+        if (file_size != 0) {
+            //print out file names and their sizes in dirent and FAT
+            printf("%s.%s %i %i\n", name, extension, size, file_size);
+        }
+    }
+}
+
 //function to go through the directory entries
 //if check = 0 it'll check for used clusters
 //if check = 1 it'll check for inconsistent file sizes
-void follow_dir(int check, int nonEmptyClusters[], uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
+//directories that are unchanged in the checkpoint ck (which may be NULL) aren't checked again
+void follow_dir(int check, int nonEmptyClusters[], uint16_t cluster, struct ckpt *ck, uint8_t *image_buf, struct bpb33* bpb)
 {
-    if (check == 0) {
+    struct ckpt_node *node = NULL;
+    int clean = 0;
+    if (ck != NULL) {
+        node = ckpt_find(ck, cluster);
+    }
+    if (node != NULL && node->clean) {
+        clean = 1;
+        if (check == 0) {
+            //use the clusters recorded in the checkpoint
+            ckpt_mark_used(ck, node, nonEmptyClusters, geometry(bpb)->clusters);
+        }
+        if (node->subtree_clean) {
+            //nothing below here has changed either
+            return;
+        }
+    } else if (check == 0 && cluster == 0) {
         nonEmptyClusters[cluster] = 1;
+    } else if (check == 0) {
+        //the entries may end before the last cluster of the directory
+        assign_used_clusters(nonEmptyClusters, cluster, 0, image_buf, bpb);
     }
     struct direntry *dirent;
-    int d, i;
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    struct chain_reader *cr = NULL;
+    int d;
+    if (cluster == 0) {
+        dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    } else {
+        //the chain reader fetches the directory's clusters ahead of the walk
+        cr = chain_open(cluster, 0, image_buf, bpb);
+        dirent = (struct direntry*)chain_next(cr, &cluster);
+        if (dirent == NULL) {
+            chain_close(cr);
+            return;
+        }
+    }
+    //start on the subdirectories before the walk gets to them
+    chain_prefetch_dirs((uint8_t*)dirent, cluster == 0
+                        ? bpb->bpbRootDirEnts * sizeof(struct direntry)
+                        : bpb->bpbBytesPerSec * bpb->bpbSecPerClust,
+                        image_buf, bpb);
     while (1) {
         for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
              d += sizeof(struct direntry)) {
             char name[9];
             char extension[4];
-            uint32_t size;
             uint16_t file_cluster = 0;
-            name[8] = ' ';
-            extension[3] = ' ';
-            memcpy(name, &(dirent->deName[0]), 8);
-            memcpy(extension, dirent->deExtension, 3);
-            if (name[0] == SLOT_EMPTY)
+            if (dirent->deName[0] == SLOT_EMPTY) {
+                if (cr != NULL) {
+                    chain_close(cr);
+                }
                 return;
+            }
             
             /* skip over deleted entries */
-            if (((uint8_t)name[0]) == SLOT_DELETED)
+            if (dirent->deName[0] == SLOT_DELETED) {
+                dirent++;
                 continue;
-            
-            /* names are space padded - remove the spaces */
-            for (i = 8; i > 0; i--) {
-                if (name[i] == ' ')
-                    name[i] = '\0';
-                else
-                    break;
             }
             
-            /* remove the spaces from extensions */
-            for (i = 3; i > 0; i--) {
-                if (extension[i] == ' ')
-                    extension[i] = '\0';
-                else
-                    break;
-            }
+            split_name(dirent, name, extension);
             
             /* don't print "." or ".." directories */
             if (strcmp(name, ".")==0) {
@@ -139,50 +220,567 @@ void follow_dir(int check, int nonEmptyClusters[], uint16_t cluster, uint8_t *im
                 //directory found
                 //the start cluster of the directory
                 file_cluster = getushort(dirent->deStartCluster);
-                follow_dir(check, nonEmptyClusters, file_cluster, image_buf, bpb);
+                follow_dir(check, nonEmptyClusters, file_cluster, ck, image_buf, bpb);
+            } else if (clean) {
+                //file is unchanged since the checkpoint
             } else {
-                //file found
-                //the start cluster of the file
-                file_cluster = getushort(dirent->deStartCluster);
-                //the size of file in bytes
-                size = getulong(dirent->deFileSize);
-                //check for used clusters
-                if (check == 0) {
-                    //store the clusters that are in used
-                    assign_used_clusters(nonEmptyClusters, file_cluster, size, image_buf, bpb);
-                }
-                //check for inconsistent size files
-                else if (check == 1) {
-                    //check whether both dirent file size and FAT file size are the same
-                    int file_size = check_file_size(file_cluster, size, image_buf, bpb);
-                    //if file sizes are inconsistent
-                    if (file_size != 0) {
-                        //print out file names and their sizes in dirent and FAT
-                        printf("%s.%s %i %i\n", name, extension, size, file_size);
-                    }
-                }
+                check_file(check, nonEmptyClusters, dirent, name, extension, image_buf, bpb);
             }
             dirent++;
         }
         if (cluster == 0) {
             // root dir is special
-            dirent++;
+            if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+                + bpb->bpbRootDirEnts * sizeof(struct direntry))
+                return;
         } else {
+            dirent = (struct direntry*)chain_next(cr, &cluster);
+            if (dirent == NULL) {
+                chain_close(cr);
+                return;
+            }
+            chain_prefetch_dirs((uint8_t*)dirent,
+                                bpb->bpbBytesPerSec * bpb->bpbSecPerClust,
+                                image_buf, bpb);
+        }
+    }
+}
+
+//the physical order scan finds every directory first, then reads the
+//directory clusters in the order they sit on the disk rather than the
+//order the tree walk would visit them in
+
+//if at least one cluster in SWEEP_DENSITY between the first and last
+//directory cluster is a directory, the whole span is read in one pass
+#define SWEEP_DENSITY 4
+
+//how a run of cluster reads moved across the disk
+struct io_pattern {
+    uint32_t reads;
+    uint32_t seeks;             //reads that didn't follow on from the last one
+    uint64_t distance;          //clusters skipped over or back by the seeks
+    int last;
+};
+
+//a directory cluster, and where it is in its directory's chain
+struct dir_cluster {
+    uint16_t cluster;
+    int dir;
+    int index;
+};
+
+//a subdirectory, found in cluster index of its parent's chain
+struct dir_link {
+    int parent;
+    int index;
+    uint16_t start;
+};
+
+struct dir_info {
+    uint16_t start;             //0 for the root directory
+    int first;                  //its clusters, in chain order, before sorting
+    int count;
+    int end;                    //chain index of the cluster the entries end in
+    int first_link;
+    int n_links;
+};
+
+struct dir_map {
+    struct dir_cluster *clusters;
+    int n_clusters;
+    struct dir_link *links;
+    int n_links;
+    struct dir_info *dirs;
+    int n_dirs;
+    int *dir_of;                //directory starting at each cluster, or -1
+    uint16_t lo, hi;            //first and last directory cluster
+    int sweep;
+    struct io_pattern tree, discovery, physical;
+};
+
+static struct dir_map *dir_map = NULL;
+
+void io_record(struct io_pattern *io, uint16_t cluster)
+{
+    io->reads++;
+    if (io->last >= 0 && cluster != io->last + 1) {
+        io->seeks++;
+        io->distance += abs((int)cluster - (io->last + 1));
+    }
+    io->last = cluster;
+}
+
+void io_print(char *what, struct io_pattern *io)
+{
+    printf("%-15s %6u reads %6u seeks %8llu clusters seeked\n", what,
+           io->reads, io->seeks, (unsigned long long)io->distance);
+}
+
+//the frontier of directories still to be read, smallest start cluster first
+struct frontier {
+    uint16_t *heap;
+    int n;
+};
+
+void frontier_push(struct frontier *f, uint16_t cluster)
+{
+    int i = f->n++;
+    while (i > 0 && f->heap[(i - 1) / 2] > cluster) {
+        f->heap[i] = f->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    f->heap[i] = cluster;
+}
+
+uint16_t frontier_pop(struct frontier *f)
+{
+    uint16_t top = f->heap[0];
+    uint16_t last = f->heap[--f->n];
+    int i = 0, child;
+    while ((child = 2 * i + 1) < f->n) {
+        if (child + 1 < f->n && f->heap[child + 1] < f->heap[child]) {
+            child++;
+        }
+        if (f->heap[child] >= last) {
+            break;
+        }
+        f->heap[i] = f->heap[child];
+        i = child;
+    }
+    f->heap[i] = last;
+    return top;
+}
+
+//queues the subdirectories in one directory cluster (or the root)
+//returns 1 if the directory's entries end in it
+int find_subdirs(struct dir_map *map, struct frontier *f, int dir, int index, struct direntry *dirent, int entries, uint32_t limit)
+{
+    int d;
+    for (d = 0; d < entries; d++, dirent++) {
+        uint16_t start;
+        if (dirent->deName[0] == SLOT_EMPTY) {
+            return 1;
+        }
+        if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+            || (dirent->deAttributes & ATTR_VOLUME) != 0
+            || (dirent->deAttributes & ATTR_DIRECTORY) == 0) {
+            continue;
+        }
+        start = getushort(dirent->deStartCluster);
+        //a directory that's already queued is only read once
+        if (start < CLUST_FIRST || start >= limit || map->dir_of[start] != -1) {
+            continue;
+        }
+        map->dir_of[start] = -2;
+        map->links[map->n_links].parent = dir;
+        map->links[map->n_links].index = index;
+        map->links[map->n_links].start = start;
+        map->n_links++;
+        frontier_push(f, start);
+    }
+    return 0;
+}
+
+//the order the tree walk reads the directory clusters in
+void tree_order(struct dir_map *map, int dir)
+{
+    struct dir_info *di = &map->dirs[dir];
+    int k, l = di->first_link;
+    //the root directory's subdirectories are all found before any cluster
+    for (k = -1; k < di->count; k++) {
+        if (k >= 0) {
+            io_record(&map->tree, map->clusters[di->first + k].cluster);
+        }
+        for (; l < di->first_link + di->n_links && map->links[l].index <= k; l++) {
+            tree_order(map, map->dir_of[map->links[l].start]);
+        }
+    }
+}
+
+int by_cluster(const void *a, const void *b)
+{
+    return (int)((struct dir_cluster*)a)->cluster - (int)((struct dir_cluster*)b)->cluster;
+}
+
+//reads every directory to find its chain and subdirectories, in start
+//cluster order from a frontier of the ones found so far
+void find_dirs(struct dir_map *map, uint8_t *image_buf, struct bpb33* bpb)
+{
+    int clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t limit = geometry(bpb)->clusters;
+    struct frontier f;
+    uint8_t *seen = calloc(limit, 1);
+    
+    f.heap = malloc(limit * sizeof(uint16_t));
+    f.n = 0;
+    
+    //the root directory isn't in the data area, so has no clusters
+    map->dirs[0].start = 0;
+    map->dirs[0].first = 0;
+    map->dirs[0].count = 0;
+    map->dirs[0].end = 0;
+    map->dirs[0].first_link = 0;
+    find_subdirs(map, &f, 0, -1, (struct direntry*)root_dir_addr(image_buf, bpb),
+                 bpb->bpbRootDirEnts, limit);
+    map->dirs[0].n_links = map->n_links;
+    map->n_dirs = 1;
+    
+    while (f.n > 0) {
+        uint16_t cluster = frontier_pop(&f);
+        struct dir_info *di = &map->dirs[map->n_dirs];
+        di->start = cluster;
+        di->first = map->n_clusters;
+        di->count = 0;
+        di->end = -1;
+        di->first_link = map->n_links;
+        map->dir_of[cluster] = map->n_dirs;
+        //a cross linked or looped chain stops at the first cluster
+        //another directory has already claimed
+        while (cluster >= CLUST_FIRST && cluster < limit && seen[cluster] == 0) {
+            uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+            seen[cluster] = 1;
+            map->clusters[map->n_clusters].cluster = cluster;
+            map->clusters[map->n_clusters].dir = map->n_dirs;
+            map->clusters[map->n_clusters].index = di->count;
+            map->n_clusters++;
+            io_record(&map->discovery, cluster);
+            if (di->end < 0) {
+                chain_prefetch_dirs(p, clust_size, image_buf, bpb);
+                if (find_subdirs(map, &f, map->n_dirs, di->count, (struct direntry*)p,
+                                 clust_size / sizeof(struct direntry), limit)) {
+                    di->end = di->count;
+                }
+            }
+            di->count++;
             cluster = get_fat_entry(cluster, image_buf, bpb);
-            dirent = (struct direntry*)cluster_to_addr(cluster, 
-                                                       image_buf, bpb);
         }
+        if (di->end < 0) {
+            di->end = di->count;
+        }
+        di->n_links = map->n_links - di->first_link;
+        map->n_dirs++;
+    }
+    
+    free(f.heap);
+    free(seen);
+}
+
+//takes the directories from the sidecar's index instead, which found
+//them the same way, so none of them have to be read
+void load_dirs(struct dir_map *map, struct sidecar_index *ix)
+{
+    uint32_t d, k, l;
+    
+    for (d = 0; d < ix->n_dirs; d++) {
+        struct sidecar_dir *sd = &ix->dirs[d];
+        struct dir_info *di = &map->dirs[d];
+        di->start = sd->start;
+        di->first = map->n_clusters;
+        di->count = sd->count;
+        di->end = sd->end;
+        di->first_link = sd->first_link;
+        di->n_links = sd->n_links;
+        if (d > 0) {
+            map->dir_of[sd->start] = d;
+        }
+        for (k = 0; k < sd->count; k++) {
+            map->clusters[map->n_clusters].cluster = ix->clusters[sd->first + k];
+            map->clusters[map->n_clusters].dir = d;
+            map->clusters[map->n_clusters].index = k;
+            map->n_clusters++;
+        }
+    }
+    for (l = 0; l < ix->n_links; l++) {
+        struct sidecar_dir *sub = &ix->dirs[ix->links[l]];
+        map->links[l].parent = sub->parent;
+        map->links[l].index = sub->index;
+        map->links[l].start = sub->start;
+    }
+    map->n_links = ix->n_links;
+    map->n_dirs = ix->n_dirs;
+}
+
+//phase one: find every directory and its chain
+struct dir_map *discover_dirs(uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    struct dir_map *map = calloc(1, sizeof(struct dir_map));
+    struct sidecar_index ix;
+    uint32_t c;
+    
+    //there can't be more directories or directory clusters than clusters
+    map->clusters = malloc(limit * sizeof(struct dir_cluster));
+    map->links = malloc(limit * sizeof(struct dir_link));
+    map->dirs = malloc((limit + 1) * sizeof(struct dir_info));
+    map->dir_of = malloc(limit * sizeof(int));
+    for (c = 0; c < limit; c++) {
+        map->dir_of[c] = -1;
+    }
+    map->tree.last = map->discovery.last = map->physical.last = -1;
+    
+    if (sidecar_dirs(&ix)) {
+        load_dirs(map, &ix);
+    } else {
+        find_dirs(map, image_buf, bpb);
+    }
+    tree_order(map, 0);
+    
+    //phase two reads the clusters in the order they are on the disk
+    qsort(map->clusters, map->n_clusters, sizeof(struct dir_cluster), by_cluster);
+    if (map->n_clusters > 0) {
+        uint32_t span;
+        map->lo = map->clusters[0].cluster;
+        map->hi = map->clusters[map->n_clusters - 1].cluster;
+        span = map->hi - map->lo + 1;
+        map->sweep = (uint32_t)map->n_clusters * SWEEP_DENSITY >= span;
+    }
+    return map;
+}
+
+//forgets the directories found by phase one, when they've changed
+void dir_map_free()
+{
+    if (dir_map == NULL) {
+        return;
+    }
+    free(dir_map->clusters);
+    free(dir_map->links);
+    free(dir_map->dirs);
+    free(dir_map->dir_of);
+    free(dir_map);
+    dir_map = NULL;
+}
+
+//phase two: goes through the directory entries like follow_dir,
+//reading the directory clusters in ascending order
+void scan_physical(int check, int nonEmptyClusters[], uint8_t *image_buf, struct bpb33* bpb)
+{
+    int clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    int first_pass = 0;
+    int i, run;
+    if (dir_map == NULL) {
+        dir_map = discover_dirs(image_buf, bpb);
+        first_pass = 1;
+    }
+    struct dir_map *map = dir_map;
+    
+    //the root directory is read fresh each time, files may have been added to it
+    struct direntry *dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
+    for (i = 0; i < bpb->bpbRootDirEnts; i++, dirent++) {
+        char name[9];
+        char extension[4];
+        if (dirent->deName[0] == SLOT_EMPTY) {
+            break;
+        }
+        if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+            || (dirent->deAttributes & (ATTR_VOLUME | ATTR_DIRECTORY)) != 0) {
+            continue;
+        }
+        split_name(dirent, name, extension);
+        check_file(check, nonEmptyClusters, dirent, name, extension, image_buf, bpb);
+    }
+    
+    if (map->sweep && map->n_clusters > 0) {
+        //dense enough that one long read beats skipping the gaps
+        chain_prefetch_range(map->lo, map->hi - map->lo + 1, image_buf, bpb);
+    }
+    for (i = 0; i < map->n_clusters; i = run) {
+        //find the run of contiguous directory clusters starting here
+        for (run = i + 1; run < map->n_clusters
+                 && map->clusters[run].cluster == map->clusters[run - 1].cluster + 1; run++) {
+        }
+        if (map->sweep == 0) {
+            chain_prefetch_range(map->clusters[i].cluster, run - i, image_buf, bpb);
+        }
+        if (first_pass && map->sweep == 0) {
+            int k;
+            for (k = i; k < run; k++) {
+                io_record(&map->physical, map->clusters[k].cluster);
+            }
+        }
+        for (; i < run; i++) {
+            struct dir_cluster *dc = &map->clusters[i];
+            int d;
+            if (check == 0) {
+                nonEmptyClusters[dc->cluster] = 1;
+            }
+            //clusters after the one the entries end in hold nothing
+            if (dc->index > map->dirs[dc->dir].end) {
+                continue;
+            }
+            dirent = (struct direntry*)cluster_to_addr(dc->cluster, image_buf, bpb);
+            for (d = 0; d < clust_size; d += sizeof(struct direntry), dirent++) {
+                char name[9];
+                char extension[4];
+                if (dirent->deName[0] == SLOT_EMPTY) {
+                    break;
+                }
+                if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+                    || (dirent->deAttributes & (ATTR_VOLUME | ATTR_DIRECTORY)) != 0) {
+                    continue;
+                }
+                split_name(dirent, name, extension);
+                check_file(check, nonEmptyClusters, dirent, name, extension, image_buf, bpb);
+            }
+        }
+    }
+    if (first_pass && map->sweep && map->n_clusters > 0) {
+        uint32_t c;
+        for (c = map->lo; c <= map->hi; c++) {
+            io_record(&map->physical, c);
+        }
+    }
+}
+
+//prints how the directory reads moved across the disk for each strategy
+void print_io_patterns()
+{
+    struct dir_map *map = dir_map;
+    if (map == NULL) {
+        return;
+    }
+    printf("Directories: %i, %i clusters", map->n_dirs, map->n_clusters);
+    if (map->n_clusters > 0) {
+        printf(" in %i-%i", map->lo, map->hi);
+    }
+    printf("%s\n", map->sweep ? ", swept" : "");
+    io_print("Tree order:", &map->tree);
+    io_print("Discovery:", &map->discovery);
+    io_print("Physical order:", &map->physical);
+}
+
+//goes through the directory entries in tree order, or in physical order
+//if asked to and there isn't a checkpoint to narrow the walk down
+void scan_dirs(int check, int physical, int nonEmptyClusters[], struct ckpt *ck, uint8_t *image_buf, struct bpb33* bpb)
+{
+    if (physical && ck == NULL) {
+        scan_physical(check, nonEmptyClusters, image_buf, bpb);
+    } else {
+        follow_dir(check, nonEmptyClusters, 0, ck, image_buf, bpb);
     }
 }
 
 void usage()
 {
-    fprintf(stderr, "Usage: dos_scandisk <imagename>\n");
+    fprintf(stderr, "Usage: dos_scandisk [-r] [-p] [-c <checkpoint>] [-n <delta>] <imagename>\n");
+    fprintf(stderr, "  -r  reconcile FAT copies that differ from the first FAT\n");
+    fprintf(stderr, "  -c  only rescan directories that changed since the checkpoint,\n");
+    fprintf(stderr, "      and update it afterwards\n");
+    fprintf(stderr, "  -p  read the directories in the order they are on the disk,\n");
+    fprintf(stderr, "      and report the seeks saved (ignored with -c)\n");
+    fprintf(stderr, "  -n  leave the image alone, and save the repairs to a delta\n");
+    fprintf(stderr, "      for dos_delta to apply later (the checkpoint isn't updated)\n");
     exit(1);
 }
 
+//size of the blocks the FAT copies are compared in
+#define FAT_CMP_BLOCK 64
+
+//returns 1 if two FAT_CMP_BLOCK sized blocks differ
+//there is no early exit, so the compiler can vectorise the loop
+int fat_block_differs(uint8_t *a, uint8_t *b)
+{
+    uint64_t wa, wb;
+    uint64_t diff = 0;
+    int i;
+    for (i = 0; i < FAT_CMP_BLOCK; i += sizeof(uint64_t)) {
+        memcpy(&wa, a + i, sizeof(uint64_t));
+        memcpy(&wb, b + i, sizeof(uint64_t));
+        diff |= wa ^ wb;
+    }
+    return diff != 0;
+}
+
+//prints a run of differing entries, and copies it over from the first FAT if asked to
+void end_fat_run(int reconcile, int copy, int *printed, int first, int last, uint8_t *image_buf, struct bpb33* bpb)
+{
+    if (*printed == 0) {
+        printf("FAT %i differs:", copy + 1);
+        *printed = 1;
+    }
+    if (first == last) {
+        printf(" %i", first);
+    } else {
+        printf(" %i-%i", first, last);
+    }
+    if (reconcile == 1) {
+        //a run of 12 bit entries starts and ends on these bytes
+        copy_fat_range(3 * first / 2, 3 * last / 2 + 2, image_buf, bpb);
+    }
+}
+
+//compares every FAT copy against the first FAT a block at a time
+//and lists the entries in the blocks that differ
+//if reconcile = 1 the differing entries are copied from the first FAT
+//returns the number of entries that differ
+int compare_fats(int reconcile, uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t fat_bytes = bpb->bpbFATsecs * bpb->bpbBytesPerSec;
+    int fat_entries = fat_bytes * 2 / 3;
+    uint8_t *primary = fat_addr(0, image_buf, bpb);
+    int differing = 0;
+    int copy;
+    
+    for (copy = 1; copy < bpb->bpbFATs; copy++) {
+        uint8_t *fat = fat_addr(copy, image_buf, bpb);
+        //the next entry that has not been compared yet
+        int next = 0;
+        int run_first = -1;
+        int run_last = -1;
+        int printed = 0;
+        uint32_t block;
+        for (block = 0; block < fat_bytes; block += FAT_CMP_BLOCK) {
+            uint32_t len = fat_bytes - block;
+            int cluster, last;
+            if (len >= FAT_CMP_BLOCK) {
+                len = FAT_CMP_BLOCK;
+                if (fat_block_differs(primary + block, fat + block) == 0) {
+                    continue;
+                }
+            } else if (memcmp(primary + block, fat + block, len) == 0) {
+                continue;
+            }
+            //entry n lives in bytes 3n/2 and 3n/2 + 1
+            cluster = block * 2 / 3;
+            if (cluster > 0) {
+                cluster--;
+            }
+            if (cluster < next) {
+                cluster = next;
+            }
+            last = (block + len) * 2 / 3;
+            if (last >= fat_entries) {
+                last = fat_entries - 1;
+            }
+            for (; cluster <= last; cluster++) {
+                if (get_fat_entry_n(cluster, copy, image_buf, bpb) == get_fat_entry_n(cluster, 0, image_buf, bpb)) {
+                    continue;
+                }
+                differing++;
+                if (run_first >= 0 && cluster == run_last + 1) {
+                    run_last = cluster;
+                    continue;
+                }
+                if (run_first >= 0) {
+                    end_fat_run(reconcile, copy, &printed, run_first, run_last, image_buf, bpb);
+                }
+                run_first = cluster;
+                run_last = cluster;
+            }
+            next = last + 1;
+        }
+        if (run_first >= 0) {
+            end_fat_run(reconcile, copy, &printed, run_first, run_last, image_buf, bpb);
+        }
+        if (printed == 1) {
+            printf("\n");
+        }
+    }
+    return differing;
+}
+
 //finds the unreferenced clusters
-void find_unrefClusters(int nonEmptyClusters[], int total_clusters, uint8_t *image_buf, struct bpb33* bpb)
+void find_unrefClusters(int nonEmptyClusters[], int total_clusters, int physical, struct ckpt *ck, uint8_t *image_buf, struct bpb33* bpb)
 {
     //flag to indicate there are unreferenced clusters
     int flag = 0;
@@ -194,7 +792,7 @@ void find_unrefClusters(int nonEmptyClusters[], int total_clusters, uint8_t *ima
         nonEmptyClusters[cluster] = 0;
     }
     //going through the image
-    follow_dir(0, nonEmptyClusters, 0, image_buf, bpb);
+    scan_dirs(0, physical, nonEmptyClusters, ck, image_buf, bpb);
     
     for (cluster = 2; cluster < total_clusters; cluster++) {
         //print out the cluster numbers if it is not referenced
@@ -260,42 +858,160 @@ void write_dirent(struct direntry *dirent, char *filename,
     dirent->deAttributes = ATTR_NORMAL;
     putushort(dirent->deStartCluster, start_cluster);
     putulong(dirent->deFileSize, size);
+    mark_dirty((uint8_t*)dirent, sizeof(struct direntry));
     
     /* a real filesystem would set the time and date here, but it's
      not necessary for this coursework */
 }
 
-//finds a free slot in the directory, and write the directory entry
-void create_unref_dirent(char *filename, uint16_t start_cluster, uint32_t size, uint8_t *image_buf, struct bpb33* bpb) {
+//finds a free slot in the root directory, and write the directory entry
+//returns the entry, or NULL if the root directory is full
+struct direntry *create_unref_dirent(char *filename, uint16_t start_cluster, uint32_t size, uint8_t *image_buf, struct bpb33* bpb) {
     struct direntry *dirent = (struct direntry*) cluster_to_addr(0, image_buf, bpb);
+    struct direntry *end = dirent + bpb->bpbRootDirEnts;
 
-    while(1) {
+    while(dirent < end) {
         if (dirent->deName[0] == SLOT_EMPTY) {
             /* we found an empty slot at the end of the directory */
             write_dirent(dirent, filename, start_cluster, size);
-            dirent++;
             
             /* make sure the next dirent is set to be empty, just in
              case it wasn't before */
-            memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-            dirent->deName[0] = SLOT_EMPTY;
-            return;
+            if (dirent + 1 < end) {
+                memset((uint8_t*)(dirent + 1), 0, sizeof(struct direntry));
+                dirent[1].deName[0] = SLOT_EMPTY;
+                mark_dirty((uint8_t*)(dirent + 1), sizeof(struct direntry));
+            }
+            return dirent;
         }
         if (dirent->deName[0] == SLOT_DELETED) {
             /* we found a deleted entry - we can just overwrite it */
             write_dirent(dirent, filename, start_cluster, size);
-            return;
+            return dirent;
         }
         dirent++;
     }
+    return NULL;
+}
+
+//the directory lost files are recovered into, and where the next one goes
+struct found_dir {
+    uint16_t cluster;           //the last cluster of the directory
+    int slot;                   //the next free entry in it
+    uint16_t next_free;         //where to start looking for a free cluster
+};
+
+//takes a free cluster for the found directory and clears it
+//returns 0 if the disk is full
+uint16_t found_alloc(struct found_dir *fd, int nonEmptyClusters[], uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t limit = geometry(bpb)->clusters;
+    uint32_t cluster;
+    for (cluster = fd->next_free; cluster < limit; cluster++) {
+        if (get_fat_entry(cluster, image_buf, bpb) == (FAT12_MASK & CLUST_FREE)) {
+            uint8_t *p = cluster_to_addr(cluster, image_buf, bpb);
+            int clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+            set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+            memset(p, 0, clust_size);
+            mark_dirty(p, clust_size);
+            //so it isn't taken for a lost file later in the scan
+            nonEmptyClusters[cluster] = 1;
+            fd->next_free = cluster + 1;
+            return cluster;
+        }
+    }
+    fd->next_free = limit;
+    return 0;
+}
+
+//makes a new FOUND.nnn directory in the root directory
+//returns 0 if there's no room for it
+int found_create(struct found_dir *fd, int nonEmptyClusters[], uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent = (struct direntry*) cluster_to_addr(0, image_buf, bpb);
+    uint8_t used[1000];
+    char name[13];
+    int i, n;
+    
+    //use the first number that isn't taken by an earlier recovery
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < bpb->bpbRootDirEnts && dirent[i].deName[0] != SLOT_EMPTY; i++) {
+        if (memcmp(dirent[i].deName, "FOUND   ", 8) == 0
+            && isdigit(dirent[i].deExtension[0]) && isdigit(dirent[i].deExtension[1])
+            && isdigit(dirent[i].deExtension[2])) {
+            used[(dirent[i].deExtension[0] - '0') * 100
+                 + (dirent[i].deExtension[1] - '0') * 10
+                 + dirent[i].deExtension[2] - '0'] = 1;
+        }
+    }
+    for (n = 0; n < 1000 && used[n]; n++) {
+    }
+    if (n == 1000) {
+        return 0;
+    }
+    
+    fd->next_free = CLUST_FIRST;
+    fd->cluster = found_alloc(fd, nonEmptyClusters, image_buf, bpb);
+    if (fd->cluster == 0) {
+        return 0;
+    }
+    sprintf(name, "FOUND.%03i", n);
+    dirent = create_unref_dirent(name, fd->cluster, 0, image_buf, bpb);
+    if (dirent == NULL) {
+        set_fat_entry(fd->cluster, FAT12_MASK & CLUST_FREE, image_buf, bpb);
+        nonEmptyClusters[fd->cluster] = 0;
+        return 0;
+    }
+    dirent->deAttributes = ATTR_DIRECTORY;
+    mark_dirty((uint8_t*)dirent, sizeof(struct direntry));
+    
+    //"." and ".." come first
+    dirent = (struct direntry*) cluster_to_addr(fd->cluster, image_buf, bpb);
+    memset(dirent[0].deName, ' ', 11);
+    dirent[0].deName[0] = '.';
+    dirent[0].deAttributes = ATTR_DIRECTORY;
+    putushort(dirent[0].deStartCluster, fd->cluster);
+    memset(dirent[1].deName, ' ', 11);
+    dirent[1].deName[0] = '.';
+    dirent[1].deName[1] = '.';
+    dirent[1].deAttributes = ATTR_DIRECTORY;
+    putushort(dirent[1].deStartCluster, 0);
+    mark_dirty((uint8_t*)dirent, 2 * sizeof(struct direntry));
+    fd->slot = 2;
+    return 1;
+}
+
+//appends an entry to the found directory, growing it a cluster at a time
+//the new clusters are zeroed, so the entry after the last is always empty
+//returns 0 if the disk is full
+int found_append(struct found_dir *fd, char *filename, uint16_t start_cluster, uint32_t size, int nonEmptyClusters[], uint8_t *image_buf, struct bpb33* bpb)
+{
+    int per_cluster = bpb->bpbSecPerClust * bpb->bpbBytesPerSec / sizeof(struct direntry);
+    struct direntry *dirent;
+    if (fd->slot == per_cluster) {
+        uint16_t next = found_alloc(fd, nonEmptyClusters, image_buf, bpb);
+        if (next == 0) {
+            return 0;
+        }
+        set_fat_entry(fd->cluster, next, image_buf, bpb);
+        fd->cluster = next;
+        fd->slot = 0;
+    }
+    dirent = (struct direntry*) cluster_to_addr(fd->cluster, image_buf, bpb);
+    write_dirent(dirent + fd->slot, filename, start_cluster, size);
+    fd->slot++;
+    return 1;
 }
 
-//finds and lists the lost files
+//finds and lists the lost files, and recovers them into a new
+//FOUND.nnn directory, or the root directory if that can't be made
 void get_lost_files(int nonEmptyClusters[], int total_clusters, uint8_t *image_buf, struct bpb33* bpb)
 {
     int clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
     int fileFound = 0;
     int cluster;
+    struct found_dir found;
+    int have_found = 0;
     for (cluster = 2; cluster < total_clusters; cluster++) {
         if (nonEmptyClusters[cluster] == 0 && get_fat_entry(cluster, image_buf, bpb) != (FAT12_MASK & CLUST_FREE)) {
             //start cluster of the file
@@ -303,19 +1019,32 @@ void get_lost_files(int nonEmptyClusters[], int total_clusters, uint8_t *image_b
             //get the number of clusters representing the file
             uint16_t blocks = get_file_blocks(cluster, image_buf, bpb);
             printf("Lost File: %i %i\n", start_cluster, blocks);
-            //counts the number of file found
-            fileFound++;
             //size of the file in bytes
             int size = blocks * clust_size;
-            char filename [13];
+            char filename [20];
             //name for each lost file
-            sprintf(filename, "found%i.dat", fileFound);
+            sprintf(filename, "FILE%04i.CHK", fileFound);
+            //counts the number of file found
+            fileFound++;
+            //the lost file's clusters are in use from now on
+            assign_used_clusters(nonEmptyClusters, cluster, size, image_buf, bpb);
             //create directory entry for the lost files
-            create_unref_dirent(filename, cluster, size, image_buf, bpb);
-            //update the nonEmptyClusters array
-            follow_dir(0, nonEmptyClusters, 0, image_buf, bpb);
+            if (have_found == 0) {
+                have_found = found_create(&found, nonEmptyClusters, image_buf, bpb) ? 1 : -1;
+            }
+            if (have_found == 1
+                && found_append(&found, filename, cluster, size, nonEmptyClusters, image_buf, bpb)) {
+                continue;
+            }
+            if (create_unref_dirent(filename, cluster, size, image_buf, bpb) == NULL) {
+                printf("No room for lost file %i\n", start_cluster);
+            }
         }
     }
+    //the physical order scan has to find the new directory
+    if (have_found == 1) {
+        dir_map_free();
+    }
 }
 
 int main(int argc, char** argv)
@@ -323,25 +1052,84 @@ int main(int argc, char** argv)
     uint8_t *image_buf;
     int fd;
     struct bpb33* bpb;
-    if (argc != 2) {
+    int reconcile = 0;
+    int physical = 0;
+    char *ckpt_file = NULL;
+    char *delta_file = NULL;
+    struct ckpt *ck = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "rpc:n:")) != -1) {
+        switch (opt) {
+        case 'r':
+            reconcile = 1;
+            break;
+        case 'p':
+            physical = 1;
+            break;
+        case 'c':
+            ckpt_file = optarg;
+            break;
+        case 'n':
+            delta_file = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1) {
         usage();
     }
     
-    image_buf = mmap_file(argv[1], &fd);
+    if (delta_file != NULL) {
+        //repair a copy-on-write copy of the image
+        image_buf = open_image_preview(argv[optind], &fd, delta_file);
+    } else {
+        image_buf = open_image(argv[optind], &fd);
+    }
     bpb = check_bootsector(image_buf);
     
-    int total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
-    int nonEmptyClusters[total_clusters];
+    //check the FAT copies agree before anything is repaired
+    compare_fats(reconcile, image_buf, bpb);
+    
+    //hash the metadata, and compare it with the last checkpoint
+    if (ckpt_file != NULL) {
+        struct ckpt *old = ckpt_read(ckpt_file, bpb);
+        ck = ckpt_build(old, image_buf, bpb);
+        ckpt_free(old);
+    }
+    
+    //the array is sized by the whole volume, as chains are followed
+    //without range checks, but only clusters the FAT describes are
+    //scanned: past those the FAT entries are the next copy's bytes
+    int total_clusters = geometry(bpb)->clusters;
+    int nonEmptyClusters[bpb->bpbSectors / bpb->bpbSecPerClust];
     //get unreferenced clusters
-    find_unrefClusters(nonEmptyClusters, total_clusters, image_buf, bpb);
+    find_unrefClusters(nonEmptyClusters, total_clusters, physical, ck, image_buf, bpb);
     //get number of blocks
     get_lost_files(nonEmptyClusters, total_clusters, image_buf, bpb);
     //print inconsistent file size files & free clusters
-    follow_dir(1, nonEmptyClusters, 0, image_buf, bpb);
+    scan_dirs(1, physical, nonEmptyClusters, ck, image_buf, bpb);
     //update the nonEmptyClusters array
-    follow_dir(1, nonEmptyClusters, 0, image_buf, bpb);
-
+    scan_dirs(1, physical, nonEmptyClusters, ck, image_buf, bpb);
+    if (physical && ck == NULL) {
+        print_io_patterns();
+    }
+    //copy the repairs to the other FATs
+    flush_fat(image_buf, bpb);
+    
+    //save the state after the repairs for the next scan
+    if (ck != NULL && delta_file == NULL) {
+        struct ckpt *next = ckpt_build(ck, image_buf, bpb);
+        uint32_t i, unchanged = 0;
+        for (i = 0; i < ck->n_nodes; i++) {
+            unchanged += ck->nodes[i].clean;
+        }
+        printf("Checkpoint: %u of %u directories unchanged\n", unchanged, ck->n_nodes);
+        ckpt_write(next, ckpt_file);
+        ckpt_free(next);
+        ckpt_free(ck);
+    }
     
-    close(fd);
+    close_image(image_buf);
     exit(0);
 }
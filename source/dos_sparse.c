@@ -0,0 +1,236 @@
+/* dos_sparse: deallocate the free clusters of a FAT-12 disk image, in
+   place or in a sparse copy, so that storing and copying the image
+   costs what the used space costs */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_sparse [-z] <imagename> [<outputname>]\n");
+    fprintf(stderr, "  punches holes for the free clusters of the image, or writes\n");
+    fprintf(stderr, "  a sparse copy to outputname if one is given\n");
+    fprintf(stderr, "  -z  also zero the slack after the end of each file\n");
+    exit(1);
+}
+
+/* cluster_offset returns where a cluster lives in the image file */
+off_t cluster_offset(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
+{
+    return cluster_to_addr(cluster, image_buf, bpb) - image_buf;
+}
+
+/* copy_range copies bytes [start, end) of the image to the output,
+   skipping anything that's already a hole in the image */
+void copy_range(int in, int out, off_t start, off_t end, uint8_t *image_buf)
+{
+    off_t data, hole;
+
+    while (start < end) {
+	data = lseek(in, start, SEEK_DATA);
+	if (data < 0 || data >= end)
+	    return;
+	hole = lseek(in, data, SEEK_HOLE);
+	if (hole < 0 || hole > end)
+	    hole = end;
+	if (pwrite(out, image_buf + data, hole - data, data) != hole - data) {
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    exit(1);
+	}
+	start = hole;
+    }
+}
+
+/* zero_slack zeroes the part of each file's last cluster past the end
+   of the file, in the output file (which may be the image itself) */
+void zero_slack(int out, uint16_t cluster, int depth, long *slack,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    uint32_t limit = geometry(bpb)->clusters;
+    struct direntry *dirent;
+    uint8_t *zeros;
+    int d;
+
+    zeros = calloc(1, clust_size);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < clust_size; d += sizeof(struct direntry), dirent++) {
+	    uint16_t file_cluster;
+	    uint32_t size, tail, n;
+
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(zeros);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED
+		|| dirent->deName[0] == '.'
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    file_cluster = getushort(dirent->deStartCluster);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+		if (depth < MAXPATHLEN / 2
+		    && file_cluster >= CLUST_FIRST && file_cluster < limit)
+		    zero_slack(out, file_cluster, depth + 1, slack,
+			       image_buf, bpb);
+		continue;
+	    }
+	    size = getulong(dirent->deFileSize);
+	    tail = size % clust_size;
+	    if (size == 0 || tail == 0)
+		continue;
+
+	    /* find the last cluster of the file */
+	    for (n = (size - 1) / clust_size; n > 0; n--) {
+		if (file_cluster < CLUST_FIRST || file_cluster >= limit)
+		    break;
+		file_cluster = get_fat_entry(file_cluster, image_buf, bpb);
+	    }
+	    if (file_cluster < CLUST_FIRST || file_cluster >= limit)
+		continue;
+	    if (pwrite(out, zeros, clust_size - tail,
+		       cluster_offset(file_cluster, image_buf, bpb) + tail)
+		!= clust_size - tail) {
+		fprintf(stderr, "Write failed: %s\n", strerror(errno));
+		exit(1);
+	    }
+	    *slack += clust_size - tail;
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= limit)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+    }
+    free(zeros);
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, out, opt;
+    int zero = 0;
+    struct bpb33* bpb;
+    struct stat statbuf, outstat;
+    uint32_t clust_size, limit, c, run_start;
+    long freed = 0, runs = 0, slack = 0;
+    off_t start, end;
+
+    while ((opt = getopt(argc, argv, "z")) != -1) {
+	switch (opt) {
+	case 'z':
+	    zero = 1;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1 && argc - optind != 2) {
+	usage();
+    }
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    limit = geometry(bpb)->clusters;
+    fstat(fd, &statbuf);
+
+    if (argc - optind == 2) {
+	/* not truncated until we know it isn't the image itself, which
+	   would throw away everything we are about to copy */
+	out = open(argv[optind+1], O_WRONLY | O_CREAT, 0666);
+	if (out < 0) {
+	    fprintf(stderr, "Can't open file %s to write the copy\n",
+		    argv[optind+1]);
+	    exit(1);
+	}
+	if (fstat(out, &outstat) == 0 && outstat.st_dev == statbuf.st_dev
+	    && outstat.st_ino == statbuf.st_ino) {
+	    fprintf(stderr, "%s is the disk image; leave out the copy to "
+		    "make the image itself sparse\n", argv[optind+1]);
+	    exit(1);
+	}
+	if (ftruncate(out, 0) < 0 || ftruncate(out, statbuf.st_size) < 0) {
+	    fprintf(stderr, "Can't size file %s: %s\n", argv[optind+1],
+		    strerror(errno));
+	    exit(1);
+	}
+	/* everything up to the first cluster is metadata */
+	copy_range(fd, out, 0, cluster_offset(CLUST_FIRST, image_buf, bpb),
+		   image_buf);
+    } else {
+	out = fd;
+    }
+
+    /* one pass over the FAT: copy the used runs, and punch out the free
+       ones */
+    run_start = CLUST_FIRST;
+    for (c = CLUST_FIRST; c <= limit; c++) {
+	int is_free = c < limit
+	    && get_fat_entry(c, image_buf, bpb) == CLUST_FREE;
+	int run_free = get_fat_entry(run_start, image_buf, bpb) == CLUST_FREE;
+	if (c < limit && c > run_start && is_free == run_free)
+	    continue;
+	if (c > run_start) {
+	    start = cluster_offset(run_start, image_buf, bpb);
+	    end = start + (off_t)(c - run_start) * clust_size;
+	    if (!run_free) {
+		if (out != fd)
+		    copy_range(fd, out, start, end, image_buf);
+	    } else {
+		freed += c - run_start;
+		runs++;
+		if (out == fd
+		    && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				 start, end - start) < 0) {
+		    fprintf(stderr, "Can't punch hole: %s\n", strerror(errno));
+		    exit(1);
+		}
+	    }
+	}
+	run_start = c;
+    }
+
+    /* anything after the last cluster, like the tail of an odd-sized
+       image */
+    start = cluster_offset(limit, image_buf, bpb);
+    if (out != fd && start < statbuf.st_size)
+	copy_range(fd, out, start, statbuf.st_size, image_buf);
+
+    if (zero)
+	zero_slack(out, 0, 0, &slack, image_buf, bpb);
+
+    printf("Deallocated %ld free clusters (%ld bytes) in %ld runs\n",
+	   freed, freed * clust_size, runs);
+    if (zero)
+	printf("Zeroed %ld bytes of slack\n", slack);
+
+    if (out != fd && close(out) < 0) {
+	fprintf(stderr, "Can't write %s: %s\n", argv[optind+1],
+		strerror(errno));
+	exit(1);
+    }
+    close(fd);
+    exit(0);
+}
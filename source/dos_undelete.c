@@ -0,0 +1,391 @@
+/* dos_undelete: find deleted files in a FAT-12 disk image, judge how
+   likely each is to come back intact, and restore the ones asked for */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "lfn.h"
+
+/* most files we'll restore in one run */
+#define MAX_RESTORE 256
+
+/* how likely a deleted file is to come back intact, best first */
+#define STATE_INTACT 0		/* every cluster is free */
+#define STATE_EMPTY 1		/* no data to lose */
+#define STATE_PARTIAL 2		/* some clusters reused since */
+#define STATE_LOST 3		/* first cluster reused since */
+
+char *state_names[] = { "intact", "empty", "partial", "lost" };
+
+/* a deleted entry, and where it is so it can be put back */
+struct deleted {
+    char *path;
+    uint16_t dir_cluster;	/* directory cluster holding the entry */
+    int slot;			/* entry within that cluster */
+    int lfn_slots;		/* long name slots just before it */
+    uint8_t first_char;		/* recovered first byte of the 8.3 name */
+    uint16_t cluster;
+    uint32_t size;
+    int is_dir;
+    uint32_t needed, free;	/* clusters the file needs, and are free */
+    int state;
+    int seq;			/* order found in */
+};
+
+struct scan {
+    struct deleted *files;
+    int n, max;
+    uint32_t limit;		/* first cluster past the data area */
+    uint32_t clust_size;
+};
+
+void usage()
+{
+    fprintf(stderr, "Usage: dos_undelete [-r <number>]... <imagename>\n");
+    fprintf(stderr, "  with no -r, lists the deleted files, most recoverable first\n");
+    fprintf(stderr, "  -r  restore the file with this number in the list\n");
+    exit(1);
+}
+
+/* looks_like_dir says whether a cluster still starts with the "."
+   entry every directory has */
+int looks_like_dir(uint16_t cluster, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    return memcmp(dirent->deName, ".          ", 11) == 0
+	&& (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+}
+
+/* assess works out how much of a deleted file is still on the disk.
+   FAT-12 forgets a file's chain when it's deleted, so like DOS's own
+   UNDELETE we assume the file was contiguous, which it usually is. */
+void assess(struct deleted *f, struct scan *sc,
+	    uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t c;
+
+    f->needed = f->is_dir ? 1 : (f->size + sc->clust_size - 1) / sc->clust_size;
+    f->free = 0;
+    if (f->needed == 0) {
+	f->state = STATE_EMPTY;
+	return;
+    }
+    for (c = f->cluster; c < f->cluster + f->needed; c++) {
+	if (c >= CLUST_FIRST && c < sc->limit
+	    && get_fat_entry(c, image_buf, bpb) == CLUST_FREE)
+	    f->free++;
+    }
+    if (f->free == f->needed
+	&& (!f->is_dir || looks_like_dir(f->cluster, image_buf, bpb)))
+	f->state = STATE_INTACT;
+    else if (f->cluster >= CLUST_FIRST && f->cluster < sc->limit
+	     && get_fat_entry(f->cluster, image_buf, bpb) == CLUST_FREE)
+	f->state = STATE_PARTIAL;
+    else
+	f->state = STATE_LOST;
+}
+
+/* deleted_name works out what a deleted entry was called.  Deleting
+   overwrites the first byte of the 8.3 name and of each long name
+   slot, but the long name's checksum covers that first byte and only
+   one value of it gives the right checksum, so if the long name slots
+   survived, both names can be recovered. */
+void deleted_name(struct direntry *dirent, struct winentry *slots, int nslots,
+		  int *lfn_slots, uint8_t *first_char, char *name, size_t size)
+{
+    struct lfn_state ls;
+    struct direntry copy;
+    struct winentry we;
+    int c, i, n;
+
+    copy = *dirent;
+    *lfn_slots = 0;
+    *first_char = '_';
+    for (n = nslots; n > 0; n--) {
+	/* the slots nearest the entry are the start of the name, and
+	   they must all carry the same checksum */
+	if (slots[nslots - n].weChksum != slots[nslots - 1].weChksum)
+	    continue;
+	for (i = nslots - n + 1; i < nslots; i++) {
+	    if (slots[i].weChksum != slots[nslots - 1].weChksum)
+		break;
+	}
+	if (i == nslots)
+	    break;
+    }
+    for (c = 0; n > 0 && c < 256; c++) {
+	copy.deName[0] = c;
+	if (lfn_checksum(copy.deName) == slots[nslots - 1].weChksum)
+	    break;
+    }
+    if (n > 0 && c > ' ' && c != SLOT_DELETED
+	&& strchr("\"*+,./:;<=>?[\\]|", c) == NULL) {
+	/* feed the slots back through the reader, with their sequence
+	   numbers put back */
+	lfn_reset(&ls);
+	for (i = nslots - n; i < nslots; i++) {
+	    we = slots[i];
+	    we.weCnt = (nslots - i) | (i == nslots - n ? WIN_LAST : 0);
+	    lfn_feed(&ls, (struct direntry*)&we);
+	}
+	*lfn_slots = n;
+	*first_char = copy.deName[0] = c;
+	lfn_name(&ls, &copy, name, size);
+	return;
+    }
+    copy.deName[0] = '?';
+    lfn_short_name(&copy, name, size);
+}
+
+void add_deleted(struct scan *sc, char *path, uint16_t dir_cluster, int slot,
+		 int lfn_slots, uint8_t first_char, struct direntry *dirent,
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct deleted *f;
+
+    if (sc->n == sc->max) {
+	sc->max = sc->max ? sc->max * 2 : 64;
+	sc->files = realloc(sc->files, sc->max * sizeof(struct deleted));
+    }
+    f = &sc->files[sc->n];
+    f->seq = sc->n++;
+    f->path = strdup(path);
+    f->dir_cluster = dir_cluster;
+    f->slot = slot;
+    f->lfn_slots = lfn_slots;
+    f->first_char = first_char;
+    f->cluster = getushort(dirent->deStartCluster);
+    f->size = getulong(dirent->deFileSize);
+    f->is_dir = (dirent->deAttributes & ATTR_DIRECTORY) != 0;
+    assess(f, sc, image_buf, bpb);
+}
+
+/* follow_dir walks the live directory tree, looking at every directory
+   cluster once and noting each deleted entry in it */
+void follow_dir(struct scan *sc, uint16_t cluster, char *path, int depth,
+		uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct lfn_state ls;
+    struct winentry slots[WIN_MAXSUBENTRIES];
+    char name[LFN_MAX_UTF8];
+    char *subpath;
+    int d, nslots = 0, lfn_slots, slot;
+    uint8_t first_char;
+    long steps = 0;
+
+    subpath = malloc(strlen(path) + LFN_MAX_UTF8 + 1);
+    lfn_reset(&ls);
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1) {
+	for (d = 0; d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+	     d += sizeof(struct direntry), dirent++) {
+	    /* the root directory isn't in clusters, so number its slots
+	       from the start */
+	    slot = (cluster == 0)
+		? dirent - (struct direntry*)root_dir_addr(image_buf, bpb)
+		: d / sizeof(struct direntry);
+	    if (dirent->deName[0] == SLOT_EMPTY) {
+		free(subpath);
+		return;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED) {
+		lfn_reset(&ls);
+		if (dirent->deAttributes == ATTR_WIN95) {
+		    /* keep the last few deleted long name slots */
+		    if (nslots == WIN_MAXSUBENTRIES) {
+			memmove(slots, slots + 1,
+				(nslots - 1) * sizeof(struct winentry));
+			nslots--;
+		    }
+		    slots[nslots++] = *(struct winentry*)dirent;
+		    continue;
+		}
+		if ((dirent->deAttributes & ATTR_VOLUME) == 0) {
+		    deleted_name(dirent, slots, nslots, &lfn_slots,
+				 &first_char, name, sizeof(name));
+		    /* the long name slots must be in the same cluster to
+		       be put back */
+		    if (lfn_slots > slot)
+			lfn_slots = 0;
+		    sprintf(subpath, "%s%s", path, name);
+		    add_deleted(sc, subpath, cluster, slot, lfn_slots,
+				first_char, dirent, image_buf, bpb);
+		    /* that may have looked at another cluster */
+		    dirent = (struct direntry*)
+			cluster_to_addr(cluster, image_buf, bpb) + slot;
+		}
+		nslots = 0;
+		continue;
+	    }
+	    nslots = 0;
+	    if (lfn_feed(&ls, dirent))
+		continue;
+	    lfn_name(&ls, dirent, name, sizeof(name));
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0
+		|| (dirent->deAttributes & ATTR_VOLUME) != 0
+		|| strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		continue;
+
+	    sprintf(subpath, "%s%s/", path, name);
+	    if (depth < MAXPATHLEN / 2)
+		follow_dir(sc, getushort(dirent->deStartCluster), subpath,
+			   depth + 1, image_buf, bpb);
+	    /* the subdirectory may have pushed this cluster out of
+	       the I/O backend's cache, so look it up again */
+	    if (cluster != 0)
+		dirent = (struct direntry*)
+		    (cluster_to_addr(cluster, image_buf, bpb) + d);
+	}
+	if (cluster == 0) {
+	    // root dir is special
+	    if ((uint8_t*)dirent >= root_dir_addr(image_buf, bpb)
+		+ bpb->bpbRootDirEnts * sizeof(struct direntry))
+		break;
+	} else {
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (cluster < CLUST_FIRST || cluster >= sc->limit
+		|| steps++ >= sc->limit)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster,
+						       image_buf, bpb);
+	}
+	/* long names don't span directory clusters we can restore */
+	nslots = 0;
+    }
+    free(subpath);
+}
+
+/* restore brings one file back: its chain is rebuilt in the primary
+   FAT (the caller copies that to the other FATs once, for every file
+   restored), and then its directory entry is undeleted */
+int restore(struct deleted *f, struct scan *sc,
+	    uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    struct winentry *we;
+    uint32_t c;
+    char *p;
+    int i;
+
+    /* an earlier restore may have taken its clusters */
+    assess(f, sc, image_buf, bpb);
+    if (f->state != STATE_INTACT && f->state != STATE_EMPTY) {
+	fprintf(stderr, "%s is %s and can't be restored\n", f->path,
+		state_names[f->state]);
+	return -1;
+    }
+
+    for (c = f->cluster; c < f->cluster + f->needed; c++) {
+	set_fat_entry(c, c + 1 == f->cluster + f->needed
+		      ? (FAT12_MASK & CLUST_EOFS) : c + 1, image_buf, bpb);
+    }
+
+    dirent = (struct direntry*)cluster_to_addr(f->dir_cluster, image_buf, bpb)
+	+ f->slot;
+    dirent->deName[0] = f->first_char;
+    for (i = 1; i <= f->lfn_slots; i++) {
+	we = (struct winentry*)(dirent - i);
+	we->weCnt = i | (i == f->lfn_slots ? WIN_LAST : 0);
+    }
+    mark_dirty((uint8_t*)(dirent - f->lfn_slots),
+	       (f->lfn_slots + 1) * sizeof(struct direntry));
+
+    /* show the name it has now */
+    p = strrchr(f->path, '/');
+    p = (p == NULL) ? f->path : p + 1;
+    if (f->lfn_slots == 0)
+	*p = f->first_char;
+    return 0;
+}
+
+/* most recoverable first, and in directory order within that */
+int by_state(const void *a, const void *b)
+{
+    const struct deleted *fa = a, *fb = b;
+    uint64_t ra, rb;
+
+    if (fa->state != fb->state)
+	return fa->state - fb->state;
+    /* compare the fractions free without dividing */
+    ra = (uint64_t)fa->free * fb->needed;
+    rb = (uint64_t)fb->free * fa->needed;
+    if (ra != rb)
+	return ra > rb ? -1 : 1;
+    return fa->seq - fb->seq;
+}
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt, i, restored = 0;
+    int wanted[MAX_RESTORE], nwanted = 0;
+    struct bpb33* bpb;
+    struct scan sc;
+    struct deleted *f;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+	switch (opt) {
+	case 'r':
+	    if (nwanted == MAX_RESTORE || atoi(optarg) < 1)
+		usage();
+	    wanted[nwanted++] = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != 1) {
+	usage();
+    }
+
+    image_buf = open_image(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    memset(&sc, 0, sizeof(sc));
+    sc.limit = geometry(bpb)->clusters;
+    sc.clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    follow_dir(&sc, 0, "", 0, image_buf, bpb);
+    qsort(sc.files, sc.n, sizeof(struct deleted), by_state);
+
+    if (nwanted == 0) {
+	for (i = 0; i < sc.n; i++) {
+	    f = &sc.files[i];
+	    printf("%3d %-7s %10u %s %u/%u clusters free  %s%s\n", i + 1,
+		   state_names[f->state], f->size,
+		   f->is_dir ? "(dir)" : "bytes", f->free, f->needed,
+		   f->path, f->lfn_slots == 0 && f->state <= STATE_EMPTY
+		   ? " (first letter lost)" : "");
+	}
+	if (sc.n == 0)
+	    printf("No deleted files found\n");
+    }
+
+    for (i = 0; i < nwanted; i++) {
+	if (wanted[i] > sc.n) {
+	    fprintf(stderr, "There is no deleted file %d\n", wanted[i]);
+	    continue;
+	}
+	f = &sc.files[wanted[i] - 1];
+	if (restore(f, &sc, image_buf, bpb) == 0) {
+	    printf("Restored %s\n", f->path);
+	    restored++;
+	}
+    }
+
+    /* every chain rebuilt goes to the other FATs in one write */
+    if (restored > 0)
+	flush_fat(image_buf, bpb);
+    close_image(image_buf);
+    exit(restored < nwanted ? 1 : 0);
+}
@@ -0,0 +1,821 @@
+/* I/O backends for reaching the disk image: the whole image memory
+   mapped, pread/pwrite through a cache of clusters, or a few sliding
+   mapped windows */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "cimg.h"
+#include "delta.h"
+#include "sidecar.h"
+
+struct io_image *io_current = NULL;
+
+/* default size of the pread backend's cluster cache, in KiB; the
+   DOS_IO_CACHE environment variable overrides it */
+#define PCACHE_DEFAULT_KB 4096
+#define PCACHE_SHARDS 16
+
+/* default window size and total budget for the window backend, in KiB;
+   DOS_IO_WINDOW and DOS_IO_CACHE override them */
+#define WINDOW_DEFAULT_KB 1024
+#define WINDOW_BUDGET_DEFAULT_KB 8192
+
+/* io_meta_length works out from the boot sector how many bytes come
+   before the first data cluster */
+uint64_t io_meta_length(uint8_t *bootsector, uint32_t *clust_size)
+{
+    struct byte_bpb33 *bpb;
+    uint32_t bytes_per_sec, res, fats, fat_secs, root_ents;
+
+    bpb = (struct byte_bpb33*)&((struct bootsector33*)bootsector)->bsBPB[0];
+    bytes_per_sec = (uint16_t)getushort(bpb->bpbBytesPerSec);
+    res = (uint16_t)getushort(bpb->bpbResSectors);
+    fats = (uint8_t)bpb->bpbFATs;
+    fat_secs = (uint16_t)getushort(bpb->bpbFATsecs);
+    root_ents = (uint16_t)getushort(bpb->bpbRootDirEnts);
+    *clust_size = bytes_per_sec * (uint8_t)bpb->bpbSecPerClust;
+    return (uint64_t)bytes_per_sec * (res + fats * fat_secs)
+	+ root_ents * sizeof(struct direntry);
+}
+
+/* ------------------------------------------------------------------ */
+/* the mmap backend: the whole image is resident */
+
+static uint8_t *mmap_open(struct io_image *img, char *pathname)
+{
+    struct stat statbuf;
+    uint8_t *buf;
+
+    buf = mmap_file(pathname, &img->fd);
+    fstat(img->fd, &statbuf);
+    img->size = statbuf.st_size;
+    img->meta_len = img->size;
+    return buf;
+}
+
+static uint8_t *mmap_cluster(struct io_image *img, uint64_t offset)
+{
+    /* can't happen: everything is below meta_len */
+    return img->meta + offset;
+}
+
+static void mmap_dirty(struct io_image *img, uint8_t *addr, size_t len)
+{
+    /* MAP_SHARED writes go straight to the page cache */
+}
+
+static int mmap_flush(struct io_image *img)
+{
+    return 0;
+}
+
+static void mmap_close(struct io_image *img)
+{
+    munmap(img->meta, img->size);
+}
+
+struct io_backend io_mmap_backend = {
+    "mmap", mmap_open, mmap_cluster, mmap_dirty, mmap_flush, mmap_close
+};
+
+/* ------------------------------------------------------------------ */
+/* the pread backend: the metadata is read once, and data clusters are
+   kept in a bounded LRU cache, split into shards with their own locks
+   and lists.  Dirty clusters are written back when they're evicted and
+   when the image is flushed. */
+
+#define NO_ENTRY (-1)
+
+struct pcache_entry {
+    uint64_t offset;		/* image offset of the cluster, or UINT64_MAX */
+    int dirty;
+    int prev, next;		/* LRU list, most recent first */
+    int hnext;			/* hash chain */
+};
+
+struct pcache_shard {
+    pthread_mutex_t lock;
+    int first, count;		/* the entries this shard owns */
+    int head, tail;
+    int *buckets;
+    int nbuckets;
+};
+
+struct pcache {
+    uint8_t *slab;		/* count * clust_size bytes of cluster data */
+    struct pcache_entry *entries;
+    int count;
+    struct pcache_shard shards[PCACHE_SHARDS];
+    uint64_t meta_dirty_lo, meta_dirty_hi;
+    long hits, misses, writebacks;
+};
+
+/* read_fully reads len bytes at offset, returning 0 or -1 with errno
+   set */
+int read_fully(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t n;
+    while (len > 0) {
+	n = pread(fd, buf, len, offset);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0) {
+	    /* past the end of the image reads as zeros */
+	    memset(buf, 0, len);
+	    return 0;
+	}
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+int write_fully(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t n;
+    while (len > 0) {
+	n = pwrite(fd, buf, len, offset);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+	offset += n;
+    }
+    return 0;
+}
+
+static uint8_t *pread_open(struct io_image *img, char *pathname)
+{
+    struct pcache *pc;
+    struct stat statbuf;
+    uint8_t boot[512];
+    char *env;
+    long kb;
+    int s, i, per_shard;
+
+    img->fd = open(pathname, O_RDWR);
+    if (img->fd < 0 || fstat(img->fd, &statbuf) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+    img->size = statbuf.st_size;
+    if (read_fully(img->fd, boot, sizeof(boot), 0) < 0) {
+	fprintf(stderr, "Cannot read boot sector: %s\n", strerror(errno));
+	exit(1);
+    }
+    img->meta_len = io_meta_length(boot, &img->clust_size);
+    if (img->clust_size == 0 || img->meta_len > img->size) {
+	fprintf(stderr, "Bad geometry in boot sector of %s\n", pathname);
+	exit(1);
+    }
+    img->meta = malloc(img->meta_len);
+    if (read_fully(img->fd, img->meta, img->meta_len, 0) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+
+    kb = PCACHE_DEFAULT_KB;
+    env = getenv("DOS_IO_CACHE");
+    if (env != NULL && atol(env) > 0)
+	kb = atol(env);
+
+    pc = calloc(1, sizeof(struct pcache));
+    per_shard = kb * 1024 / img->clust_size / PCACHE_SHARDS;
+    if (per_shard < 2)
+	per_shard = 2;
+    pc->count = per_shard * PCACHE_SHARDS;
+    pc->slab = malloc((size_t)pc->count * img->clust_size);
+    pc->entries = malloc(pc->count * sizeof(struct pcache_entry));
+    pc->meta_dirty_lo = UINT64_MAX;
+    for (s = 0; s < PCACHE_SHARDS; s++) {
+	struct pcache_shard *sh = &pc->shards[s];
+	pthread_mutex_init(&sh->lock, NULL);
+	sh->first = s * per_shard;
+	sh->count = per_shard;
+	sh->nbuckets = per_shard * 2;
+	sh->buckets = malloc(sh->nbuckets * sizeof(int));
+	for (i = 0; i < sh->nbuckets; i++)
+	    sh->buckets[i] = NO_ENTRY;
+	/* every entry starts out empty, chained in the LRU list */
+	for (i = 0; i < per_shard; i++) {
+	    struct pcache_entry *e = &pc->entries[sh->first + i];
+	    e->offset = UINT64_MAX;
+	    e->dirty = 0;
+	    e->hnext = NO_ENTRY;
+	    e->prev = i == 0 ? NO_ENTRY : sh->first + i - 1;
+	    e->next = i == per_shard - 1 ? NO_ENTRY : sh->first + i + 1;
+	}
+	sh->head = sh->first;
+	sh->tail = sh->first + per_shard - 1;
+    }
+    img->priv = pc;
+    return img->meta;
+}
+
+static void lru_unlink(struct pcache *pc, struct pcache_shard *sh, int i)
+{
+    struct pcache_entry *e = &pc->entries[i];
+    if (e->prev != NO_ENTRY)
+	pc->entries[e->prev].next = e->next;
+    else
+	sh->head = e->next;
+    if (e->next != NO_ENTRY)
+	pc->entries[e->next].prev = e->prev;
+    else
+	sh->tail = e->prev;
+}
+
+static void lru_push(struct pcache *pc, struct pcache_shard *sh, int i)
+{
+    struct pcache_entry *e = &pc->entries[i];
+    e->prev = NO_ENTRY;
+    e->next = sh->head;
+    if (sh->head != NO_ENTRY)
+	pc->entries[sh->head].prev = i;
+    sh->head = i;
+    if (sh->tail == NO_ENTRY)
+	sh->tail = i;
+}
+
+static int write_back(struct io_image *img, struct pcache *pc, int i)
+{
+    struct pcache_entry *e = &pc->entries[i];
+    if (!e->dirty)
+	return 0;
+    e->dirty = 0;
+    pc->writebacks++;
+    return write_fully(img->fd, pc->slab + (size_t)i * img->clust_size,
+		       img->clust_size, e->offset);
+}
+
+static uint8_t *pread_cluster(struct io_image *img, uint64_t offset)
+{
+    struct pcache *pc = img->priv;
+    uint64_t key = offset / img->clust_size;
+    struct pcache_shard *sh = &pc->shards[key % PCACHE_SHARDS];
+    int b = (key / PCACHE_SHARDS) % sh->nbuckets;
+    int i, *pp;
+    struct pcache_entry *e;
+
+    pthread_mutex_lock(&sh->lock);
+    for (i = sh->buckets[b]; i != NO_ENTRY; i = pc->entries[i].hnext) {
+	if (pc->entries[i].offset == offset) {
+	    pc->hits++;
+	    lru_unlink(pc, sh, i);
+	    lru_push(pc, sh, i);
+	    pthread_mutex_unlock(&sh->lock);
+	    return pc->slab + (size_t)i * img->clust_size;
+	}
+    }
+
+    /* miss: recycle the least recently used entry */
+    pc->misses++;
+    i = sh->tail;
+    e = &pc->entries[i];
+    if (write_back(img, pc, i) < 0) {
+	fprintf(stderr, "Write to disk image failed: %s\n", strerror(errno));
+	exit(1);
+    }
+    if (e->offset != UINT64_MAX) {
+	uint64_t okey = e->offset / img->clust_size;
+	pp = &sh->buckets[(okey / PCACHE_SHARDS) % sh->nbuckets];
+	while (*pp != i)
+	    pp = &pc->entries[*pp].hnext;
+	*pp = e->hnext;
+    }
+    e->offset = offset;
+    e->hnext = sh->buckets[b];
+    sh->buckets[b] = i;
+    lru_unlink(pc, sh, i);
+    lru_push(pc, sh, i);
+    if (read_fully(img->fd, pc->slab + (size_t)i * img->clust_size,
+		   img->clust_size, offset) < 0) {
+	fprintf(stderr, "Read from disk image failed: %s\n", strerror(errno));
+	exit(1);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return pc->slab + (size_t)i * img->clust_size;
+}
+
+static void pread_dirty(struct io_image *img, uint8_t *addr, size_t len)
+{
+    struct pcache *pc = img->priv;
+    struct pcache_shard *sh;
+    uint64_t lo, hi;
+    int i;
+
+    if (addr >= img->meta && addr < img->meta + img->meta_len) {
+	lo = addr - img->meta;
+	hi = lo + len;
+	if (lo < pc->meta_dirty_lo)
+	    pc->meta_dirty_lo = lo;
+	if (hi > pc->meta_dirty_hi)
+	    pc->meta_dirty_hi = hi;
+    } else if (addr >= pc->slab
+	       && addr < pc->slab + (size_t)pc->count * img->clust_size) {
+	/* writes never span clusters, since clusters aren't contiguous.
+	   Entries are handed out to the shards in runs, and eviction
+	   writes back and clears dirty under the shard's lock, so this
+	   takes it too. */
+	i = (addr - pc->slab) / img->clust_size;
+	sh = &pc->shards[i / pc->shards[0].count];
+	pthread_mutex_lock(&sh->lock);
+	pc->entries[i].dirty = 1;
+	pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+static int pread_flush(struct io_image *img)
+{
+    struct pcache *pc = img->priv;
+    int i, s, err = 0;
+
+    if (pc->meta_dirty_lo < pc->meta_dirty_hi) {
+	err |= write_fully(img->fd, img->meta + pc->meta_dirty_lo,
+			   pc->meta_dirty_hi - pc->meta_dirty_lo,
+			   pc->meta_dirty_lo);
+	pc->meta_dirty_lo = UINT64_MAX;
+	pc->meta_dirty_hi = 0;
+    }
+    for (s = 0; s < PCACHE_SHARDS; s++) {
+	struct pcache_shard *sh = &pc->shards[s];
+	pthread_mutex_lock(&sh->lock);
+	for (i = sh->first; i < sh->first + sh->count; i++)
+	    err |= write_back(img, pc, i);
+	pthread_mutex_unlock(&sh->lock);
+    }
+    return err;
+}
+
+static void pread_close(struct io_image *img)
+{
+    struct pcache *pc = img->priv;
+    int s;
+
+    if (getenv("DOS_IO_STATS") != NULL) {
+	fprintf(stderr, "pread cache: %ld hits, %ld misses, %ld writebacks\n",
+		pc->hits, pc->misses, pc->writebacks);
+    }
+    for (s = 0; s < PCACHE_SHARDS; s++) {
+	pthread_mutex_destroy(&pc->shards[s].lock);
+	free(pc->shards[s].buckets);
+    }
+    free(pc->slab);
+    free(pc->entries);
+    free(pc);
+    free(img->meta);
+}
+
+struct io_backend io_pread_backend = {
+    "pread", pread_open, pread_cluster, pread_dirty, pread_flush, pread_close
+};
+
+/* ------------------------------------------------------------------ */
+/* the window backend: only the metadata is mapped for good, and data
+   clusters are reached through a few windows onto the file, recycled
+   least recently used first.  A window's pages are dropped with
+   MADV_DONTNEED before it moves, so the resident set stays within the
+   budget however big the image is.  Writes go through MAP_SHARED
+   mappings, so as with the mmap backend there's nothing to flush. */
+
+struct window {
+    uint64_t base;		/* image offset it maps, or UINT64_MAX */
+    long used;			/* when it was last used, for LRU */
+};
+
+struct wmap {
+    pthread_mutex_t lock;
+    uint8_t *area;		/* count slots of slot_len bytes */
+    uint64_t win_len;		/* bytes of the image a window starts */
+    size_t slot_len;		/* ... plus room for a cluster running past */
+    size_t meta_map_len;
+    struct window *windows;
+    int count;
+    long clock;
+    long hits, misses;
+};
+
+static size_t round_to_page(uint64_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (len + page - 1) / page * page;
+}
+
+static uint8_t *window_open(struct io_image *img, char *pathname)
+{
+    struct wmap *wm;
+    struct stat statbuf;
+    uint8_t boot[512];
+    char *env;
+    long kb, budget;
+    int i;
+
+    img->fd = open(pathname, O_RDWR);
+    if (img->fd < 0 || fstat(img->fd, &statbuf) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+    img->size = statbuf.st_size;
+    if (read_fully(img->fd, boot, sizeof(boot), 0) < 0) {
+	fprintf(stderr, "Cannot read boot sector: %s\n", strerror(errno));
+	exit(1);
+    }
+    img->meta_len = io_meta_length(boot, &img->clust_size);
+    if (img->clust_size == 0 || img->meta_len > img->size) {
+	fprintf(stderr, "Bad geometry in boot sector of %s\n", pathname);
+	exit(1);
+    }
+
+    wm = calloc(1, sizeof(struct wmap));
+    wm->meta_map_len = round_to_page(img->meta_len);
+    img->meta = mmap(NULL, wm->meta_map_len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED, img->fd, 0);
+    if (img->meta == MAP_FAILED) {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+
+    kb = WINDOW_DEFAULT_KB;
+    env = getenv("DOS_IO_WINDOW");
+    if (env != NULL && atol(env) > 0)
+	kb = atol(env);
+    budget = WINDOW_BUDGET_DEFAULT_KB;
+    env = getenv("DOS_IO_CACHE");
+    if (env != NULL && atol(env) > 0)
+	budget = atol(env);
+
+    wm->win_len = round_to_page((uint64_t)kb * 1024);
+    wm->slot_len = wm->win_len + round_to_page(img->clust_size);
+    wm->count = (uint64_t)budget * 1024 / wm->slot_len;
+    if (wm->count < 2)
+	wm->count = 2;
+
+    /* reserve the address space for all the windows up front */
+    wm->area = mmap(NULL, wm->count * wm->slot_len, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (wm->area == MAP_FAILED) {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+    wm->windows = malloc(wm->count * sizeof(struct window));
+    for (i = 0; i < wm->count; i++) {
+	wm->windows[i].base = UINT64_MAX;
+	wm->windows[i].used = 0;
+    }
+    pthread_mutex_init(&wm->lock, NULL);
+    img->priv = wm;
+    return img->meta;
+}
+
+static uint8_t *window_cluster(struct io_image *img, uint64_t offset)
+{
+    struct wmap *wm = img->priv;
+    uint64_t base = offset - offset % wm->win_len;
+    uint8_t *slot;
+    int i, victim = 0;
+
+    pthread_mutex_lock(&wm->lock);
+    wm->clock++;
+    for (i = 0; i < wm->count; i++) {
+	if (wm->windows[i].base == base) {
+	    wm->hits++;
+	    wm->windows[i].used = wm->clock;
+	    pthread_mutex_unlock(&wm->lock);
+	    return wm->area + (size_t)i * wm->slot_len + (offset - base);
+	}
+	if (wm->windows[i].used < wm->windows[victim].used)
+	    victim = i;
+    }
+
+    /* miss: move the least recently used window */
+    wm->misses++;
+    slot = wm->area + (size_t)victim * wm->slot_len;
+    if (wm->windows[victim].base != UINT64_MAX)
+	madvise(slot, wm->slot_len, MADV_DONTNEED);
+    if (mmap(slot, wm->slot_len, PROT_READ | PROT_WRITE,
+	     MAP_SHARED | MAP_FIXED, img->fd, base) == MAP_FAILED) {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+    wm->windows[victim].base = base;
+    wm->windows[victim].used = wm->clock;
+    pthread_mutex_unlock(&wm->lock);
+    return slot + (offset - base);
+}
+
+static void window_dirty(struct io_image *img, uint8_t *addr, size_t len)
+{
+    /* MAP_SHARED writes go straight to the page cache */
+}
+
+static int window_flush(struct io_image *img)
+{
+    return 0;
+}
+
+static void window_close(struct io_image *img)
+{
+    struct wmap *wm = img->priv;
+
+    if (getenv("DOS_IO_STATS") != NULL) {
+	fprintf(stderr, "windows: %ld hits, %ld misses\n",
+		wm->hits, wm->misses);
+    }
+    munmap(wm->area, wm->count * wm->slot_len);
+    munmap(img->meta, wm->meta_map_len);
+    pthread_mutex_destroy(&wm->lock);
+    free(wm->windows);
+    free(wm);
+}
+
+struct io_backend io_window_backend = {
+    "window", window_open, window_cluster, window_dirty, window_flush,
+    window_close
+};
+
+/* ------------------------------------------------------------------ */
+/* the preview backend: the whole image is mapped MAP_PRIVATE, so a
+   repair changes a copy-on-write copy and the file is never written.
+   The sectors reported dirty are compared with the file when the
+   image is flushed, and the ones that really changed are saved as a
+   delta for dos_delta to apply or revert later. */
+
+struct preview {
+    pthread_mutex_t lock;
+    char *delta_file;
+    uint32_t sec_size;
+    uint32_t n_secs;
+    uint8_t *dirty;		/* one flag per sector */
+};
+
+static char *preview_delta_file;
+
+static uint8_t *preview_open(struct io_image *img, char *pathname)
+{
+    struct preview *pv;
+    struct stat statbuf;
+    struct byte_bpb33 *bpb;
+
+    img->fd = open(pathname, O_RDONLY);
+    if (img->fd < 0 || fstat(img->fd, &statbuf) < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		pathname, strerror(errno));
+	exit(1);
+    }
+    img->size = statbuf.st_size;
+    img->meta_len = img->size;
+    img->meta = mmap(NULL, img->size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     img->fd, 0);
+    if (img->meta == MAP_FAILED) {
+	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
+	exit(1);
+    }
+
+    pv = calloc(1, sizeof(struct preview));
+    bpb = (struct byte_bpb33*)&((struct bootsector33*)img->meta)->bsBPB[0];
+    pv->sec_size = (uint16_t)getushort(bpb->bpbBytesPerSec);
+    if (pv->sec_size == 0)
+	pv->sec_size = 512;
+    pv->n_secs = (img->size + pv->sec_size - 1) / pv->sec_size;
+    pv->dirty = calloc(pv->n_secs, 1);
+    pv->delta_file = preview_delta_file;
+    pthread_mutex_init(&pv->lock, NULL);
+    img->priv = pv;
+    return img->meta;
+}
+
+static uint8_t *preview_cluster(struct io_image *img, uint64_t offset)
+{
+    /* can't happen: everything is below meta_len */
+    return img->meta + offset;
+}
+
+static void preview_dirty(struct io_image *img, uint8_t *addr, size_t len)
+{
+    struct preview *pv = img->priv;
+    uint64_t first, last;
+
+    if (len == 0)
+	return;
+    first = (addr - img->meta) / pv->sec_size;
+    last = (addr - img->meta + len - 1) / pv->sec_size;
+    pthread_mutex_lock(&pv->lock);
+    for (; first <= last && first < pv->n_secs; first++)
+	pv->dirty[first] = 1;
+    pthread_mutex_unlock(&pv->lock);
+}
+
+/* the delta is rewritten in full each time, so flushing more than once
+   leaves it describing everything changed so far */
+static int preview_flush(struct io_image *img)
+{
+    struct preview *pv = img->priv;
+    struct delta *d = delta_new(pv->sec_size, img->size);
+    uint8_t *orig = NULL;
+    size_t orig_len = 0;
+    uint32_t s, e, i, run;
+    int ret;
+
+    pthread_mutex_lock(&pv->lock);
+    for (s = 0; s < pv->n_secs; s = e) {
+	if (pv->dirty[s] == 0) {
+	    e = s + 1;
+	    continue;
+	}
+	for (e = s; e < pv->n_secs && pv->dirty[e]; e++)
+	    ;
+	/* the last sector may be short if the image is */
+	if ((uint64_t)e * pv->sec_size > img->size)
+	    e--;
+	if (e == s)
+	    break;
+	if (orig_len < (size_t)(e - s) * pv->sec_size) {
+	    orig_len = (size_t)(e - s) * pv->sec_size;
+	    orig = realloc(orig, orig_len);
+	}
+	if (read_fully(img->fd, orig, (size_t)(e - s) * pv->sec_size,
+		       (uint64_t)s * pv->sec_size) < 0) {
+	    pthread_mutex_unlock(&pv->lock);
+	    free(orig);
+	    delta_free(d);
+	    return -1;
+	}
+	/* only keep the sectors whose contents really changed */
+	for (i = s; i < e; i = run) {
+	    uint8_t *now = img->meta + (uint64_t)i * pv->sec_size;
+	    uint8_t *was = orig + (size_t)(i - s) * pv->sec_size;
+	    if (memcmp(now, was, pv->sec_size) == 0) {
+		run = i + 1;
+		continue;
+	    }
+	    for (run = i + 1; run < e
+		     && memcmp(img->meta + (uint64_t)run * pv->sec_size,
+			       orig + (size_t)(run - s) * pv->sec_size,
+			       pv->sec_size) != 0; run++)
+		;
+	    delta_add(d, i, run - i, was, now);
+	}
+    }
+    pthread_mutex_unlock(&pv->lock);
+    free(orig);
+    ret = delta_write(d, pv->delta_file);
+    delta_free(d);
+    return ret;
+}
+
+static void preview_close(struct io_image *img)
+{
+    struct preview *pv = img->priv;
+
+    munmap(img->meta, img->size);
+    pthread_mutex_destroy(&pv->lock);
+    free(pv->dirty);
+    free(pv);
+}
+
+struct io_backend io_preview_backend = {
+    "preview", preview_open, preview_cluster, preview_dirty, preview_flush,
+    preview_close
+};
+
+/* ------------------------------------------------------------------ */
+
+static struct io_backend *backends[] = {
+    &io_mmap_backend, &io_pread_backend, &io_window_backend,
+    &io_cimg_backend, NULL
+};
+
+/* io_find_backend looks up a backend by name */
+struct io_backend *io_find_backend(char *name)
+{
+    int i;
+    for (i = 0; backends[i] != NULL; i++) {
+	if (strcmp(backends[i]->name, name) == 0)
+	    return backends[i];
+    }
+    return NULL;
+}
+
+/* open_image_backend opens the disk image with the given backend, and
+   makes it the image that cluster_to_addr works on */
+uint8_t *open_image_backend(char *filename, int *fd,
+			    struct io_backend *backend)
+{
+    struct io_image *img;
+
+    if (io_current != NULL) {
+	fprintf(stderr, "Only one disk image can be open at a time\n");
+	exit(1);
+    }
+    img = calloc(1, sizeof(struct io_image));
+    img->ops = backend;
+    img->meta = backend->open(img, filename);
+    *fd = img->fd;
+    io_current = img;
+    return img->meta;
+}
+
+/* io_choose_backend returns the backend named by the DOS_IO
+   environment variable, or mmap if it isn't set.  Compressed images
+   can only be opened with the cimg backend, so they always are. */
+struct io_backend *io_choose_backend(char *filename)
+{
+    struct io_backend *backend = &io_mmap_backend;
+    char *name = getenv("DOS_IO");
+
+    if (cimg_is_compressed(filename)) {
+	backend = &io_cimg_backend;
+    } else if (name != NULL && name[0] != '\0') {
+	backend = io_find_backend(name);
+	if (backend == NULL) {
+	    fprintf(stderr, "Unknown I/O backend %s\n", name);
+	    exit(1);
+	}
+    }
+    return backend;
+}
+
+/* open_image opens the disk image with the backend io_choose_backend
+   picks.  If DOS_IO_SIDECAR is set, the image's sidecar is used as
+   well. */
+uint8_t *open_image(char *filename, int *fd)
+{
+    struct io_backend *backend = io_choose_backend(filename);
+
+    sidecar_open(filename);
+    return open_image_backend(filename, fd, backend);
+}
+
+/* open_image_preview opens the disk image read only, for a repair to
+   be tried on a private copy of it.  When the image is flushed or
+   closed, the sectors that changed are written to delta_file instead
+   of the image. */
+uint8_t *open_image_preview(char *filename, int *fd, char *delta_file)
+{
+    if (cimg_is_compressed(filename)) {
+	fprintf(stderr, "Compressed images can't be previewed\n");
+	exit(1);
+    }
+    preview_delta_file = delta_file;
+    return open_image_backend(filename, fd, &io_preview_backend);
+}
+
+/* mark_dirty records that len bytes at addr, which came from
+   cluster_to_addr, root_dir_addr or the FAT, have been written */
+void mark_dirty(uint8_t *addr, size_t len)
+{
+    if (io_current != NULL) {
+	io_current->ops->dirty(io_current, addr, len);
+	sidecar_changed(addr, len);
+    }
+}
+
+/* flush_image writes back everything that's been changed */
+void flush_image(uint8_t *image_buf)
+{
+    flush_fat_pending();
+    if (io_current != NULL && io_current->ops->flush(io_current) < 0) {
+	fprintf(stderr, "Write to disk image failed: %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
+/* close_image writes back and closes the image opened by open_image */
+void close_image(uint8_t *image_buf)
+{
+    struct io_image *img = io_current;
+
+    if (img == NULL)
+	return;
+    flush_image(image_buf);
+    sidecar_close(image_buf, img->fd);
+    img->ops->close(img);
+    close(img->fd);
+    io_current = NULL;
+    free(img);
+}
@@ -0,0 +1,57 @@
+/* I/O backends: the different ways the disk image can be brought into
+   memory.  Everything before the first data cluster (boot sector,
+   FATs and root directory) is always resident at image_buf; data
+   clusters go through the backend's cluster() operation, which
+   cluster_to_addr() calls for offsets past meta_len.
+
+   Addresses returned by cluster() stay valid until the backend needs
+   the memory back, which for a caching backend may be the next call.
+   Callers that hold a pointer into a cluster across other cluster
+   accesses must look it up again, and anything written through such a
+   pointer must be reported with mark_dirty(). */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct io_image;
+
+struct io_backend {
+    char *name;
+    /* open the image, returning the address of the resident metadata */
+    uint8_t *(*open)(struct io_image *img, char *pathname);
+    /* return the address of the cluster starting at this image offset */
+    uint8_t *(*cluster)(struct io_image *img, uint64_t offset);
+    /* note that len bytes at addr have been written */
+    void (*dirty)(struct io_image *img, uint8_t *addr, size_t len);
+    /* write back everything that's dirty; returns 0 on success */
+    int (*flush)(struct io_image *img);
+    void (*close)(struct io_image *img);
+};
+
+struct io_image {
+    struct io_backend *ops;
+    int fd;
+    uint64_t size;		/* size of the image file */
+    uint8_t *meta;		/* resident metadata, i.e. image_buf */
+    uint64_t meta_len;		/* bytes of the image that are resident */
+    uint32_t clust_size;
+    void *priv;			/* backend's own state */
+};
+
+/* the image opened by open_image, or NULL if the tool mapped the image
+   itself with mmap_file */
+extern struct io_image *io_current;
+
+extern struct io_backend io_mmap_backend;
+extern struct io_backend io_pread_backend;
+extern struct io_backend io_window_backend;
+extern struct io_backend io_cimg_backend;
+extern struct io_backend io_preview_backend;
+
+struct io_backend *io_find_backend(char *name);
+struct io_backend *io_choose_backend(char *filename);
+uint8_t *open_image_backend(char *filename, int *fd,
+			    struct io_backend *backend);
+uint64_t io_meta_length(uint8_t *bootsector, uint32_t *clust_size);
+int read_fully(int fd, uint8_t *buf, size_t len, uint64_t offset);
+int write_fully(int fd, uint8_t *buf, size_t len, uint64_t offset);
@@ -0,0 +1,829 @@
+/* VFAT long file names: collecting the long name slots in front of a
+   short entry, writing new ones, and indexing a directory by name for
+   lookups */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "lfn.h"
+#include "lock.h"
+
+/* short name characters that need replacing, besides controls, spaces
+   and anything outside ASCII */
+#define BAD_SHORT_CHARS "\"*+,./:;<=>?[\\]|"
+
+/* the longest numeric tail a short name can get, "~999999" */
+#define MAX_TAIL 999999
+
+/* how many directory indexes dir_index_get keeps */
+#define DIR_INDEX_CACHE 16
+
+/* one name in a directory index; entries with long names appear twice,
+   once for each name */
+struct dir_ref {
+    uint32_t hash;
+    uint32_t name;		/* offset of the UTF-8 name in the pool */
+    uint16_t cluster;		/* directory cluster holding the entry */
+    uint16_t slot;		/* entry number within that cluster */
+};
+
+struct dir_index {
+    struct dir_ref *refs;
+    int n, max;
+    char *pool;
+    size_t pool_len, pool_max;
+    int *table;			/* open addressing, refs by hash */
+    uint32_t mask;
+    uint16_t dir;		/* the directory, when it's cached */
+    uint8_t *image;
+    struct dir_index *next;
+};
+
+/* the indexes dir_index_get has built, most recently used first */
+static struct dir_index *index_cache;
+
+/* ------------------------------------------------------------------ */
+/* UCS-2 and case folding */
+
+/* fold maps a character to the one it's equal to when case is
+   ignored: simple upper casing for ASCII, Latin-1, Latin Extended-A,
+   Greek and Cyrillic, which is what short name matching needs */
+static uint16_t fold(uint16_t c)
+{
+    if (c < 0x80)
+	return (c >= 'a' && c <= 'z') ? c - 0x20 : c;
+    if (c >= 0xe0 && c <= 0xfe && c != 0xf7)
+	return c - 0x20;
+    if (c == 0xff)
+	return 0x178;
+    if (c >= 0x100 && c <= 0x17f) {
+	/* mostly pairs of upper then lower case, with a few odd ones */
+	if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149
+	    || c == 0x17f)
+	    return c;
+	if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e))
+	    return (c & 1) ? c : c - 1;
+	return c & ~1;
+    }
+    if (c >= 0x3b1 && c <= 0x3c9 && c != 0x3c2)
+	return c - 0x20;
+    if (c >= 0x430 && c <= 0x44f)
+	return c - 0x20;
+    if (c >= 0x450 && c <= 0x45f)
+	return c - 0x50;
+    return c;
+}
+
+/* utf8_to_ucs2 converts a name, returning its length in characters, or
+   -1 if it's longer than max.  Anything UCS-2 can't hold becomes '_'. */
+static int utf8_to_ucs2(char *s, uint16_t *out, int max)
+{
+    uint8_t *p = (uint8_t*)s;
+    uint32_t c;
+    int n = 0;
+
+    while (*p != '\0') {
+	c = *p++;
+	if (c >= 0xc0 && c < 0xe0 && (p[0] & 0xc0) == 0x80) {
+	    c = ((c & 0x1f) << 6) | (p[0] & 0x3f);
+	    p++;
+	} else if (c >= 0xe0 && c < 0xf0 && (p[0] & 0xc0) == 0x80
+		   && (p[1] & 0xc0) == 0x80) {
+	    c = ((c & 0x0f) << 12) | ((p[0] & 0x3f) << 6) | (p[1] & 0x3f);
+	    p += 2;
+	} else if (c >= 0x80) {
+	    /* a four byte sequence, or not UTF-8 at all */
+	    while ((*p & 0xc0) == 0x80)
+		p++;
+	    c = '_';
+	}
+	if (n == max)
+	    return -1;
+	out[n++] = c;
+    }
+    return n;
+}
+
+static void ucs2_to_utf8(uint16_t *in, int len, char *out, size_t size)
+{
+    size_t n = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+	uint16_t c = in[i];
+	if (c < 0x80) {
+	    if (n + 1 >= size)
+		break;
+	    out[n++] = c;
+	} else if (c < 0x800) {
+	    if (n + 2 >= size)
+		break;
+	    out[n++] = 0xc0 | (c >> 6);
+	    out[n++] = 0x80 | (c & 0x3f);
+	} else {
+	    if (n + 3 >= size)
+		break;
+	    out[n++] = 0xe0 | (c >> 12);
+	    out[n++] = 0x80 | ((c >> 6) & 0x3f);
+	    out[n++] = 0x80 | (c & 0x3f);
+	}
+    }
+    out[n] = '\0';
+}
+
+static uint32_t hash_ucs2(uint16_t *name, int len)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++) {
+	uint16_t c = fold(name[i]);
+	h = (h ^ (c & 0xff)) * 16777619U;
+	h = (h ^ (c >> 8)) * 16777619U;
+    }
+    return h;
+}
+
+/* lfn_hash returns the hash of a UTF-8 name with case folded, so that
+   names that match have the same hash */
+uint32_t lfn_hash(char *name)
+{
+    uint16_t ucs[WIN_MAXLEN];
+    int len = utf8_to_ucs2(name, ucs, WIN_MAXLEN);
+    return hash_ucs2(ucs, len < 0 ? WIN_MAXLEN : len);
+}
+
+/* names_match compares two UTF-8 names, ignoring case */
+static int names_match(char *a, char *b)
+{
+    uint16_t ua[WIN_MAXLEN], ub[WIN_MAXLEN];
+    int la, lb, i;
+
+    la = utf8_to_ucs2(a, ua, WIN_MAXLEN);
+    lb = utf8_to_ucs2(b, ub, WIN_MAXLEN);
+    if (la < 0 || la != lb)
+	return FALSE;
+    for (i = 0; i < la; i++) {
+	if (fold(ua[i]) != fold(ub[i]))
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+/* ------------------------------------------------------------------ */
+/* reading long names */
+
+/* lfn_checksum is the checksum of an 11 byte short name that every
+   slot of its long name carries */
+uint8_t lfn_checksum(uint8_t *short_name)
+{
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++)
+	sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    return sum;
+}
+
+void lfn_reset(struct lfn_state *ls)
+{
+    ls->len = 0;
+    ls->expect = 0;
+    ls->complete = FALSE;
+}
+
+/* lfn_feed looks at the next entry of a directory.  If it's a long name
+   slot, it's collected and TRUE returned, and the caller should move
+   on; slots that are out of sequence are dropped. */
+int lfn_feed(struct lfn_state *ls, struct direntry *dirent)
+{
+    struct winentry *we = (struct winentry*)dirent;
+    uint16_t *p;
+    int seq, i;
+
+    if (dirent->deName[0] == SLOT_EMPTY || dirent->deName[0] == SLOT_DELETED
+	|| dirent->deAttributes != ATTR_WIN95)
+	return FALSE;
+
+    seq = we->weCnt & WIN_CNT;
+    if ((we->weCnt & WIN_LAST) != 0) {
+	/* the first slot on disk holds the end of the name */
+	lfn_reset(ls);
+	if (seq == 0 || seq > WIN_MAXSUBENTRIES)
+	    return TRUE;
+	ls->expect = seq;
+	ls->len = seq * WIN_CHARS;
+	ls->chksum = we->weChksum;
+    } else if (ls->expect == 0 || seq != ls->expect
+	       || we->weChksum != ls->chksum) {
+	lfn_reset(ls);
+	return TRUE;
+    }
+
+    p = ls->name + (seq - 1) * WIN_CHARS;
+    for (i = 0; i < 5; i++)
+	*p++ = getushort(&we->wePart1[i * 2]);
+    for (i = 0; i < 6; i++)
+	*p++ = getushort(&we->wePart2[i * 2]);
+    for (i = 0; i < 2; i++)
+	*p++ = getushort(&we->wePart3[i * 2]);
+    ls->expect = seq - 1;
+    if (seq == 1) {
+	/* the name ends at a NUL, or fills the last slot exactly */
+	for (i = 0; i < ls->len && ls->name[i] != 0; i++)
+	    ;
+	ls->len = i;
+	ls->complete = ls->len > 0;
+    }
+    return TRUE;
+}
+
+/* lfn_short_name formats the 8.3 name of an entry as NAME.EXT, or just
+   NAME if there's no extension */
+void lfn_short_name(struct direntry *dirent, char *name, size_t size)
+{
+    char buf[13];
+    int i, n = 0;
+
+    for (i = 0; i < 8 && dirent->deName[i] != ' '; i++)
+	buf[n++] = (i == 0 && dirent->deName[0] == SLOT_E5)
+	    ? SLOT_DELETED : dirent->deName[i];
+    if (dirent->deExtension[0] != ' ') {
+	buf[n++] = '.';
+	for (i = 0; i < 3 && dirent->deExtension[i] != ' '; i++)
+	    buf[n++] = dirent->deExtension[i];
+    }
+    buf[n] = '\0';
+    snprintf(name, size, "%s", buf);
+}
+
+/* lfn_name gives the name of a short entry: its long name if the slots
+   before it made one with the right checksum, and otherwise its 8.3
+   name.  It returns TRUE for a long name, and starts collecting
+   afresh. */
+int lfn_name(struct lfn_state *ls, struct direntry *dirent,
+	     char *name, size_t size)
+{
+    int is_long = ls->complete && ls->expect == 0
+	&& ls->chksum == lfn_checksum(dirent->deName);
+
+    if (is_long)
+	ucs2_to_utf8(ls->name, ls->len, name, size);
+    else
+	lfn_short_name(dirent, name, size);
+    lfn_reset(ls);
+    return is_long;
+}
+
+/* ------------------------------------------------------------------ */
+/* walking a directory */
+
+typedef int (*dir_visit)(struct direntry *dirent, uint16_t cluster,
+			 int slot, void *arg);
+
+/* dir_walk calls visit on every slot of a directory, in order, until
+   it returns TRUE or the directory ends */
+static void dir_walk(uint16_t cluster, dir_visit visit, void *arg,
+		     uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    int per_cluster, slot;
+    long steps = 0;
+
+    per_cluster = cluster == 0 ? bpb->bpbRootDirEnts
+	: bpb->bpbBytesPerSec * bpb->bpbSecPerClust / sizeof(struct direntry);
+    while (1) {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	for (slot = 0; slot < per_cluster; slot++) {
+	    if (visit(dirent + slot, cluster, slot, arg))
+		return;
+	}
+	if (cluster == 0)
+	    return;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (cluster < CLUST_FIRST || is_end_of_file(cluster)
+	    || steps++ >= bpb->bpbSectors)
+	    return;
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* the directory index */
+
+static void index_add(struct dir_index *di, char *name, uint16_t cluster,
+		      int slot)
+{
+    size_t len = strlen(name) + 1;
+    struct dir_ref *ref;
+
+    if (di->n == di->max) {
+	di->max = di->max ? di->max * 2 : 64;
+	di->refs = realloc(di->refs, di->max * sizeof(struct dir_ref));
+    }
+    if (di->pool_len + len > di->pool_max) {
+	while (di->pool_len + len > di->pool_max)
+	    di->pool_max = di->pool_max ? di->pool_max * 2 : 1024;
+	di->pool = realloc(di->pool, di->pool_max);
+    }
+    ref = &di->refs[di->n++];
+    ref->hash = lfn_hash(name);
+    ref->name = di->pool_len;
+    ref->cluster = cluster;
+    ref->slot = slot;
+    memcpy(di->pool + di->pool_len, name, len);
+    di->pool_len += len;
+}
+
+/* index_table (re)makes the hash table of an index for all its refs,
+   with room for as many again */
+static void index_table(struct dir_index *di)
+{
+    uint32_t size = 16;
+    int i, h;
+
+    while (size < 4 * (uint32_t)di->n)
+	size *= 2;
+    free(di->table);
+    di->mask = size - 1;
+    di->table = malloc(size * sizeof(int));
+    for (i = 0; i < size; i++)
+	di->table[i] = -1;
+    for (i = 0; i < di->n; i++) {
+	for (h = di->refs[i].hash & di->mask; di->table[h] >= 0;
+	     h = (h + 1) & di->mask)
+	    ;
+	di->table[h] = i;
+    }
+}
+
+/* index_insert adds a name to an index that's already been built */
+static void index_insert(struct dir_index *di, char *name, uint16_t cluster,
+			 int slot)
+{
+    int h;
+
+    index_add(di, name, cluster, slot);
+    if (2 * (uint32_t)di->n > di->mask + 1) {
+	index_table(di);
+	return;
+    }
+    for (h = di->refs[di->n - 1].hash & di->mask; di->table[h] >= 0;
+	 h = (h + 1) & di->mask)
+	;
+    di->table[h] = di->n - 1;
+}
+
+struct build_state {
+    struct dir_index *di;
+    struct lfn_state ls;
+};
+
+static int index_visit(struct direntry *dirent, uint16_t cluster, int slot,
+		       void *arg)
+{
+    struct build_state *bs = arg;
+    char name[LFN_MAX_UTF8];
+
+    if (dirent->deName[0] == SLOT_EMPTY)
+	return TRUE;
+    if (lfn_feed(&bs->ls, dirent))
+	return FALSE;
+    if (dirent->deName[0] == SLOT_DELETED
+	|| (dirent->deAttributes & ATTR_VOLUME) != 0) {
+	lfn_reset(&bs->ls);
+	return FALSE;
+    }
+    /* a file can be found by either of its names */
+    if (lfn_name(&bs->ls, dirent, name, sizeof(name)))
+	index_add(bs->di, name, cluster, slot);
+    lfn_short_name(dirent, name, sizeof(name));
+    index_add(bs->di, name, cluster, slot);
+    return FALSE;
+}
+
+/* dir_index_build reads a directory once and indexes its entries by
+   case-folded name hash, so each lookup in it is a hash probe */
+struct dir_index *dir_index_build(uint16_t cluster, uint8_t *image_buf,
+				  struct bpb33* bpb)
+{
+    struct build_state bs;
+    struct dir_index *di;
+
+    di = calloc(1, sizeof(struct dir_index));
+    bs.di = di;
+    lfn_reset(&bs.ls);
+    dir_walk(cluster, index_visit, &bs, image_buf, bpb);
+    index_table(di);
+    return di;
+}
+
+/* dir_index_get returns the index of the directory at cluster, only
+   reading the directory the first time.  The index stays cached for
+   later lookups, and lfn_create keeps it up to date, so it mustn't be
+   freed.  Anything else that may have changed the directory, such as
+   another process, needs a dir_index_drop first. */
+struct dir_index *dir_index_get(uint16_t cluster, uint8_t *image_buf,
+				struct bpb33* bpb)
+{
+    struct dir_index *di, **pp;
+    int n = 0;
+
+    for (pp = &index_cache; *pp != NULL; pp = &(*pp)->next, n++) {
+	di = *pp;
+	if (di->dir == cluster && di->image == image_buf) {
+	    *pp = di->next;
+	    di->next = index_cache;
+	    index_cache = di;
+	    return di;
+	}
+	if (n == DIR_INDEX_CACHE - 1 && di->next != NULL) {
+	    /* full: the least recently used one goes */
+	    dir_index_free(di->next);
+	    di->next = NULL;
+	}
+    }
+    di = dir_index_build(cluster, image_buf, bpb);
+    di->dir = cluster;
+    di->image = image_buf;
+    di->next = index_cache;
+    index_cache = di;
+    return di;
+}
+
+/* dir_index_drop forgets the cached index of the directory at cluster,
+   so that the next dir_index_get reads the directory afresh */
+void dir_index_drop(uint16_t cluster)
+{
+    struct dir_index *di, **pp;
+
+    for (pp = &index_cache; *pp != NULL; pp = &(*pp)->next) {
+	di = *pp;
+	if (di->dir == cluster) {
+	    *pp = di->next;
+	    dir_index_free(di);
+	    return;
+	}
+    }
+}
+
+/* dir_index_find returns the entry with this name, long or short, or
+   NULL if there isn't one */
+struct direntry *dir_index_find(struct dir_index *di, char *name,
+				uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t hash = lfn_hash(name);
+    struct dir_ref *ref;
+    int h;
+
+    for (h = hash & di->mask; di->table[h] >= 0; h = (h + 1) & di->mask) {
+	ref = &di->refs[di->table[h]];
+	if (ref->hash == hash && names_match(di->pool + ref->name, name))
+	    return (struct direntry*)cluster_to_addr(ref->cluster, image_buf,
+						     bpb) + ref->slot;
+    }
+    return NULL;
+}
+
+void dir_index_free(struct dir_index *di)
+{
+    free(di->refs);
+    free(di->pool);
+    free(di->table);
+    free(di);
+}
+
+/* ------------------------------------------------------------------ */
+/* writing long names */
+
+/* short_char maps a character to one that's allowed in a short name,
+   noting whether anything was lost */
+static char short_char(uint16_t c, int *lossy)
+{
+    if (c <= ' ' || c >= 0x7f || strchr(BAD_SHORT_CHARS, c) != NULL) {
+	*lossy = TRUE;
+	return '_';
+    }
+    return (c >= 'a' && c <= 'z') ? c - 0x20 : c;
+}
+
+static void format_short(char *base, int base_len, char *ext, char *out)
+{
+    if (ext[0] != '\0')
+	sprintf(out, "%.*s.%s", base_len, base, ext);
+    else
+	sprintf(out, "%.*s", base_len, base);
+}
+
+/* make_short_name works out the 8.3 name for a long name, adding a
+   numeric tail like ~1 if characters had to be dropped or replaced, and
+   says whether a long name is needed as well.  With no directory index
+   di, no tail is added. */
+static int make_short_name(uint16_t *ucs, int len, struct dir_index *di,
+			   uint8_t *short_name, int *needs_lfn,
+			   uint8_t *image_buf, struct bpb33* bpb)
+{
+    char base[9], ext[4], candidate[16], tail[8], exact[16];
+    int dot = -1, base_len = 0, ext_len = 0, lossy = FALSE;
+    int i, n, keep;
+
+    for (i = 0; i < len; i++) {
+	if (ucs[i] == '.')
+	    dot = i;
+    }
+    if (dot == 0)
+	dot = -1;		/* a leading dot doesn't start an extension */
+    for (i = 0; i < (dot < 0 ? len : dot); i++) {
+	if (ucs[i] == ' ' || ucs[i] == '.') {
+	    lossy = TRUE;
+	    continue;
+	}
+	if (base_len == 8) {
+	    lossy = TRUE;
+	    break;
+	}
+	base[base_len++] = short_char(ucs[i], &lossy);
+    }
+    for (i = dot + 1; dot >= 0 && i < len; i++) {
+	if (ucs[i] == ' ') {
+	    lossy = TRUE;
+	    continue;
+	}
+	if (ext_len == 3) {
+	    lossy = TRUE;
+	    break;
+	}
+	ext[ext_len++] = short_char(ucs[i], &lossy);
+    }
+    base[base_len] = '\0';
+    ext[ext_len] = '\0';
+    if (base_len == 0) {
+	base[base_len++] = '_';
+	base[base_len] = '\0';
+	lossy = TRUE;
+    }
+
+    /* the short name on its own will do if it says exactly the same */
+    format_short(base, base_len, ext, exact);
+    *needs_lfn = lossy || (int)strlen(exact) != len;
+    for (i = 0; !*needs_lfn && i < len; i++) {
+	if (ucs[i] != (uint8_t)exact[i])
+	    *needs_lfn = TRUE;
+    }
+
+    if (lossy && di != NULL) {
+	for (n = 1; n <= MAX_TAIL; n++) {
+	    sprintf(tail, "~%d", n);
+	    keep = 8 - strlen(tail);
+	    if (keep > base_len)
+		keep = base_len;
+	    memcpy(candidate, base, keep);
+	    strcpy(candidate + keep, tail);
+	    format_short(candidate, strlen(candidate), ext, exact);
+	    if (dir_index_find(di, exact, image_buf, bpb) == NULL)
+		break;
+	}
+	if (n > MAX_TAIL)
+	    return -1;
+	strcpy(base, candidate);
+	base_len = strlen(base);
+    }
+
+    memset(short_name, ' ', 11);
+    memcpy(short_name, base, base_len);
+    memcpy(short_name + 8, ext, ext_len);
+    if (short_name[0] == SLOT_DELETED)
+	short_name[0] = SLOT_E5;
+    return 0;
+}
+
+struct space_state {
+    int need;			/* consecutive free slots wanted */
+    int run;
+    uint16_t cluster;		/* the cluster being looked at */
+    uint16_t start_cluster;	/* cluster the run starts in */
+    int start;			/* slot the run starts at */
+    int past_end;		/* we're past the end of the directory */
+    int found;
+};
+
+/* space_visit looks for a run of free slots.  The run may carry on
+   from one cluster of a subdirectory into the next, so it's written a
+   cluster at a time. */
+static int space_visit(struct direntry *dirent, uint16_t cluster, int slot,
+		       void *arg)
+{
+    struct space_state *ss = arg;
+
+    ss->cluster = cluster;
+    if (dirent->deName[0] == SLOT_EMPTY)
+	ss->past_end = TRUE;
+    if (!ss->past_end && dirent->deName[0] != SLOT_DELETED) {
+	ss->run = 0;
+	return FALSE;
+    }
+    if (ss->run == 0) {
+	ss->start_cluster = cluster;
+	ss->start = slot;
+    }
+    if (++ss->run == ss->need) {
+	ss->found = TRUE;
+	return TRUE;
+    }
+    return FALSE;
+}
+
+/* put_name_part copies characters of a long name into a slot; the
+   name is NUL terminated if there's room, and padded with 0xffff */
+static void put_name_part(uint8_t *dst, int count, uint16_t *ucs, int len,
+			  int *pos)
+{
+    uint16_t c;
+    int i;
+
+    for (i = 0; i < count; i++, (*pos)++) {
+	if (*pos < len)
+	    c = ucs[*pos];
+	else if (*pos == len)
+	    c = 0;
+	else
+	    c = 0xffff;
+	putushort(dst + i * 2, c);
+    }
+}
+
+/* grow_dir adds a zeroed cluster to the end of the directory whose
+   last cluster is last, returning it, or 0 if the volume is full */
+static uint16_t grow_dir(uint16_t last, uint8_t *image_buf,
+			 struct bpb33* bpb)
+{
+    uint32_t clust_bytes = geometry(bpb)->clust_bytes;
+    uint16_t cluster;
+    uint8_t *p;
+
+    lock_fat();
+    cluster = find_free_cluster(CLUST_FIRST, image_buf, bpb);
+    if (cluster != 0) {
+	set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	p = cluster_to_addr(cluster, image_buf, bpb);
+	memset(p, 0, clust_bytes);
+	mark_dirty(p, clust_bytes);
+	set_fat_entry(last, cluster, image_buf, bpb);
+	flush_fat(image_buf, bpb);
+    }
+    unlock_fat();
+    return cluster;
+}
+
+/* lfn_slots returns how many directory slots lfn_create will use for
+   name, or -1 if it can't be stored */
+int lfn_slots(char *name)
+{
+    uint16_t ucs[WIN_MAXLEN];
+    uint8_t short_name[11];
+    int len, needs_lfn;
+
+    len = utf8_to_ucs2(name, ucs, WIN_MAXLEN);
+    if (len <= 0)
+	return -1;
+    make_short_name(ucs, len, NULL, short_name, &needs_lfn, NULL, NULL);
+    return needs_lfn ? (len + WIN_CHARS - 1) / WIN_CHARS + 1 : 1;
+}
+
+/* next_slot steps *cluster and *slot on to the following directory
+   slot, into the next cluster of a subdirectory if need be, and
+   returns its address, or NULL at the end of the directory */
+static struct direntry *next_slot(uint16_t *cluster, int *slot,
+				  int per_cluster, uint8_t *image_buf,
+				  struct bpb33* bpb)
+{
+    if (++*slot == per_cluster) {
+	if (*cluster == 0)
+	    return NULL;
+	*cluster = get_fat_entry(*cluster, image_buf, bpb);
+	if (*cluster < CLUST_FIRST || is_end_of_file(*cluster))
+	    return NULL;
+	*slot = 0;
+    }
+    return (struct direntry*)cluster_to_addr(*cluster, image_buf, bpb)
+	+ *slot;
+}
+
+/* lfn_create adds an entry called name to the directory starting at
+   dir_cluster (0 for the root), with a long name in front of it if the
+   name isn't a plain 8.3 one.  A subdirectory without a long enough
+   run of free slots is given more clusters.  It returns the new short
+   entry, or NULL if the name is unusable, or the directory has no room
+   and can't be grown. */
+struct direntry *lfn_create(uint16_t dir_cluster, char *name, uint8_t attr,
+			    uint16_t start_cluster, uint32_t size,
+			    uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint16_t ucs[WIN_MAXLEN];
+    uint8_t short_name[11], chksum;
+    char long_str[LFN_MAX_UTF8];
+    struct dir_index *di;
+    struct space_state ss;
+    struct direntry *dirent, *first;
+    struct winentry *we;
+    int len, needs_lfn, slots, per_cluster, i, seq, pos, slot;
+    uint16_t cluster, next;
+
+    len = utf8_to_ucs2(name, ucs, WIN_MAXLEN);
+    if (len <= 0)
+	return NULL;
+    di = dir_index_get(dir_cluster, image_buf, bpb);
+    i = make_short_name(ucs, len, di, short_name, &needs_lfn,
+			image_buf, bpb);
+    if (i < 0)
+	return NULL;
+    slots = needs_lfn ? (len + WIN_CHARS - 1) / WIN_CHARS + 1 : 1;
+
+    per_cluster = dir_cluster == 0 ? bpb->bpbRootDirEnts
+	: bpb->bpbBytesPerSec * bpb->bpbSecPerClust / sizeof(struct direntry);
+    memset(&ss, 0, sizeof(ss));
+    ss.need = slots;
+    ss.cluster = dir_cluster;
+    dir_walk(dir_cluster, space_visit, &ss, image_buf, bpb);
+    if (!ss.found) {
+	/* the root directory can't grow; a subdirectory can, until the
+	   free run at its end is long enough.  ss.cluster is its last
+	   one, and new clusters are all free slots. */
+	if (dir_cluster == 0)
+	    return NULL;
+	while (ss.run < slots) {
+	    next = grow_dir(ss.cluster, image_buf, bpb);
+	    if (next == 0)
+		return NULL;
+	    if (ss.run == 0) {
+		ss.start_cluster = next;
+		ss.start = 0;
+	    }
+	    ss.cluster = next;
+	    ss.run += per_cluster;
+	}
+	ss.past_end = TRUE;
+    }
+
+    /* the slots are written, and marked dirty, a cluster at a time */
+    cluster = ss.start_cluster;
+    slot = ss.start;
+    dirent = first = (struct direntry*)cluster_to_addr(cluster, image_buf,
+						       bpb) + slot;
+    chksum = lfn_checksum(short_name);
+    for (i = 0; i < slots - 1; i++) {
+	/* the end of the name comes first */
+	seq = slots - 1 - i;
+	we = (struct winentry*)dirent;
+	memset(we, 0, sizeof(struct winentry));
+	we->weCnt = seq | (i == 0 ? WIN_LAST : 0);
+	we->weAttributes = ATTR_WIN95;
+	we->weChksum = chksum;
+	pos = (seq - 1) * WIN_CHARS;
+	put_name_part(we->wePart1, 5, ucs, len, &pos);
+	put_name_part(we->wePart2, 6, ucs, len, &pos);
+	put_name_part(we->wePart3, 2, ucs, len, &pos);
+	if (slot == per_cluster - 1)
+	    mark_dirty((uint8_t*)first, (uint8_t*)(dirent + 1)
+		       - (uint8_t*)first);
+	dirent = next_slot(&cluster, &slot, per_cluster, image_buf, bpb);
+	if (slot == 0)
+	    first = dirent;
+    }
+    memset(dirent, 0, sizeof(struct direntry));
+    memcpy(dirent->deName, short_name, 11);
+    dirent->deAttributes = attr;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+    mark_dirty((uint8_t*)first, (uint8_t*)(dirent + 1) - (uint8_t*)first);
+
+    if (ss.past_end) {
+	/* we used the end of the directory, so mark the new end */
+	next = cluster;
+	i = slot;
+	first = next_slot(&next, &i, per_cluster, image_buf, bpb);
+	if (first != NULL) {
+	    memset(first, 0, sizeof(struct direntry));
+	    mark_dirty((uint8_t*)first, sizeof(struct direntry));
+	}
+	/* that may have been in the next cluster */
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb)
+	    + slot;
+    }
+
+    /* the cached index of the directory gets the new names too */
+    if (needs_lfn) {
+	ucs2_to_utf8(ucs, len, long_str, sizeof(long_str));
+	index_insert(di, long_str, cluster, slot);
+    }
+    lfn_short_name(dirent, long_str, sizeof(long_str));
+    index_insert(di, long_str, cluster, slot);
+    return dirent;
+}
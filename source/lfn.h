@@ -0,0 +1,43 @@
+/* VFAT long file names.  A long name is stored in a run of winentry
+   slots just before the short (8.3) entry it belongs to, last part
+   first, each carrying a checksum of the short name so that a stale
+   run can be told apart.  Names are UCS-2 on disk and UTF-8 here. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* room for the longest name in UTF-8, plus the terminator */
+#define LFN_MAX_UTF8 (WIN_MAXLEN * 3 + 1)
+
+/* the long name collected so far while walking a directory */
+struct lfn_state {
+    uint16_t name[WIN_MAXSUBENTRIES * WIN_CHARS];
+    int len;			/* characters in name, once complete */
+    int expect;			/* sequence number of the next slot */
+    int complete;		/* every slot down to 1 has been seen */
+    uint8_t chksum;
+};
+
+struct dir_index;
+
+void lfn_reset(struct lfn_state *ls);
+int lfn_feed(struct lfn_state *ls, struct direntry *dirent);
+int lfn_name(struct lfn_state *ls, struct direntry *dirent,
+	     char *name, size_t size);
+void lfn_short_name(struct direntry *dirent, char *name, size_t size);
+uint8_t lfn_checksum(uint8_t *short_name);
+uint32_t lfn_hash(char *name);
+
+struct dir_index *dir_index_build(uint16_t cluster, uint8_t *image_buf,
+				  struct bpb33* bpb);
+struct direntry *dir_index_find(struct dir_index *di, char *name,
+				uint8_t *image_buf, struct bpb33* bpb);
+void dir_index_free(struct dir_index *di);
+struct dir_index *dir_index_get(uint16_t cluster, uint8_t *image_buf,
+				struct bpb33* bpb);
+void dir_index_drop(uint16_t cluster);
+
+int lfn_slots(char *name);
+struct direntry *lfn_create(uint16_t dir_cluster, char *name, uint8_t attr,
+			    uint16_t start_cluster, uint32_t size,
+			    uint8_t *image_buf, struct bpb33* bpb);
@@ -0,0 +1,127 @@
+/* byte-range locks on the disk image; see lock.h */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "io.h"
+#include "lock.h"
+
+static int lock_fd = -1;		/* the image, for fcntl */
+static int lock_regions = 0;		/* locking regions, not the whole image */
+static struct geometry *lock_geom;
+
+/* set_lock locks or unlocks len bytes at offset, waiting for anyone
+   else holding them */
+static void set_lock(int type, uint64_t offset, uint64_t len)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offset;
+    fl.l_len = len;
+    while (fcntl(lock_fd, F_SETLKW, &fl) < 0) {
+	if (errno == EINTR)
+	    continue;
+	fprintf(stderr, "Cannot lock disk image: %s\n", strerror(errno));
+	exit(1);
+    }
+}
+
+/* open_image_locked opens the disk image for writing alongside other
+   processes.  The whole image is locked before the backend reads any
+   of it; if the backend maps it shared, that's swapped for region
+   locks as soon as it's open.  The sidecar isn't used, as its decoded
+   copy of the FAT wouldn't see the other writers' changes. */
+uint8_t *open_image_locked(char *filename, int *fd)
+{
+    struct io_backend *backend = io_choose_backend(filename);
+    uint8_t *image_buf;
+    int whole_fd;
+
+    /* closing any descriptor for the image drops every lock this
+       process holds on it, so the whole image lock gets its own
+       descriptor, kept open for as long as it's needed */
+    whole_fd = open(filename, O_RDWR);
+    if (whole_fd < 0) {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		filename, strerror(errno));
+	exit(1);
+    }
+    lock_fd = whole_fd;
+    set_lock(F_WRLCK, 0, 0);
+
+    image_buf = open_image_backend(filename, fd, backend);
+    lock_fd = *fd;
+    if (backend == &io_mmap_backend || backend == &io_window_backend) {
+	lock_regions = 1;
+	close(whole_fd);
+    }
+    return image_buf;
+}
+
+/* lock_attach tells the locks where the regions of the volume are;
+   call it once check_bootsector has read the BPB */
+void lock_attach(struct bpb33* bpb)
+{
+    lock_geom = geometry(bpb);
+}
+
+static uint64_t cluster_start(uint16_t cluster)
+{
+    if (cluster == MSDOSFSROOT)
+	return lock_geom->root_offset;
+    return lock_geom->data_offset
+	+ (uint64_t)(cluster - CLUST_FIRST) * lock_geom->clust_bytes;
+}
+
+void lock_fat(void)
+{
+    if (lock_regions)
+	set_lock(F_WRLCK, lock_geom->fat_offset,
+		 lock_geom->root_offset - lock_geom->fat_offset);
+}
+
+void unlock_fat(void)
+{
+    if (lock_regions)
+	set_lock(F_UNLCK, lock_geom->fat_offset,
+		 lock_geom->root_offset - lock_geom->fat_offset);
+}
+
+void lock_dir(uint16_t cluster, int exclusive)
+{
+    if (lock_regions)
+	set_lock(exclusive ? F_WRLCK : F_RDLCK, cluster_start(cluster), 1);
+}
+
+void unlock_dir(uint16_t cluster)
+{
+    if (lock_regions)
+	set_lock(F_UNLCK, cluster_start(cluster), 1);
+}
+
+void lock_extent(uint16_t first, uint32_t count)
+{
+    if (lock_regions)
+	set_lock(F_WRLCK, cluster_start(first),
+		 (uint64_t)count * lock_geom->clust_bytes);
+}
+
+void unlock_extent(uint16_t first, uint32_t count)
+{
+    if (lock_regions)
+	set_lock(F_UNLCK, cluster_start(first),
+		 (uint64_t)count * lock_geom->clust_bytes);
+}
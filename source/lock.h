@@ -0,0 +1,31 @@
+/* byte-range locks on the disk image, so that several processes can
+   copy files into it at once.  Each kind of thing that gets changed
+   has its own lock domain in the image file:
+
+   - the FATs, all copies, held only while clusters are allocated or
+     given back and the change is mirrored to the other copies
+   - each directory, the first byte of its first cluster (or of the
+     root directory), shared while it's looked up and exclusive while
+     entries are added to it
+   - data extents, the clusters a file's data is being written to
+
+   They're always taken in that order, directory before FAT before
+   extent, so two processes can't deadlock.
+
+   Processes only see each other's changes straight away if the image
+   is mapped MAP_SHARED, as the mmap and window backends do.  With any
+   other backend the whole image is locked from before it's opened
+   until it's closed, and writers take turns. */
+
+#include <stdint.h>
+
+struct bpb33;
+
+uint8_t *open_image_locked(char *filename, int *fd);
+void lock_attach(struct bpb33* bpb);
+void lock_fat(void);
+void unlock_fat(void);
+void lock_dir(uint16_t cluster, int exclusive);
+void unlock_dir(uint16_t cluster);
+void lock_extent(uint16_t first, uint32_t count);
+void unlock_extent(uint16_t first, uint32_t count);
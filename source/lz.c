@@ -0,0 +1,162 @@
+/* LZ77 compression using LZ4's block format.  A block is a series of
+   sequences, each a token byte (literal count in the high nibble, match
+   length minus 4 in the low nibble, 15 meaning more length bytes
+   follow), the literals, and a two byte little-endian match offset.
+   The last sequence has only literals. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+/* matches can't start in the last 12 bytes or run into the last 5 */
+#define MATCH_LIMIT 12
+#define LAST_LITERALS 5
+
+static uint32_t read32(uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* put_length writes the part of a length that didn't fit in its nibble */
+static uint32_t put_length(uint8_t *dst, uint32_t len)
+{
+    uint32_t n = 0;
+    while (len >= 255) {
+	dst[n++] = 255;
+	len -= 255;
+    }
+    dst[n++] = len;
+    return n;
+}
+
+/* emit writes one sequence, returning the new output position or 0 if
+   it won't fit */
+static uint32_t emit(uint8_t *dst, uint32_t op, uint32_t cap, uint8_t *lit,
+		     uint32_t lit_len, uint32_t offset, uint32_t match_len)
+{
+    uint32_t token_pos = op;
+    uint32_t ml = match_len > 0 ? match_len - MIN_MATCH : 0;
+
+    if (op + 1 + lit_len + lit_len / 255 + 1 + 2 + ml / 255 + 1 > cap)
+	return 0;
+    op++;
+    dst[token_pos] = (lit_len < 15 ? lit_len : 15) << 4;
+    if (lit_len >= 15)
+	op += put_length(dst + op, lit_len - 15);
+    memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+	return op;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    dst[token_pos] |= ml < 15 ? ml : 15;
+    if (ml >= 15)
+	op += put_length(dst + op, ml - 15);
+    return op;
+}
+
+/* lz_compress compresses len bytes from src into dst, returning the
+   compressed length, or 0 if it won't fit in cap bytes */
+uint32_t lz_compress(uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap)
+{
+    int32_t table[1 << HASH_BITS];
+    uint32_t ip = 0, anchor = 0, op = 0, ref, h, match_len;
+    int32_t prev;
+    int i;
+
+    for (i = 0; i < (1 << HASH_BITS); i++)
+	table[i] = -1;
+
+    while (len > MATCH_LIMIT && ip < len - MATCH_LIMIT) {
+	h = hash32(read32(src + ip));
+	prev = table[h];
+	table[h] = ip;
+	ref = prev;
+	if (prev < 0 || ip - ref > MAX_OFFSET
+	    || read32(src + ref) != read32(src + ip)) {
+	    /* skip faster through data that isn't compressing */
+	    ip += 1 + ((ip - anchor) >> 6);
+	    continue;
+	}
+	match_len = MIN_MATCH;
+	while (ip + match_len < len - LAST_LITERALS
+	       && src[ref + match_len] == src[ip + match_len])
+	    match_len++;
+	op = emit(dst, op, cap, src + anchor, ip - anchor, ip - ref,
+		  match_len);
+	if (op == 0)
+	    return 0;
+	ip += match_len;
+	anchor = ip;
+    }
+    return emit(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+/* lz_decompress expands a block that must come to exactly out_len
+   bytes; it returns 0 on success and -1 if the block is corrupt */
+int lz_decompress(uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len)
+{
+    uint32_t ip = 0, op = 0, lit_len, match_len, offset, i;
+    uint8_t b;
+
+    while (ip < len) {
+	uint8_t token = src[ip++];
+
+	lit_len = token >> 4;
+	if (lit_len == 15) {
+	    do {
+		if (ip >= len)
+		    return -1;
+		b = src[ip++];
+		lit_len += b;
+	    } while (b == 255);
+	}
+	if (lit_len > len - ip || lit_len > out_len - op)
+	    return -1;
+	memcpy(dst + op, src + ip, lit_len);
+	ip += lit_len;
+	op += lit_len;
+	if (ip == len)
+	    break;		/* the last sequence has no match */
+
+	if (len - ip < 2)
+	    return -1;
+	offset = src[ip] | (src[ip + 1] << 8);
+	ip += 2;
+	if (offset == 0 || offset > op)
+	    return -1;
+	match_len = token & 15;
+	if (match_len == 15) {
+	    do {
+		if (ip >= len)
+		    return -1;
+		b = src[ip++];
+		match_len += b;
+	    } while (b == 255);
+	}
+	match_len += MIN_MATCH;
+	if (match_len > out_len - op)
+	    return -1;
+	if (offset >= match_len) {
+	    memcpy(dst + op, dst + op - offset, match_len);
+	} else {
+	    /* the match overlaps what it's copying, so go byte by byte */
+	    for (i = 0; i < match_len; i++)
+		dst[op + i] = dst[op - offset + i];
+	}
+	op += match_len;
+    }
+    return op == out_len ? 0 : -1;
+}
@@ -0,0 +1,10 @@
+/* a small LZ77 codec in the style of LZ4's block format: fast to
+   decompress, which is what matters for reading compressed images */
+
+#include <stdint.h>
+
+/* lz_bound is the most space lz_compress can need for len bytes */
+#define lz_bound(len) ((len) + (len) / 255 + 16)
+
+uint32_t lz_compress(uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap);
+int lz_decompress(uint8_t *src, uint32_t len, uint8_t *dst, uint32_t out_len);
@@ -0,0 +1,508 @@
+/* the sidecar cache of decoded metadata; see sidecar.h */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "sidecar.h"
+#include "sum.h"
+
+#define SIDECAR_MAGIC "DSSC"
+#define SIDECAR_VERSION 1
+
+/* the file is this header, then the decoded FAT, the free bitmap, the
+   directories, their clusters and their links, each part starting on
+   an 8 byte boundary */
+struct sidecar_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t image_size;
+    int64_t mtime;
+    uint32_t meta_crc;		/* of the primary FAT and root directory */
+    uint32_t fat_entries;
+    uint32_t clusters;		/* first cluster past the data area */
+    uint32_t n_dirs;
+    uint32_t n_clusters;
+    uint32_t n_links;
+};
+
+/* where each part is, in bytes from the start of the file */
+struct sidecar_layout {
+    size_t fat, free, dirs, clusters, links, total;
+};
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+uint16_t *sidecar_fat = NULL;
+uint32_t sidecar_entries = 0;
+struct bpb33 *sidecar_bpb = NULL;
+
+static char *sc_path = NULL;		/* NULL unless DOS_IO_SIDECAR is set */
+static struct sidecar_header *sc_hdr = NULL;	/* the mapped file */
+static struct sidecar_layout sc_layout;
+static uint8_t *sc_free;		/* bit set for each free cluster */
+static int sc_stale = 0;		/* the image has been written to */
+static uint8_t *sc_image;
+static struct volume sc_volume;		/* a copy, as callers free theirs */
+static struct bpb33 *sc_bpb;		/* the BPB to rebuild it with */
+
+static void layout(struct sidecar_layout *l, struct sidecar_header *hdr)
+{
+    l->fat = ALIGN8(sizeof(struct sidecar_header));
+    l->free = l->fat + ALIGN8(hdr->fat_entries * sizeof(uint16_t));
+    l->dirs = l->free + ALIGN8((hdr->clusters + 7) / 8);
+    l->clusters = l->dirs + hdr->n_dirs * sizeof(struct sidecar_dir);
+    l->links = l->clusters + ALIGN8(hdr->n_clusters * sizeof(uint16_t));
+    l->total = l->links + ALIGN8(hdr->n_links * sizeof(uint32_t));
+}
+
+static uint32_t meta_crc(uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+    struct sum_state s;
+
+    sum_init(&s, 0);
+    sum_update(&s, image_buf + g->fat_offset, g->fat_bytes);
+    sum_update(&s, image_buf + g->root_offset,
+	       bpb->bpbRootDirEnts * sizeof(struct direntry));
+    return sum_crc(&s);
+}
+
+static void drop(void)
+{
+    if (sc_hdr != NULL)
+	munmap(sc_hdr, sc_layout.total);
+    sc_hdr = NULL;
+    sidecar_fat = NULL;
+    sidecar_entries = 0;
+    sidecar_bpb = NULL;
+}
+
+static void fill_index(struct sidecar_index *index)
+{
+    uint8_t *base = (uint8_t*)sc_hdr;
+
+    index->dirs = (struct sidecar_dir*)(base + sc_layout.dirs);
+    index->n_dirs = sc_hdr->n_dirs;
+    index->clusters = (uint16_t*)(base + sc_layout.clusters);
+    index->n_clusters = sc_hdr->n_clusters;
+    index->links = (uint32_t*)(base + sc_layout.links);
+    index->n_links = sc_hdr->n_links;
+}
+
+/* index_ok checks that everything in the directory index is in range,
+   so the tools can use it without checking */
+static int index_ok(void)
+{
+    struct sidecar_index ix;
+    uint32_t limit = sc_hdr->clusters, i;
+
+    fill_index(&ix);
+    if (ix.n_dirs < 1 || ix.n_dirs > limit + 1 || ix.n_clusters > limit
+	|| ix.n_links > limit)
+	return 0;
+    for (i = 0; i < ix.n_dirs; i++) {
+	struct sidecar_dir *di = &ix.dirs[i];
+	if (di->start >= limit || di->parent >= ix.n_dirs
+	    || (uint64_t)di->first + di->count > ix.n_clusters
+	    || (uint64_t)di->first_link + di->n_links > ix.n_links)
+	    return 0;
+    }
+    for (i = 0; i < ix.n_clusters; i++) {
+	if (ix.clusters[i] < CLUST_FIRST || ix.clusters[i] >= limit)
+	    return 0;
+    }
+    for (i = 0; i < ix.n_links; i++) {
+	if (ix.links[i] == 0 || ix.links[i] >= ix.n_dirs)
+	    return 0;
+    }
+    return 1;
+}
+
+/* sidecar_open maps the image's sidecar, if DOS_IO_SIDECAR is set and
+   there's one that matches the image's size and modification time.
+   Its contents aren't trusted until sidecar_attach has checked them
+   against the metadata. */
+void sidecar_open(char *image_path)
+{
+    struct stat image, st;
+    struct sidecar_header hdr;
+    char *env = getenv("DOS_IO_SIDECAR");
+    void *map;
+    int fd;
+
+    if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0)
+	return;
+    sc_path = malloc(strlen(image_path) + 5);
+    sprintf(sc_path, "%s.dsc", image_path);
+    sc_stale = 0;
+
+    fd = open(sc_path, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (stat(image_path, &image) < 0 || fstat(fd, &st) < 0
+	|| read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	|| memcmp(hdr.magic, SIDECAR_MAGIC, 4) != 0
+	|| hdr.version != SIDECAR_VERSION
+	|| hdr.image_size != (uint64_t)image.st_size
+	|| hdr.mtime != (int64_t)image.st_mtime) {
+	close(fd);
+	return;
+    }
+    layout(&sc_layout, &hdr);
+    if ((uint64_t)st.st_size != sc_layout.total) {
+	close(fd);
+	return;
+    }
+    /* private, so the decoded FAT can be kept up to date in memory
+       without touching the file */
+    map = mmap(NULL, sc_layout.total, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	       fd, 0);
+    close(fd);
+    if (map != MAP_FAILED)
+	sc_hdr = map;
+}
+
+/* sidecar_attach checks the sidecar against the volume check_bootsector
+   has just read, and if it matches makes get_fat_entry use it */
+void sidecar_attach(uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+
+    if (sc_path == NULL)
+	return;
+    sc_image = image_buf;
+    /* close_image rebuilds the sidecar with this, and some tools free
+       their BPB before closing the image */
+    sc_volume = *(struct volume*)bpb;
+    sc_bpb = &sc_volume.bpb;
+    if (sc_hdr == NULL)
+	return;
+    if (sc_hdr->fat_entries != g->fat_bytes * 2 / 3
+	|| sc_hdr->clusters != g->clusters
+	|| sc_hdr->meta_crc != meta_crc(image_buf, bpb) || !index_ok()) {
+	drop();
+	return;
+    }
+    sidecar_fat = (uint16_t*)((uint8_t*)sc_hdr + sc_layout.fat);
+    sidecar_entries = sc_hdr->fat_entries;
+    sc_free = (uint8_t*)sc_hdr + sc_layout.free;
+    sidecar_bpb = bpb;
+}
+
+/* sidecar_changed is told about every write to the image.  The first
+   one removes the sidecar file, since its directory index may no
+   longer be right; writes to the primary FAT are decoded into the
+   table, so it and the free bitmap stay current for the rest of the
+   run. */
+void sidecar_changed(uint8_t *addr, size_t len)
+{
+    struct geometry *g;
+    uint8_t *fat;
+    uint32_t lo, hi, n;
+
+    if (sc_path == NULL)
+	return;
+    if (!sc_stale) {
+	sc_stale = 1;
+	unlink(sc_path);
+    }
+    if (sidecar_fat == NULL)
+	return;
+    g = geometry(sidecar_bpb);
+    fat = sc_image + g->fat_offset;
+    if (addr + len <= fat || addr >= fat + g->fat_bytes)
+	return;
+    lo = addr < fat ? 0 : addr - fat;
+    hi = addr + len - fat;
+    if (hi > g->fat_bytes)
+	hi = g->fat_bytes;
+    /* entry n is in bytes 3n/2 and 3n/2 + 1 */
+    n = lo * 2 / 3;
+    if (n > 0)
+	n--;
+    for (; n < sidecar_entries && n * 3 / 2 < hi; n++) {
+	sidecar_fat[n] = get_fat_entry_n(n, 0, sc_image, sidecar_bpb);
+	if (n < CLUST_FIRST || n >= sc_hdr->clusters)
+	    continue;
+	if (sidecar_fat[n] == CLUST_FREE)
+	    sc_free[n / 8] |= 1 << (n % 8);
+	else
+	    sc_free[n / 8] &= ~(1 << (n % 8));
+    }
+}
+
+/* sidecar_next_free returns the first free cluster from from on, or 0
+   if there isn't one, skipping a byte of the bitmap at a time where
+   it's all in use */
+uint16_t sidecar_next_free(uint16_t from)
+{
+    uint32_t c = from < CLUST_FIRST ? CLUST_FIRST : from;
+    uint32_t limit = sc_hdr->clusters;
+
+    while (c < limit) {
+	if ((c & 7) == 0 && sc_free[c / 8] == 0) {
+	    c += 8;
+	    continue;
+	}
+	if (sc_free[c / 8] & (1 << (c % 8)))
+	    return c;
+	c++;
+    }
+    return 0;
+}
+
+/* sidecar_dirs fills in the directory index, returning 0 if there
+   isn't one or the image has changed since it was built */
+int sidecar_dirs(struct sidecar_index *index)
+{
+    if (sidecar_fat == NULL || sc_stale)
+	return 0;
+    fill_index(index);
+    return 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* building a new sidecar from the image */
+
+struct builder {
+    struct sidecar_index ix;
+    int32_t *dir_of;		/* directory starting at a cluster, -1 if
+				   none, -2 while it's queued */
+    int32_t *link_index;	/* chain index each link was found at */
+    uint16_t *heap;		/* start clusters still to be read */
+    int n_heap;
+    uint32_t limit;
+};
+
+static void heap_push(struct builder *b, uint16_t cluster)
+{
+    int i = b->n_heap++;
+
+    while (i > 0 && b->heap[(i - 1) / 2] > cluster) {
+	b->heap[i] = b->heap[(i - 1) / 2];
+	i = (i - 1) / 2;
+    }
+    b->heap[i] = cluster;
+}
+
+static uint16_t heap_pop(struct builder *b)
+{
+    uint16_t top = b->heap[0];
+    uint16_t last = b->heap[--b->n_heap];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < b->n_heap) {
+	if (child + 1 < b->n_heap && b->heap[child + 1] < b->heap[child])
+	    child++;
+	if (b->heap[child] >= last)
+	    break;
+	b->heap[i] = b->heap[child];
+	i = child;
+    }
+    b->heap[i] = last;
+    return top;
+}
+
+/* find_subdirs queues the subdirectories in some directory entries,
+   returning 1 if the directory's entries end among them */
+static int find_subdirs(struct builder *b, int32_t index,
+			struct direntry *dirent, int entries)
+{
+    uint16_t start;
+    int d;
+
+    for (d = 0; d < entries; d++, dirent++) {
+	if (dirent->deName[0] == SLOT_EMPTY)
+	    return 1;
+	if (dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.'
+	    || (dirent->deAttributes & ATTR_VOLUME) != 0
+	    || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	    continue;
+	start = getushort(dirent->deStartCluster);
+	if (start < CLUST_FIRST || start >= b->limit
+	    || b->dir_of[start] != -1)
+	    continue;
+	b->dir_of[start] = -2;
+	b->link_index[b->ix.n_links] = index;
+	b->ix.links[b->ix.n_links++] = start;
+	heap_push(b, start);
+    }
+    return 0;
+}
+
+/* build_index finds every directory and its chain, the same way
+   dos_scandisk does: a directory is read once, the smallest start
+   cluster first, and a chain stops at a cluster another directory has
+   already claimed */
+static void build_index(struct builder *b, uint8_t *image_buf,
+			struct bpb33* bpb)
+{
+    struct geometry *g = geometry(bpb);
+    struct sidecar_dir *di;
+    uint8_t *seen;
+    uint32_t c, l, found;
+
+    b->limit = g->clusters;
+    b->ix.dirs = malloc((b->limit + 1) * sizeof(struct sidecar_dir));
+    b->ix.clusters = malloc(b->limit * sizeof(uint16_t));
+    b->ix.links = malloc(b->limit * sizeof(uint32_t));
+    b->link_index = malloc(b->limit * sizeof(int32_t));
+    b->dir_of = malloc(b->limit * sizeof(int32_t));
+    b->heap = malloc(b->limit * sizeof(uint16_t));
+    seen = calloc(b->limit, 1);
+    for (c = 0; c < b->limit; c++)
+	b->dir_of[c] = -1;
+
+    di = &b->ix.dirs[0];
+    memset(di, 0, sizeof(*di));
+    di->index = -1;
+    find_subdirs(b, -1, (struct direntry*)root_dir_addr(image_buf, bpb),
+		 bpb->bpbRootDirEnts);
+    di->n_links = b->ix.n_links;
+    b->ix.n_dirs = 1;
+
+    while (b->n_heap > 0) {
+	uint16_t cluster = heap_pop(b);
+	int ended = 0;
+
+	di = &b->ix.dirs[b->ix.n_dirs];
+	memset(di, 0, sizeof(*di));
+	di->start = cluster;
+	di->first = b->ix.n_clusters;
+	di->first_link = b->ix.n_links;
+	b->dir_of[cluster] = b->ix.n_dirs;
+	while (cluster >= CLUST_FIRST && cluster < b->limit
+	       && seen[cluster] == 0) {
+	    seen[cluster] = 1;
+	    b->ix.clusters[b->ix.n_clusters++] = cluster;
+	    if (!ended) {
+		ended = find_subdirs(b, di->count, (struct direntry*)
+				     cluster_to_addr(cluster, image_buf, bpb),
+				     g->clust_bytes / sizeof(struct direntry));
+		if (ended)
+		    di->end = di->count;
+	    }
+	    di->count++;
+	    cluster = get_fat_entry_n(cluster, 0, image_buf, bpb);
+	}
+	if (!ended)
+	    di->end = di->count;
+	di->n_links = b->ix.n_links - di->first_link;
+	b->ix.n_dirs++;
+    }
+
+    /* the links were found as start clusters; every one of them has
+       been read by now, so turn them into directory numbers */
+    for (c = 0; c < b->ix.n_dirs; c++) {
+	di = &b->ix.dirs[c];
+	for (l = di->first_link; l < di->first_link + di->n_links; l++) {
+	    found = b->dir_of[b->ix.links[l]];
+	    b->ix.links[l] = found;
+	    b->ix.dirs[found].parent = c;
+	    b->ix.dirs[found].index = b->link_index[l];
+	}
+    }
+    free(seen);
+}
+
+/* put writes len bytes, padded with zeroes to an 8 byte boundary */
+static int put(FILE *f, void *p, size_t len)
+{
+    static uint8_t zeroes[8];
+
+    return fwrite(p, 1, len, f) == len
+	&& fwrite(zeroes, 1, ALIGN8(len) - len, f) == ALIGN8(len) - len;
+}
+
+/* write_sidecar builds a sidecar for the image as it is now, and
+   replaces the old one with it */
+static void write_sidecar(uint8_t *image_buf, struct bpb33* bpb,
+			  struct stat *image)
+{
+    struct geometry *g = geometry(bpb);
+    struct sidecar_header hdr;
+    struct builder b;
+    uint16_t *fat;
+    uint8_t *free_map;
+    char *tmp;
+    FILE *f;
+    uint32_t n;
+    int ok;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SIDECAR_MAGIC, 4);
+    hdr.version = SIDECAR_VERSION;
+    hdr.image_size = image->st_size;
+    hdr.mtime = image->st_mtime;
+    hdr.meta_crc = meta_crc(image_buf, bpb);
+    hdr.fat_entries = g->fat_bytes * 2 / 3;
+    hdr.clusters = g->clusters;
+
+    fat = malloc(hdr.fat_entries * sizeof(uint16_t));
+    free_map = calloc((hdr.clusters + 7) / 8, 1);
+    for (n = 0; n < hdr.fat_entries; n++) {
+	fat[n] = get_fat_entry_n(n, 0, image_buf, bpb);
+	if (n >= CLUST_FIRST && n < hdr.clusters && fat[n] == CLUST_FREE)
+	    free_map[n / 8] |= 1 << (n % 8);
+    }
+    memset(&b, 0, sizeof(b));
+    build_index(&b, image_buf, bpb);
+    hdr.n_dirs = b.ix.n_dirs;
+    hdr.n_clusters = b.ix.n_clusters;
+    hdr.n_links = b.ix.n_links;
+
+    /* written under another name and renamed, so a tool starting up
+       meanwhile never sees half a sidecar */
+    tmp = malloc(strlen(sc_path) + 5);
+    sprintf(tmp, "%s.tmp", sc_path);
+    f = fopen(tmp, "w");
+    if (f != NULL) {
+	ok = put(f, &hdr, sizeof(hdr))
+	    && put(f, fat, hdr.fat_entries * sizeof(uint16_t))
+	    && put(f, free_map, (hdr.clusters + 7) / 8)
+	    && put(f, b.ix.dirs, hdr.n_dirs * sizeof(struct sidecar_dir))
+	    && put(f, b.ix.clusters, hdr.n_clusters * sizeof(uint16_t))
+	    && put(f, b.ix.links, hdr.n_links * sizeof(uint32_t));
+	if (fclose(f) != 0 || !ok || rename(tmp, sc_path) < 0)
+	    unlink(tmp);
+    }
+
+    free(tmp);
+    free(fat);
+    free(free_map);
+    free(b.ix.dirs);
+    free(b.ix.clusters);
+    free(b.ix.links);
+    free(b.link_index);
+    free(b.dir_of);
+    free(b.heap);
+}
+
+/* sidecar_close is called by close_image once everything has been
+   written back.  If the sidecar was missing, didn't match or has gone
+   stale, a new one is made, so the next run starts warm. */
+void sidecar_close(uint8_t *image_buf, int fd)
+{
+    struct stat image;
+
+    if (sc_path == NULL)
+	return;
+    if ((sidecar_fat == NULL || sc_stale) && sc_bpb != NULL
+	&& sc_image == image_buf && fstat(fd, &image) == 0)
+	write_sidecar(image_buf, sc_bpb, &image);
+    drop();
+    free(sc_path);
+    sc_path = NULL;
+    sc_bpb = NULL;
+}
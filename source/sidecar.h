@@ -0,0 +1,51 @@
+/* the sidecar: an opt-in cache file next to the image, <image>.dsc,
+   holding what the tools would otherwise work out again on every run:
+   the decoded FAT, a bitmap of the free clusters and an index of the
+   directories and their chains.  Setting DOS_IO_SIDECAR turns it on
+   for images opened with open_image.
+
+   A sidecar is only used if the image's size and modification time
+   and a checksum of the primary FAT and root directory all match the
+   ones it was built from.  Writes to the primary FAT are decoded into
+   it as they're marked dirty; any write at all makes the directory
+   index stale and removes the file, and close_image writes a new one. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* a directory, numbered in the order they were found: the root
+   directory first, then the rest smallest start cluster first, as
+   dos_scandisk's discovery finds them */
+struct sidecar_dir {
+    uint32_t start;		/* 0 for the root directory */
+    uint32_t parent;
+    int32_t index;		/* where in the parent's chain it was found,
+				   or -1 for the root directory */
+    uint32_t first;		/* its clusters in the cluster list */
+    uint32_t count;
+    uint32_t end;		/* chain index of the cluster entries end in */
+    uint32_t first_link;	/* its subdirectories in the link list */
+    uint32_t n_links;
+};
+
+struct sidecar_index {
+    struct sidecar_dir *dirs;
+    uint32_t n_dirs;
+    uint16_t *clusters;		/* each directory's chain, in order */
+    uint32_t n_clusters;
+    uint32_t *links;		/* subdirectories, as directory numbers */
+    uint32_t n_links;
+};
+
+/* the decoded primary FAT of the volume with this BPB, if it has a
+   sidecar */
+extern uint16_t *sidecar_fat;
+extern uint32_t sidecar_entries;
+extern struct bpb33 *sidecar_bpb;
+
+void sidecar_open(char *image_path);
+void sidecar_attach(uint8_t *image_buf, struct bpb33* bpb);
+void sidecar_changed(uint8_t *addr, size_t len);
+uint16_t sidecar_next_free(uint16_t from);
+int sidecar_dirs(struct sidecar_index *index);
+void sidecar_close(uint8_t *image_buf, int fd);
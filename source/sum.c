@@ -0,0 +1,262 @@
+/* streaming checksums: CRC32C and XXH64 */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sum.h"
+
+#define CRC32C_POLY 0x82f63b78	/* reversed Castagnoli polynomial */
+
+#define P1 0x9e3779b185ebca87ULL
+#define P2 0xc2b2ae3d27d4eb4fULL
+#define P3 0x165667b19e3779f9ULL
+#define P4 0x85ebca77c2b2ae63ULL
+#define P5 0x27d4eb2f165667c5ULL
+
+/* ------------------------------------------------------------------ */
+/* CRC32C */
+
+/* slicing by eight: table[k][b] is the CRC of byte b followed by k
+   zero bytes, so eight bytes are folded in with eight lookups */
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static int crc_hw;
+
+static void crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+	c = i;
+	for (j = 0; j < 8; j++)
+	    c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+	crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+	c = crc_table[0][i];
+	for (j = 1; j < 8; j++) {
+	    c = (c >> 8) ^ crc_table[0][c & 0xff];
+	    crc_table[j][i] = c;
+	}
+    }
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc_hw = 1;
+#endif
+}
+
+static uint32_t crc_soft(uint32_t crc, uint8_t *p, size_t len)
+{
+    uint32_t lo, hi;
+
+    while (len >= 8) {
+	lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+	hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+	crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+	    ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+	    ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+	    ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hard(uint32_t crc, uint8_t *p, size_t len)
+{
+    uint64_t c = crc, w;
+
+    while (len >= 8) {
+	memcpy(&w, p, 8);
+	c = _mm_crc32_u64(c, w);
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+
+static uint32_t crc_hard(uint32_t crc, uint8_t *p, size_t len)
+{
+    uint64_t w;
+
+    while (len >= 8) {
+	memcpy(&w, p, 8);
+	crc = __crc32cd(crc, w);
+	p += 8;
+	len -= 8;
+    }
+    while (len-- > 0)
+	crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#else
+#define crc_hard crc_soft
+#endif
+
+/* sum_crc_engine says how the CRC is being computed */
+char *sum_crc_engine(void)
+{
+    pthread_once(&crc_once, crc_init);
+    return crc_hw ? "hardware" : "table";
+}
+
+/* ------------------------------------------------------------------ */
+/* XXH64 */
+
+static uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	| (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40
+	| (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+}
+
+static uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+    h ^= xxh_round(0, v);
+    return h * P1 + P4;
+}
+
+/* xxh_stripes consumes whole 32 byte stripes, returning how many bytes
+   it used */
+static size_t xxh_stripes(struct sum_state *s, uint8_t *p, size_t len)
+{
+    size_t done = 0;
+
+    while (len - done >= 32) {
+	s->v[0] = xxh_round(s->v[0], read64(p + done));
+	s->v[1] = xxh_round(s->v[1], read64(p + done + 8));
+	s->v[2] = xxh_round(s->v[2], read64(p + done + 16));
+	s->v[3] = xxh_round(s->v[3], read64(p + done + 24));
+	done += 32;
+    }
+    return done;
+}
+
+static void xxh_update(struct sum_state *s, uint8_t *p, size_t len)
+{
+    size_t n;
+
+    s->total += len;
+    if (s->buffered > 0) {
+	n = 32 - s->buffered;
+	if (n > len)
+	    n = len;
+	memcpy(s->buf + s->buffered, p, n);
+	s->buffered += n;
+	p += n;
+	len -= n;
+	if (s->buffered < 32)
+	    return;
+	xxh_stripes(s, s->buf, 32);
+	s->buffered = 0;
+    }
+    n = xxh_stripes(s, p, len);
+    memcpy(s->buf, p + n, len - n);
+    s->buffered = len - n;
+}
+
+/* ------------------------------------------------------------------ */
+
+void sum_init(struct sum_state *s, int hash64)
+{
+    pthread_once(&crc_once, crc_init);
+    s->crc = 0xffffffff;
+    s->hash64 = hash64;
+    s->v[0] = P1 + P2;
+    s->v[1] = P2;
+    s->v[2] = 0;
+    s->v[3] = -P1;
+    s->total = 0;
+    s->buffered = 0;
+}
+
+void sum_update(struct sum_state *s, uint8_t *p, size_t len)
+{
+    s->crc = crc_hw ? crc_hard(s->crc, p, len) : crc_soft(s->crc, p, len);
+    if (s->hash64)
+	xxh_update(s, p, len);
+}
+
+uint32_t sum_crc(struct sum_state *s)
+{
+    return ~s->crc;
+}
+
+/* sum_hash64 finishes the 64-bit hash of everything so far, without
+   changing the state */
+uint64_t sum_hash64(struct sum_state *s)
+{
+    uint64_t h;
+    uint8_t *p = s->buf;
+    int left = s->buffered;
+
+    if (s->total >= 32) {
+	h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12)
+	    + rotl(s->v[3], 18);
+	h = xxh_merge(h, s->v[0]);
+	h = xxh_merge(h, s->v[1]);
+	h = xxh_merge(h, s->v[2]);
+	h = xxh_merge(h, s->v[3]);
+    } else {
+	h = P5;
+    }
+    h += s->total;
+    for (; left >= 8; p += 8, left -= 8) {
+	h ^= xxh_round(0, read64(p));
+	h = rotl(h, 27) * P1 + P4;
+    }
+    if (left >= 4) {
+	h ^= (uint64_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24)
+	    * P1;
+	h = rotl(h, 23) * P2 + P3;
+	p += 4;
+	left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+	h ^= *p * P5;
+	h = rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* sum_manifest_line prints a file's checksums in the form dos_cp -m
+   uses: CRC, 64-bit hash if there is one, size, first cluster, path.
+   The path comes last as it may have spaces in it. */
+void sum_manifest_line(FILE *f, struct sum_state *s, char *path,
+		       uint32_t size, uint16_t cluster)
+{
+    if (s->hash64)
+	fprintf(f, "%08x %016llx %10u %5u %s\n", sum_crc(s),
+		(unsigned long long)sum_hash64(s), size, cluster, path);
+    else
+	fprintf(f, "%08x %10u %5u %s\n", sum_crc(s), size, cluster, path);
+}
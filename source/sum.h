@@ -0,0 +1,26 @@
+/* checksums computed as data streams past, so that copying a file and
+   checksumming it take one read.  CRC32C is always computed, using the
+   CPU's instruction for it where there is one; the 64-bit hash
+   (XXH64) is optional, for when 32 bits isn't enough to tell files
+   apart. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct sum_state {
+    uint32_t crc;
+    int hash64;			/* computing the 64-bit hash too */
+    uint64_t v[4];		/* XXH64 accumulators */
+    uint64_t total;
+    uint8_t buf[32];		/* XXH64 input not yet a whole stripe */
+    int buffered;
+};
+
+void sum_init(struct sum_state *s, int hash64);
+void sum_update(struct sum_state *s, uint8_t *p, size_t len);
+uint32_t sum_crc(struct sum_state *s);
+uint64_t sum_hash64(struct sum_state *s);
+char *sum_crc_engine(void);
+void sum_manifest_line(FILE *f, struct sum_state *s, char *path,
+		       uint32_t size, uint16_t cluster);